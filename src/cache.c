@@ -0,0 +1,283 @@
+/*
+ * cache.c
+ * Host side cache of device app inventories
+ *
+ *
+ * Copyright (C) 2026 ideviceinstaller contributors
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#ifdef WIN32
+#include <direct.h>
+#define cache_mkdir(path) mkdir(path)
+#else
+#define cache_mkdir(path) mkdir(path, 0700)
+#endif
+
+#include "cache.h"
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+static uint64_t fnv1a(uint64_t hash, const char *data, size_t length)
+{
+	size_t i;
+	for (i = 0; i < length; i++) {
+		hash ^= (unsigned char)data[i];
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
+static char* cache_dir(void)
+{
+	const char *base = getenv("XDG_CACHE_HOME");
+	const char *sub = "/ideviceinstaller";
+	char *dir = NULL;
+
+	if (!base || !*base) {
+#ifdef WIN32
+		base = getenv("LOCALAPPDATA");
+#else
+		base = getenv("HOME");
+		sub = "/.cache/ideviceinstaller";
+#endif
+	}
+	if (!base || !*base) {
+		return NULL;
+	}
+	dir = malloc(strlen(base) + strlen(sub) + 1);
+	if (dir) {
+		strcpy(dir, base);
+		strcat(dir, sub);
+	}
+	return dir;
+}
+
+static int mkdir_with_parents(char *dir)
+{
+	struct stat st;
+	char *p = dir;
+
+	while ((p = strchr(p + 1, '/'))) {
+		*p = '\0';
+		if (stat(dir, &st) != 0) {
+			cache_mkdir(dir);
+		}
+		*p = '/';
+	}
+	if (stat(dir, &st) != 0 && cache_mkdir(dir) != 0) {
+		return -1;
+	}
+	return 0;
+}
+
+char* inventory_cache_path(const char *udid, plist_t client_opts)
+{
+	char *dir = NULL;
+	char *xml = NULL;
+	uint32_t xml_len = 0;
+	char *path = NULL;
+	size_t size;
+
+	if (!udid || strchr(udid, '/')) {
+		return NULL;
+	}
+	dir = cache_dir();
+	if (!dir) {
+		return NULL;
+	}
+	if (client_opts) {
+		plist_to_xml(client_opts, &xml, &xml_len);
+	}
+	size = strlen(dir) + strlen(udid) + 32;
+	path = malloc(size);
+	if (path) {
+		snprintf(path, size, "%s/%s-%016" PRIx64 ".plist", dir, udid, fnv1a(FNV_OFFSET_BASIS, (xml) ? xml : "", xml_len));
+	}
+	free(xml);
+	free(dir);
+
+	return path;
+}
+
+plist_t inventory_cache_load(const char *path, char **signature, uint64_t *age)
+{
+	plist_t root = NULL;
+	plist_t apps = NULL;
+	const char *sig = NULL;
+	uint64_t timestamp = 0;
+	uint64_t now = (uint64_t)time(NULL);
+
+	if (plist_read_from_file(path, &root, NULL) != PLIST_ERR_SUCCESS) {
+		return NULL;
+	}
+	if (plist_get_node_type(root) == PLIST_DICT) {
+		apps = plist_dict_get_item(root, "Apps");
+		sig = plist_get_string_ptr(plist_dict_get_item(root, "Signature"), NULL);
+		timestamp = plist_dict_get_uint(root, "Timestamp");
+	}
+	if (plist_get_node_type(apps) != PLIST_ARRAY || !sig) {
+		plist_free(root);
+		return NULL;
+	}
+
+	apps = plist_copy(apps);
+	*signature = strdup(sig);
+	*age = (now > timestamp) ? now - timestamp : 0;
+	plist_free(root);
+
+	return apps;
+}
+
+int inventory_cache_save(const char *path, plist_t apps, const char *signature)
+{
+	plist_t root = NULL;
+	char *tmp = NULL;
+	char *slash = NULL;
+	int res = -1;
+
+	tmp = malloc(strlen(path) + 5);
+	if (!tmp) {
+		return -1;
+	}
+	strcpy(tmp, path);
+	slash = strrchr(tmp, '/');
+	if (slash) {
+		*slash = '\0';
+		mkdir_with_parents(tmp);
+	}
+	strcpy(tmp, path);
+	strcat(tmp, ".tmp");
+
+	root = plist_new_dict();
+	plist_dict_set_item(root, "Timestamp", plist_new_uint((uint64_t)time(NULL)));
+	plist_dict_set_item(root, "Signature", plist_new_string(signature));
+	plist_dict_set_item(root, "Apps", plist_copy(apps));
+
+	if (plist_write_to_file(root, tmp, PLIST_FORMAT_BINARY, PLIST_OPT_NONE) == PLIST_ERR_SUCCESS) {
+#ifdef WIN32
+		remove(path);
+#endif
+		if (rename(tmp, path) == 0) {
+			res = 0;
+		} else {
+			remove(tmp);
+		}
+	}
+	plist_free(root);
+	free(tmp);
+
+	return res;
+}
+
+void inventory_cache_invalidate(const char *udid)
+{
+	char *dir = NULL;
+	DIR *dirp = NULL;
+	struct dirent *ep = NULL;
+	size_t udid_len;
+
+	if (!udid) {
+		return;
+	}
+	dir = cache_dir();
+	if (!dir) {
+		return;
+	}
+	dirp = opendir(dir);
+	if (!dirp) {
+		free(dir);
+		return;
+	}
+	udid_len = strlen(udid);
+	while ((ep = readdir(dirp))) {
+		if (strncmp(ep->d_name, udid, udid_len) != 0 || ep->d_name[udid_len] != '-') {
+			continue;
+		}
+		size_t size = strlen(dir) + strlen(ep->d_name) + 2;
+		char *path = malloc(size);
+		if (path) {
+			snprintf(path, size, "%s/%s", dir, ep->d_name);
+			remove(path);
+			free(path);
+		}
+	}
+	closedir(dirp);
+	free(dir);
+}
+
+static int compare_strings(const void *a, const void *b)
+{
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+char* inventory_signature(plist_t apps)
+{
+	uint32_t count = plist_array_get_size(apps);
+	char **entries = NULL;
+	uint32_t num_entries = 0;
+	uint64_t hash = FNV_OFFSET_BASIS;
+	char *signature = NULL;
+	uint32_t i;
+
+	entries = calloc((count) ? count : 1, sizeof(char*));
+	if (!entries) {
+		return NULL;
+	}
+	for (i = 0; i < count; i++) {
+		plist_t app = plist_array_get_item(apps, i);
+		const char *bundle_id = plist_get_string_ptr(plist_dict_get_item(app, "CFBundleIdentifier"), NULL);
+		const char *version = plist_get_string_ptr(plist_dict_get_item(app, "CFBundleVersion"), NULL);
+		if (!bundle_id) {
+			continue;
+		}
+		if (!version) {
+			version = "";
+		}
+		size_t size = strlen(bundle_id) + strlen(version) + 2;
+		entries[num_entries] = malloc(size);
+		if (entries[num_entries]) {
+			snprintf(entries[num_entries], size, "%s\n%s", bundle_id, version);
+			num_entries++;
+		}
+	}
+
+	qsort(entries, num_entries, sizeof(char*), compare_strings);
+	for (i = 0; i < num_entries; i++) {
+		hash = fnv1a(hash, entries[i], strlen(entries[i]) + 1);
+		free(entries[i]);
+	}
+	free(entries);
+
+	signature = malloc(32);
+	if (signature) {
+		snprintf(signature, 32, "%u-%016" PRIx64, num_entries, hash);
+	}
+	return signature;
+}
@@ -0,0 +1,52 @@
+/*
+ * cache.h
+ * Host side cache of device app inventories
+ *
+ *
+ * Copyright (C) 2026 ideviceinstaller contributors
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifndef __CACHE_H
+#define __CACHE_H
+
+#include <stdint.h>
+#include <plist/plist.h>
+
+/* Returns the path of the cache file holding the app list of the device
+ * with the given UDID as browsed with client_opts, or NULL. The options are
+ * part of the file name so each attribute set is cached separately. */
+char* inventory_cache_path(const char *udid, plist_t client_opts);
+
+/* Loads a cached app list. On success returns the apps array and sets
+ * signature (to be freed by the caller) and age, the number of seconds
+ * since the list was last known to be current. Returns NULL otherwise. */
+plist_t inventory_cache_load(const char *path, char **signature, uint64_t *age);
+
+/* Writes apps with the given signature and the current time to path,
+ * replacing any previous version atomically. Returns 0 on success. */
+int inventory_cache_save(const char *path, plist_t apps, const char *signature);
+
+/* Removes all cached app lists of the device with the given UDID. */
+void inventory_cache_invalidate(const char *udid);
+
+/* Returns a string identifying the set of CFBundleIdentifier and
+ * CFBundleVersion pairs in apps, independent of their order. */
+char* inventory_signature(plist_t apps);
+
+#endif
@@ -0,0 +1,291 @@
+/*
+ * diff.c
+ * Comparison of app inventories
+ *
+ *
+ * Copyright (C) 2026 ideviceinstaller contributors
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "diff.h"
+
+struct inventory_entry {
+	char *bundle_id;
+	char *version;           /* for display */
+	char *short_version;     /* CFBundleShortVersionString or NULL */
+	char *build;             /* CFBundleVersion or NULL */
+	uint32_t hash;
+};
+
+struct inventory_index {
+	struct inventory_entry *entries;
+	uint32_t num_entries;
+	uint32_t capacity;
+	/* open addressing table of entry index + 1, 0 for empty slots */
+	uint32_t *slots;
+	uint32_t num_slots;
+};
+
+struct inventory_diff {
+	const struct inventory_index *base;
+	uint8_t *seen;
+	inventory_diff_cb_t cb;
+	void *user_data;
+};
+
+static uint32_t hash_string(const char *str)
+{
+	uint32_t hash = 2166136261U;
+	for (; *str; str++) {
+		hash = (hash ^ (unsigned char)*str) * 16777619U;
+	}
+	return hash;
+}
+
+/* Returns the version of app as "short (build)", or whichever of the two
+ * exists, to be freed by the caller */
+static char* app_version(plist_t app)
+{
+	const char *short_version = plist_get_string_ptr(plist_dict_get_item(app, "CFBundleShortVersionString"), NULL);
+	const char *build = plist_get_string_ptr(plist_dict_get_item(app, "CFBundleVersion"), NULL);
+	char *version = NULL;
+
+	if (short_version && build && strcmp(short_version, build) != 0) {
+		size_t size = strlen(short_version) + strlen(build) + 4;
+		version = malloc(size);
+		if (version) {
+			snprintf(version, size, "%s (%s)", short_version, build);
+		}
+		return version;
+	}
+	if (short_version) {
+		return strdup(short_version);
+	}
+	return strdup((build) ? build : "");
+}
+
+static char* strdup_or_null(const char *str)
+{
+	return (str) ? strdup(str) : NULL;
+}
+
+static void entry_set_version(struct inventory_entry *entry, plist_t app)
+{
+	free(entry->version);
+	free(entry->short_version);
+	free(entry->build);
+	entry->version = app_version(app);
+	entry->short_version = strdup_or_null(plist_get_string_ptr(plist_dict_get_item(app, "CFBundleShortVersionString"), NULL));
+	entry->build = strdup_or_null(plist_get_string_ptr(plist_dict_get_item(app, "CFBundleVersion"), NULL));
+}
+
+/* Compares only the version keys present on both sides, so a listing
+ * that lacks one of them (e.g. list -a CFBundleShortVersionString) does
+ * not make every app look changed. */
+static int entry_version_differs(const struct inventory_entry *entry, plist_t app)
+{
+	const char *short_version = plist_get_string_ptr(plist_dict_get_item(app, "CFBundleShortVersionString"), NULL);
+	const char *build = plist_get_string_ptr(plist_dict_get_item(app, "CFBundleVersion"), NULL);
+
+	if (entry->short_version && short_version && strcmp(entry->short_version, short_version) != 0) {
+		return 1;
+	}
+	if (entry->build && build && strcmp(entry->build, build) != 0) {
+		return 1;
+	}
+	return 0;
+}
+
+static int64_t index_find(const struct inventory_index *index, const char *bundle_id, uint32_t hash)
+{
+	uint32_t mask = index->num_slots - 1;
+	uint32_t i;
+
+	if (index->num_slots == 0) {
+		return -1;
+	}
+	for (i = hash & mask; index->slots[i]; i = (i + 1) & mask) {
+		const struct inventory_entry *entry = &index->entries[index->slots[i] - 1];
+		if (entry->hash == hash && !strcmp(entry->bundle_id, bundle_id)) {
+			return index->slots[i] - 1;
+		}
+	}
+	return -1;
+}
+
+static int index_grow(struct inventory_index *index)
+{
+	uint32_t num_slots = (index->num_slots) ? index->num_slots * 2 : 256;
+	uint32_t *slots = calloc(num_slots, sizeof(uint32_t));
+	uint32_t i;
+
+	if (!slots) {
+		return -1;
+	}
+	for (i = 0; i < index->num_entries; i++) {
+		uint32_t j = index->entries[i].hash & (num_slots - 1);
+		while (slots[j]) {
+			j = (j + 1) & (num_slots - 1);
+		}
+		slots[j] = i + 1;
+	}
+	free(index->slots);
+	index->slots = slots;
+	index->num_slots = num_slots;
+	return 0;
+}
+
+struct inventory_index* inventory_index_new(void)
+{
+	return calloc(1, sizeof(struct inventory_index));
+}
+
+void inventory_index_add(struct inventory_index *index, plist_t app)
+{
+	const char *bundle_id = plist_get_string_ptr(plist_dict_get_item(app, "CFBundleIdentifier"), NULL);
+	struct inventory_entry *entry = NULL;
+	uint32_t hash;
+	int64_t found;
+
+	if (!bundle_id) {
+		return;
+	}
+	hash = hash_string(bundle_id);
+	found = index_find(index, bundle_id, hash);
+	if (found >= 0) {
+		entry_set_version(&index->entries[found], app);
+		return;
+	}
+
+	/* keep the load factor below 3/4 */
+	if ((index->num_entries + 1) * 4 > index->num_slots * 3 && index_grow(index) < 0) {
+		return;
+	}
+	if (index->num_entries == index->capacity) {
+		uint32_t capacity = (index->capacity) ? index->capacity * 2 : 256;
+		struct inventory_entry *entries = realloc(index->entries, capacity * sizeof(struct inventory_entry));
+		if (!entries) {
+			return;
+		}
+		index->entries = entries;
+		index->capacity = capacity;
+	}
+	entry = &index->entries[index->num_entries];
+	memset(entry, '\0', sizeof(struct inventory_entry));
+	entry->bundle_id = strdup(bundle_id);
+	entry_set_version(entry, app);
+	entry->hash = hash;
+	index->num_entries++;
+
+	uint32_t i = hash & (index->num_slots - 1);
+	while (index->slots[i]) {
+		i = (i + 1) & (index->num_slots - 1);
+	}
+	index->slots[i] = index->num_entries;
+}
+
+uint32_t inventory_index_size(const struct inventory_index *index)
+{
+	return (index) ? index->num_entries : 0;
+}
+
+void inventory_index_free(struct inventory_index *index)
+{
+	uint32_t i;
+
+	if (!index) {
+		return;
+	}
+	for (i = 0; i < index->num_entries; i++) {
+		free(index->entries[i].bundle_id);
+		free(index->entries[i].version);
+		free(index->entries[i].short_version);
+		free(index->entries[i].build);
+	}
+	free(index->entries);
+	free(index->slots);
+	free(index);
+}
+
+struct inventory_diff* inventory_diff_new(const struct inventory_index *base, inventory_diff_cb_t cb, void *user_data)
+{
+	struct inventory_diff *diff = calloc(1, sizeof(struct inventory_diff));
+	if (!diff) {
+		return NULL;
+	}
+	diff->seen = calloc((base->num_entries) ? base->num_entries : 1, sizeof(uint8_t));
+	if (!diff->seen) {
+		free(diff);
+		return NULL;
+	}
+	diff->base = base;
+	diff->cb = cb;
+	diff->user_data = user_data;
+	return diff;
+}
+
+void inventory_diff_add(struct inventory_diff *diff, plist_t app)
+{
+	const char *bundle_id = plist_get_string_ptr(plist_dict_get_item(app, "CFBundleIdentifier"), NULL);
+	char *version = NULL;
+	int64_t found;
+
+	if (!bundle_id) {
+		return;
+	}
+	found = index_find(diff->base, bundle_id, hash_string(bundle_id));
+	version = app_version(app);
+	if (found < 0) {
+		diff->cb(INVENTORY_ADDED, bundle_id, NULL, version, diff->user_data);
+	} else {
+		const struct inventory_entry *entry = &diff->base->entries[found];
+		diff->seen[found] = 1;
+		if (version && entry_version_differs(entry, app)) {
+			diff->cb(INVENTORY_CHANGED, bundle_id, entry->version, version, diff->user_data);
+		}
+	}
+	free(version);
+}
+
+void inventory_diff_finish(struct inventory_diff *diff)
+{
+	uint32_t i;
+
+	for (i = 0; i < diff->base->num_entries; i++) {
+		if (!diff->seen[i]) {
+			const struct inventory_entry *entry = &diff->base->entries[i];
+			diff->cb(INVENTORY_REMOVED, entry->bundle_id, entry->version, NULL, diff->user_data);
+		}
+	}
+}
+
+void inventory_diff_free(struct inventory_diff *diff)
+{
+	if (!diff) {
+		return;
+	}
+	free(diff->seen);
+	free(diff);
+}
@@ -0,0 +1,73 @@
+/*
+ * diff.h
+ * Comparison of app inventories
+ *
+ *
+ * Copyright (C) 2026 ideviceinstaller contributors
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifndef __DIFF_H
+#define __DIFF_H
+
+#include <stdint.h>
+#include <plist/plist.h>
+
+/* Hash index of an app inventory by CFBundleIdentifier, holding the
+ * version of every app. */
+struct inventory_index;
+
+enum inventory_change {
+	INVENTORY_ADDED,
+	INVENTORY_REMOVED,
+	INVENTORY_CHANGED
+};
+
+/* Called for every difference. old_version is NULL for added apps and
+ * new_version is NULL for removed ones. */
+typedef void (*inventory_diff_cb_t)(enum inventory_change change, const char *bundle_id, const char *old_version, const char *new_version, void *user_data);
+
+/* Compares apps added one by one against an index without storing them. */
+struct inventory_diff;
+
+struct inventory_index* inventory_index_new(void);
+
+/* Adds the app record app, later records replace earlier ones with the
+ * same CFBundleIdentifier. Records without it are ignored. */
+void inventory_index_add(struct inventory_index *index, plist_t app);
+
+uint32_t inventory_index_size(const struct inventory_index *index);
+
+void inventory_index_free(struct inventory_index *index);
+
+/* Creates a comparison against base, which must not be modified while the
+ * comparison is in use. Any number of comparisons can use the same base
+ * concurrently. */
+struct inventory_diff* inventory_diff_new(const struct inventory_index *base, inventory_diff_cb_t cb, void *user_data);
+
+/* Reports app if it was added or its version changed compared to base.
+ * Only CFBundleShortVersionString and CFBundleVersion present in both
+ * records are compared. */
+void inventory_diff_add(struct inventory_diff *diff, plist_t app);
+
+/* Reports the apps of base that were not added to the comparison. */
+void inventory_diff_finish(struct inventory_diff *diff);
+
+void inventory_diff_free(struct inventory_diff *diff);
+
+#endif
@@ -0,0 +1,435 @@
+/*
+ * filter.c
+ * Filter expressions over app attributes
+ *
+ *
+ * Copyright (C) 2026 ideviceinstaller contributors
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <inttypes.h>
+
+#include "filter.h"
+#include "utils.h"
+
+enum filter_node_type {
+	FILTER_NODE_AND,
+	FILTER_NODE_OR,
+	FILTER_NODE_NOT,
+	FILTER_NODE_PRESENT,
+	FILTER_NODE_COMPARE
+};
+
+enum filter_op {
+	FILTER_OP_EQ,
+	FILTER_OP_NE,
+	FILTER_OP_LT,
+	FILTER_OP_LE,
+	FILTER_OP_GT,
+	FILTER_OP_GE
+};
+
+struct filter {
+	enum filter_node_type type;
+	struct filter *left;
+	struct filter *right;
+	char *key;
+	enum filter_op op;
+	char *value;
+	int value_is_number;
+	uint64_t number;
+};
+
+struct filter_parser {
+	const char *expr;
+	const char *p;
+	char *error;
+};
+
+static const struct {
+	const char *token;
+	enum filter_op op;
+} filter_ops[] = {
+	{ "==", FILTER_OP_EQ }, { "!=", FILTER_OP_NE }, { "<=", FILTER_OP_LE }, { ">=", FILTER_OP_GE },
+	{ "=", FILTER_OP_EQ }, { "<", FILTER_OP_LT }, { ">", FILTER_OP_GT }
+};
+
+static void parser_error(struct filter_parser *parser, const char *msg)
+{
+	if (parser->error) {
+		return;
+	}
+	parser->error = malloc(strlen(msg) + 32);
+	if (parser->error) {
+		sprintf(parser->error, "%s at position %d", msg, (int)(parser->p - parser->expr) + 1);
+	}
+}
+
+static void skip_whitespace(struct filter_parser *parser)
+{
+	while (isspace((unsigned char)*parser->p)) {
+		parser->p++;
+	}
+}
+
+static struct filter* filter_node_new(enum filter_node_type type, struct filter *left, struct filter *right)
+{
+	struct filter *node = calloc(1, sizeof(struct filter));
+	if (!node) {
+		filter_free(left);
+		filter_free(right);
+		return NULL;
+	}
+	node->type = type;
+	node->left = left;
+	node->right = right;
+	return node;
+}
+
+static struct filter* parse_or(struct filter_parser *parser);
+
+static char* parse_value(struct filter_parser *parser)
+{
+	const char *start = parser->p;
+	char *value = NULL;
+	size_t len;
+
+	if (*start == '"' || *start == '\'') {
+		const char *end = strchr(start + 1, *start);
+		if (!end) {
+			parser_error(parser, "Unterminated string");
+			return NULL;
+		}
+		len = end - (start + 1);
+		start++;
+		parser->p = end + 1;
+	} else {
+		const char *end = start;
+		while (*end && !isspace((unsigned char)*end) && !strchr("()&|!<>=", *end)) {
+			end++;
+		}
+		if (end == start) {
+			parser_error(parser, "Expected value");
+			return NULL;
+		}
+		len = end - start;
+		parser->p = end;
+	}
+	value = malloc(len + 1);
+	if (value) {
+		memcpy(value, start, len);
+		value[len] = '\0';
+	}
+	return value;
+}
+
+static struct filter* parse_comparison(struct filter_parser *parser)
+{
+	const char *start = parser->p;
+	struct filter *node = NULL;
+	unsigned int i;
+
+	while (isalnum((unsigned char)*parser->p) || *parser->p == '_') {
+		parser->p++;
+	}
+	if (parser->p == start) {
+		parser_error(parser, (*parser->p) ? "Expected attribute" : "Unexpected end of expression");
+		return NULL;
+	}
+	node = filter_node_new(FILTER_NODE_PRESENT, NULL, NULL);
+	if (!node) {
+		return NULL;
+	}
+	node->key = malloc(parser->p - start + 1);
+	if (!node->key) {
+		filter_free(node);
+		return NULL;
+	}
+	memcpy(node->key, start, parser->p - start);
+	node->key[parser->p - start] = '\0';
+
+	skip_whitespace(parser);
+	for (i = 0; i < sizeof(filter_ops) / sizeof(filter_ops[0]); i++) {
+		size_t len = strlen(filter_ops[i].token);
+		if (!strncmp(parser->p, filter_ops[i].token, len)) {
+			parser->p += len;
+			break;
+		}
+	}
+	if (i == sizeof(filter_ops) / sizeof(filter_ops[0])) {
+		return node;
+	}
+
+	node->type = FILTER_NODE_COMPARE;
+	node->op = filter_ops[i].op;
+	skip_whitespace(parser);
+	node->value = parse_value(parser);
+	if (!node->value) {
+		filter_free(node);
+		return NULL;
+	}
+	if (isdigit((unsigned char)node->value[0])) {
+		char *end = NULL;
+		node->number = strtoull(node->value, &end, 10);
+		node->value_is_number = (*end == '\0');
+	}
+
+	return node;
+}
+
+static struct filter* parse_unary(struct filter_parser *parser)
+{
+	struct filter *node = NULL;
+
+	skip_whitespace(parser);
+	if (*parser->p == '!') {
+		parser->p++;
+		node = parse_unary(parser);
+		if (!node) {
+			return NULL;
+		}
+		return filter_node_new(FILTER_NODE_NOT, node, NULL);
+	}
+	if (*parser->p == '(') {
+		parser->p++;
+		node = parse_or(parser);
+		if (!node) {
+			return NULL;
+		}
+		skip_whitespace(parser);
+		if (*parser->p != ')') {
+			parser_error(parser, "Expected ')'");
+			filter_free(node);
+			return NULL;
+		}
+		parser->p++;
+		return node;
+	}
+	return parse_comparison(parser);
+}
+
+static struct filter* parse_and(struct filter_parser *parser)
+{
+	struct filter *node = parse_unary(parser);
+
+	while (node) {
+		skip_whitespace(parser);
+		if (strncmp(parser->p, "&&", 2) != 0) {
+			break;
+		}
+		parser->p += 2;
+		struct filter *right = parse_unary(parser);
+		if (!right) {
+			filter_free(node);
+			return NULL;
+		}
+		node = filter_node_new(FILTER_NODE_AND, node, right);
+	}
+	return node;
+}
+
+static struct filter* parse_or(struct filter_parser *parser)
+{
+	struct filter *node = parse_and(parser);
+
+	while (node) {
+		skip_whitespace(parser);
+		if (strncmp(parser->p, "||", 2) != 0) {
+			break;
+		}
+		parser->p += 2;
+		struct filter *right = parse_and(parser);
+		if (!right) {
+			filter_free(node);
+			return NULL;
+		}
+		node = filter_node_new(FILTER_NODE_OR, node, right);
+	}
+	return node;
+}
+
+struct filter* filter_compile(const char *expr, char **error)
+{
+	struct filter_parser parser;
+	struct filter *filter = NULL;
+
+	parser.expr = expr;
+	parser.p = expr;
+	parser.error = NULL;
+
+	filter = parse_or(&parser);
+	if (filter) {
+		skip_whitespace(&parser);
+		if (*parser.p) {
+			parser_error(&parser, "Unexpected input");
+			filter_free(filter);
+			filter = NULL;
+		}
+	} else if (!parser.error) {
+		parser.error = strdup("Out of memory");
+	}
+	if (error) {
+		*error = parser.error;
+	} else {
+		free(parser.error);
+	}
+
+	return filter;
+}
+
+static int filter_op_result(enum filter_op op, int cmp)
+{
+	switch (op) {
+		case FILTER_OP_EQ:
+			return cmp == 0;
+		case FILTER_OP_NE:
+			return cmp != 0;
+		case FILTER_OP_LT:
+			return cmp < 0;
+		case FILTER_OP_LE:
+			return cmp <= 0;
+		case FILTER_OP_GT:
+			return cmp > 0;
+		case FILTER_OP_GE:
+			return cmp >= 0;
+		default:
+			return 0;
+	}
+}
+
+static int filter_compare(const struct filter *filter, plist_t node)
+{
+	char numbuf[32];
+	const char *str = NULL;
+	uint64_t uval = 0;
+	int cmp;
+
+	switch (plist_get_node_type(node)) {
+		case PLIST_INT:
+			plist_get_uint_val(node, &uval);
+			if (filter->value_is_number) {
+				return filter_op_result(filter->op, (uval < filter->number) ? -1 : (uval > filter->number));
+			}
+			snprintf(numbuf, sizeof(numbuf), "%" PRIu64, uval);
+			str = numbuf;
+			break;
+		case PLIST_BOOLEAN:
+			str = plist_bool_val_is_true(node) ? "true" : "false";
+			break;
+		case PLIST_STRING:
+			str = plist_get_string_ptr(node, NULL);
+			break;
+		default:
+			break;
+	}
+	if (!str) {
+		return (filter->op == FILTER_OP_NE);
+	}
+
+	switch (filter->op) {
+		case FILTER_OP_EQ:
+			return glob_match(filter->value, str);
+		case FILTER_OP_NE:
+			return !glob_match(filter->value, str);
+		default:
+			break;
+	}
+	if (isdigit((unsigned char)str[0]) && isdigit((unsigned char)filter->value[0])) {
+		cmp = version_compare(str, filter->value);
+	} else {
+		cmp = strcmp(str, filter->value);
+	}
+	return filter_op_result(filter->op, cmp);
+}
+
+int filter_match(const struct filter *filter, plist_t dict)
+{
+	plist_t node = NULL;
+	uint64_t uval = 0;
+
+	switch (filter->type) {
+		case FILTER_NODE_AND:
+			return filter_match(filter->left, dict) && filter_match(filter->right, dict);
+		case FILTER_NODE_OR:
+			return filter_match(filter->left, dict) || filter_match(filter->right, dict);
+		case FILTER_NODE_NOT:
+			return !filter_match(filter->left, dict);
+		case FILTER_NODE_PRESENT:
+			node = plist_dict_get_item(dict, filter->key);
+			switch (plist_get_node_type(node)) {
+				case PLIST_NONE:
+					return 0;
+				case PLIST_BOOLEAN:
+					return plist_bool_val_is_true(node);
+				case PLIST_INT:
+					plist_get_uint_val(node, &uval);
+					return uval != 0;
+				case PLIST_STRING:
+					return *plist_get_string_ptr(node, NULL) != '\0';
+				default:
+					return 1;
+			}
+		case FILTER_NODE_COMPARE:
+			node = plist_dict_get_item(dict, filter->key);
+			if (!node) {
+				return (filter->op == FILTER_OP_NE);
+			}
+			return filter_compare(filter, node);
+		default:
+			return 0;
+	}
+}
+
+int filter_add_attributes(const struct filter *filter, plist_t attrs)
+{
+	uint32_t i;
+
+	if (!filter) {
+		return 0;
+	}
+	if (filter->key) {
+		for (i = 0; i < plist_array_get_size(attrs); i++) {
+			const char *attr = plist_get_string_ptr(plist_array_get_item(attrs, i), NULL);
+			if (attr && !strcmp(attr, filter->key)) {
+				return 0;
+			}
+		}
+		plist_array_append_item(attrs, plist_new_string(filter->key));
+		return 1;
+	}
+	return filter_add_attributes(filter->left, attrs) + filter_add_attributes(filter->right, attrs);
+}
+
+void filter_free(struct filter *filter)
+{
+	if (!filter) {
+		return;
+	}
+	filter_free(filter->left);
+	filter_free(filter->right);
+	free(filter->key);
+	free(filter->value);
+	free(filter);
+}
@@ -0,0 +1,50 @@
+/*
+ * filter.h
+ * Filter expressions over app attributes
+ *
+ *
+ * Copyright (C) 2026 ideviceinstaller contributors
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifndef __FILTER_H
+#define __FILTER_H
+
+#include <plist/plist.h>
+
+/* A compiled filter expression like
+ *   CFBundleIdentifier==com.example.* && !(CFBundleVersion<2.0 || Beta)
+ * "==" and "!=" match glob patterns, "<", "<=", ">" and ">=" compare
+ * integers numerically and strings as dotted versions. A bare attribute
+ * matches if it is present and not false, 0 or empty. */
+struct filter;
+
+/* Compiles expr. Returns NULL and sets error (to be freed by the caller)
+ * if the expression is invalid. */
+struct filter* filter_compile(const char *expr, char **error);
+
+/* Returns 1 if the dictionary dict matches the filter, 0 otherwise. */
+int filter_match(const struct filter *filter, plist_t dict);
+
+/* Appends the attributes used by the filter that are not yet contained in
+ * the array attrs to it. Returns the number of attributes added. */
+int filter_add_attributes(const struct filter *filter, plist_t attrs);
+
+void filter_free(struct filter *filter);
+
+#endif
@@ -43,6 +43,7 @@
 #endif
 #ifndef WIN32
 #include <signal.h>
+#include <sys/socket.h>
 #endif
 
 #include <libimobiledevice/libimobiledevice.h>
@@ -53,10 +54,30 @@
 
 #include <plist/plist.h>
 
+#include <libimobiledevice-glue/thread.h>
+#ifndef WIN32
+#include <libimobiledevice-glue/socket.h>
+#endif
+
 #include <zip.h>
 
 #include <zlib.h>
 
+#include "scheduler.h"
+#include "utils.h"
+#include "json.h"
+#include "cache.h"
+#include "filter.h"
+#include "table.h"
+#include "diff.h"
+#include "trace.h"
+#include "metrics.h"
+#include "report.h"
+#include "probes.h"
+#ifdef HAVE_SQLITE3
+#include "inventory.h"
+#endif
+
 #ifdef WIN32
 #include <windows.h>
 #define wait_ms(x) Sleep(x)
@@ -97,6 +118,8 @@ const char APPARCH_PATH[] = "ApplicationArchives";
 
 char *udid = NULL;
 char *cmdarg = NULL;
+char **cmdargs = NULL;
+int num_cmdargs = 0;
 char *extsinf = NULL;
 char *extmeta = NULL;
 
@@ -109,7 +132,14 @@ enum cmd_mode {
 	CMD_LIST_ARCHIVES,
 	CMD_ARCHIVE,
 	CMD_RESTORE,
-	CMD_REMOVE_ARCHIVE
+	CMD_REMOVE_ARCHIVE,
+	CMD_BATCH,
+	CMD_WATCH,
+	CMD_SYNC,
+	CMD_STAGE,
+	CMD_COMMIT,
+	CMD_DIFF,
+	CMD_INVENTORY
 };
 
 int cmd = CMD_NONE;
@@ -128,6 +158,7 @@ plist_t bundle_ids = NULL;
 plist_t return_attrs = NULL;
 #define FORMAT_XML 1
 #define FORMAT_JSON 2
+#define FORMAT_NDJSON 3
 int output_format = 0;
 int opt_list_user = 0;
 int opt_list_system = 0;
@@ -136,6 +167,33 @@ int remove_after_copy = 0;
 int skip_uninstall = 1;
 int app_only = 0;
 int docs_only = 0;
+int stage_depth = 1;
+int quiet = 0;
+int dry_run = 0;
+int if_changed = 0;
+int preflight = 1;
+unsigned int max_uploads = 2;
+unsigned int device_jobs = 1;
+char *provision_manifest_path = NULL;
+int daemon_mode = 0;
+int client_mode = 0;
+char *socket_path = NULL;
+char *trace_file = NULL;
+char *metrics_file = NULL;
+unsigned int metrics_interval = 0;
+char *report_file = NULL;
+uint64_t min_free_space = 512*1024*1024;
+int max_age = -1;
+char *filter_expr = NULL;
+struct filter *list_filter = NULL;
+/* attributes only requested for filtering, sorting or grouping */
+plist_t list_extra_attrs = NULL;
+char *list_sort_key = NULL;
+int list_sort_descending = 0;
+unsigned int list_top = 0;
+char *list_group_key = NULL;
+struct app_table *list_table = NULL;
+int list_all_devices = 0;
 
 // ZIP format constants
 #define LOCAL_HEADER_SIGNATURE 0x04034b50
@@ -304,6 +362,7 @@ static void r_close_entry(ZipParser* zp)
 
 /* Get next entry in ZIP file */
 static int r_zip_get_next_entry(ZipParser* zp) {
+    PROBE(zip__entry__begin);
     if (zp->consumed == false && zp->header_start != -1)
     {
         r_close_entry(zp);
@@ -352,6 +411,7 @@ static int r_zip_get_next_entry(ZipParser* zp) {
 		return 0;
     }
 
+    PROBE3(zip__entry__end, zp->filename, zp->comp_size, zp->uncomp_size);
     return 1;
 }
 
@@ -392,7 +452,12 @@ static int r_extract_current(ZipParser* zp, afc_client_t afc, uint64_t af) {
 
 			uint32_t bytes_written = 0;
 			// Write the data chunk to the AFC file
-			if (afc_file_write(afc, af, buffer, bytes_read, &bytes_written) != AFC_E_SUCCESS) {
+			uint64_t trace_start = trace_begin();
+			PROBE2(afc__write__begin, af, bytes_read);
+			afc_error_t aerr = afc_file_write(afc, af, buffer, bytes_read, &bytes_written);
+			PROBE3(afc__write__end, af, bytes_written, aerr);
+			trace_end("afc", "afc_file_write", NULL, trace_start, bytes_written);
+			if (aerr != AFC_E_SUCCESS) {
 				fprintf(stderr, "AFC write error!\n");
 				return 0;
 			} else if (bytes_written != bytes_read) {
@@ -436,8 +501,12 @@ static int r_extract_current(ZipParser* zp, afc_client_t afc, uint64_t af) {
                 if (ret == Z_STREAM_ERROR) break;
 
                 uint32_t have = sizeof(out_buf) - strm.avail_out;
-                if (afc_file_write(afc, af, out_buf, have, &written) !=
-					AFC_E_SUCCESS) {
+                uint64_t trace_start = trace_begin();
+                PROBE2(afc__write__begin, af, have);
+                afc_error_t aerr = afc_file_write(afc, af, out_buf, have, &written);
+                PROBE3(afc__write__end, af, written, aerr);
+                trace_end("afc", "afc_file_write", NULL, trace_start, written);
+                if (aerr != AFC_E_SUCCESS) {
 					fprintf(stderr, "AFC Write error!\n");
 					return 0;
 				} else if (written != have) {
@@ -663,75 +732,375 @@ static int r_get_app_directory(ZipParser* zp, char** path) {
     return 0;
 }
 
-static void print_apps_header()
+/* size of the stdout buffer used while listing apps */
+#define LIST_OUTPUT_BUFFER_SIZE (256 * 1024)
+
+struct list_column {
+	const char *key;
+	int quoted;
+};
+
+static struct list_column *list_columns = NULL;
+static uint32_t num_list_columns = 0;
+
+/* resolve the requested return attributes into columns once per listing */
+static void list_columns_resolve(void)
 {
-	if (!return_attrs) {
+	uint32_t i = 0;
+
+	if (list_columns || !return_attrs) {
 		return;
 	}
+	uint32_t num_attrs = plist_array_get_size(return_attrs);
+	/* apps listed from all devices start with the UDID of their device */
+	uint32_t first = (list_all_devices) ? 1 : 0;
+	num_list_columns = first + num_attrs;
+	list_columns = calloc(num_list_columns ? num_list_columns : 1, sizeof(struct list_column));
+	if (first) {
+		list_columns[0].key = "udid";
+		list_columns[0].quoted = 0;
+	}
+	for (i = 0; i < num_attrs; i++) {
+		const char *key = plist_get_string_ptr(plist_array_get_item(return_attrs, i), NULL);
+		list_columns[first + i].key = (key) ? key : "";
+		list_columns[first + i].quoted = strcmp(list_columns[first + i].key, "CFBundleIdentifier") != 0;
+	}
+}
+
+/* list output goes out in large blocks, progress output as it happens */
+static void setup_stdout_buffering(void)
+{
+	if (cmd == CMD_LIST_APPS || cmd == CMD_DIFF) {
+		setvbuf(stdout, NULL, _IOFBF, LIST_OUTPUT_BUFFER_SIZE);
+	} else {
+		setbuf(stdout, NULL);
+	}
+}
+
+static void print_apps_header()
+{
 	uint32_t i = 0;
-	for (i = 0; i < plist_array_get_size(return_attrs); i++) {
-		plist_t node = plist_array_get_item(return_attrs, i);
+
+	list_columns_resolve();
+	if (!list_columns) {
+		return;
+	}
+	for (i = 0; i < num_list_columns; i++) {
 		if (i > 0) {
-			printf(", ");
+			fputs(", ", stdout);
+		}
+		fputs(list_columns[i].key, stdout);
+	}
+	putchar('\n');
+}
+
+static void print_app(plist_t app)
+{
+	uint32_t j = 0;
+
+	for (j = 0; j < num_list_columns; j++) {
+		if (j > 0) {
+			fputs(", ", stdout);
+		}
+		plist_t node = plist_dict_get_item(app, list_columns[j].key);
+		if (!node) {
+			continue;
+		}
+		uint64_t uval = 0;
+		uint64_t len = 0;
+		const char *str = NULL;
+		switch (plist_get_node_type(node)) {
+			case PLIST_STRING:
+				str = plist_get_string_ptr(node, &len);
+				if (list_columns[j].quoted) {
+					putchar('"');
+					fwrite(str, 1, len, stdout);
+					putchar('"');
+				} else {
+					fwrite(str, 1, len, stdout);
+				}
+				break;
+			case PLIST_INT:
+				plist_get_uint_val(node, &uval);
+				printf("%" PRIu64, uval);
+				break;
+			case PLIST_BOOLEAN:
+				fputs(plist_bool_val_is_true(node) ? "true" : "false", stdout);
+				break;
+			case PLIST_ARRAY:
+				fputs("(array)", stdout);
+				break;
+			case PLIST_DICT:
+				fputs("(dict)", stdout);
+				break;
+			default:
+				break;
 		}
-		printf("%s", plist_get_string_ptr(node, NULL));
 	}
-	printf("\n");
+	putchar('\n');
 }
 
 static void print_apps(plist_t apps)
 {
-	if (!return_attrs) {
+	uint32_t i = 0;
+
+	list_columns_resolve();
+	if (!list_columns) {
 		return;
 	}
-	uint32_t i = 0;
 	for (i = 0; i < plist_array_get_size(apps); i++) {
 		plist_t app = plist_array_get_item(apps, i);
-		uint32_t j = 0;
-		for (j = 0; j < plist_array_get_size(return_attrs); j++) {
-			plist_t node = plist_array_get_item(return_attrs, j);
-			if (j > 0) {
-				printf(", ");
-			}
-			const char* key = plist_get_string_ptr(node, NULL);
-			node = plist_dict_get_item(app, key);
-			if (node) {
-				if (!strcmp(key, "CFBundleIdentifier")) {
-					printf("%s", plist_get_string_ptr(node, NULL));
-				} else {
-					uint64_t uval = 0;
-					switch (plist_get_node_type(node)) {
-						case PLIST_STRING:
-							printf("\"%s\"", plist_get_string_ptr(node, NULL));
-							break;
-						case PLIST_INT:
-							plist_get_uint_val(node, &uval);
-							printf("%" PRIu64, uval);
-							break;
-						case PLIST_BOOLEAN:
-							printf("%s", plist_bool_val_is_true(node) ? "true" : "false");
-							break;
-						case PLIST_ARRAY:
-							printf("(array)");
-							break;
-						case PLIST_DICT:
-							printf("(dict)");
-							break;
-						default:
-							break;
-					}
-				}
+		if (list_filter && !filter_match(list_filter, app)) {
+			continue;
+		}
+		print_app(app);
+	}
+}
+
+static int apps_printed = 0;
+
+/* when set, browse results are also collected here to update the cache */
+static plist_t list_collected = NULL;
+
+/* Writes the text between start and end with indent in front of each
+ * line. A trailing newline is dropped, so the caller decides what follows
+ * the last line. */
+static void print_indented(const char *start, const char *end, const char *indent)
+{
+	while (end > start && (end[-1] == '\n' || end[-1] == '\r')) {
+		end--;
+	}
+	while (start < end) {
+		const char *eol = memchr(start, '\n', end - start);
+		if (!eol) {
+			eol = end;
+		}
+		printf("%s%.*s", indent, (int)(eol - start), start);
+		if (eol < end) {
+			putchar('\n');
+		}
+		start = eol + 1;
+	}
+}
+
+#define XML_PLIST_PROLOG \
+	"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n" \
+	"<!DOCTYPE plist PUBLIC \"-//Apple//DTD PLIST 1.0//EN\" \"http://www.apple.com/DTDs/PropertyList-1.0.dtd\">\n" \
+	"<plist version=\"1.0\">\n"
+
+static void print_apps_formatted_header(void)
+{
+	apps_printed = 0;
+	if (output_format == FORMAT_XML) {
+		printf(XML_PLIST_PROLOG "<array>\n");
+	} else if (output_format == FORMAT_JSON) {
+		printf("[");
+	}
+}
+
+static void print_apps_formatted_footer(void)
+{
+	if (output_format == FORMAT_XML) {
+		printf("</array>\n</plist>\n");
+	} else if (output_format == FORMAT_JSON) {
+		printf((apps_printed) ? "\n]\n" : "]\n");
+	}
+}
+
+/* Prints app as an element of an array at the given nesting depth */
+static void print_app_formatted(plist_t app, int depth)
+{
+	uint32_t i;
+
+	for (i = 0; i < plist_array_get_size(list_extra_attrs); i++) {
+		plist_dict_remove_item(app, plist_get_string_ptr(plist_array_get_item(list_extra_attrs, i), NULL));
+	}
+	if (output_format == FORMAT_XML) {
+		char *buf = NULL;
+		uint32_t len = 0;
+		plist_err_t perr = plist_to_xml(app, &buf, &len);
+		if (perr != PLIST_ERR_SUCCESS) {
+			fprintf(stderr, "ERROR: Failed to convert data to XML format (%d).\n", perr);
+		} else {
+			/* only keep the dict, without XML declaration and plist element */
+			const char *start = strstr(buf, "<plist version=\"1.0\">\n");
+			const char *end = strstr(buf, "</plist>");
+			if (start && end) {
+				start += strlen("<plist version=\"1.0\">\n");
+				print_indented(start, end, (depth > 1) ? "\t\t" : "\t");
+				putchar('\n');
 			}
 		}
-		printf("\n");
+		free(buf);
+	} else if (output_format == FORMAT_JSON) {
+		printf("%s%*s", (apps_printed) ? ",\n" : "\n", depth * 2, "");
+		json_write_node(stdout, app, 1, depth);
+	} else if (output_format == FORMAT_NDJSON) {
+		json_write_node(stdout, app, 0, 0);
+		putchar('\n');
+	}
+	apps_printed++;
+}
+
+/* Prints a chunk of apps as elements of the array opened by
+ * print_apps_formatted_header(), so the browse results don't need to be
+ * collected before printing. */
+static void print_apps_formatted(plist_t apps)
+{
+	uint32_t i;
+
+	for (i = 0; i < plist_array_get_size(apps); i++) {
+		plist_t app = plist_array_get_item(apps, i);
+		if (list_filter && !filter_match(list_filter, app)) {
+			continue;
+		}
+		print_app_formatted(app, 1);
+	}
+	if (output_format == FORMAT_NDJSON) {
+		/* let consumers process the apps while the browse goes on */
+		fflush(stdout);
+	}
+}
+
+/* Adds the matching apps of a browse chunk to list_table */
+static void list_table_add(plist_t apps)
+{
+	uint32_t i;
+
+	for (i = 0; i < plist_array_get_size(apps); i++) {
+		plist_t app = plist_array_get_item(apps, i);
+		if (list_filter && !filter_match(list_filter, app)) {
+			continue;
+		}
+		app_table_add(list_table, plist_copy(app));
+	}
+}
+
+static void print_xml_escaped(const char *str)
+{
+	for (; *str; str++) {
+		switch (*str) {
+			case '&':
+				fputs("&amp;", stdout);
+				break;
+			case '<':
+				fputs("&lt;", stdout);
+				break;
+			case '>':
+				fputs("&gt;", stdout);
+				break;
+			default:
+				putchar(*str);
+				break;
+		}
+	}
+}
+
+static void print_app_group(const char *group, plist_t *rows, uint32_t num_rows, void *user_data)
+{
+	int *num_groups = (int*)user_data;
+	int depth = 1;
+	uint32_t i;
+
+	if (list_group_key) {
+		if (output_format == FORMAT_XML) {
+			fputs("\t<key>", stdout);
+			print_xml_escaped((group) ? group : "");
+			fputs("</key>\n\t<array>\n", stdout);
+			depth = 2;
+		} else if (output_format == FORMAT_JSON) {
+			printf((*num_groups) ? ",\n  " : "\n  ");
+			json_write_string(stdout, (group) ? group : "", (group) ? strlen(group) : 0);
+			printf(": [");
+			apps_printed = 0;
+			depth = 2;
+		} else if (!output_format) {
+			printf("%s%s: %s (%u)\n", (*num_groups) ? "\n" : "", list_group_key, (group) ? group : "(none)", num_rows);
+		}
+	}
+	for (i = 0; i < num_rows; i++) {
+		if (output_format) {
+			print_app_formatted(rows[i], depth);
+		} else {
+			print_app(rows[i]);
+		}
+	}
+	if (list_group_key) {
+		if (output_format == FORMAT_XML) {
+			fputs("\t</array>\n", stdout);
+		} else if (output_format == FORMAT_JSON) {
+			printf((apps_printed) ? "\n  ]" : "]");
+		}
+	}
+	(*num_groups)++;
+}
+
+/* Prints the sorted and grouped apps collected in list_table. Groups are
+ * printed as a dictionary of arrays with --xml and --json, and one after
+ * another otherwise. */
+static void print_app_table(void)
+{
+	int num_groups = 0;
+
+	if (!output_format) {
+		print_apps_header();
+	} else if (list_group_key && output_format == FORMAT_XML) {
+		printf(XML_PLIST_PROLOG "<dict>\n");
+	} else if (list_group_key && output_format == FORMAT_JSON) {
+		printf("{");
+	} else {
+		print_apps_formatted_header();
+	}
+
+	app_table_foreach_group(list_table, print_app_group, &num_groups);
+
+	if (!output_format) {
+		return;
+	} else if (list_group_key && output_format == FORMAT_XML) {
+		printf("</dict>\n</plist>\n");
+	} else if (list_group_key && output_format == FORMAT_JSON) {
+		printf((num_groups) ? "\n}\n" : "}\n");
+	} else {
+		print_apps_formatted_footer();
+	}
+}
+
+static void print_app_list(plist_t apps)
+{
+	if (list_table) {
+		list_table_add(apps);
+		print_app_table();
+	} else if (output_format) {
+		print_apps_formatted_header();
+		print_apps_formatted(apps);
+		print_apps_formatted_footer();
+	} else {
+		print_apps_header();
+		print_apps(apps);
 	}
 }
 
+static volatile int quit_requested = 0;
+
+#ifndef WIN32
+static void quit_signal_handler(int sig)
+{
+	quit_requested = 1;
+}
+#endif
+
 static void notifier(const char *notification, void *unused)
 {
+	if (notification && (!strcmp(notification, NP_APP_INSTALLED) || !strcmp(notification, NP_APP_UNINSTALLED))) {
+		inventory_cache_invalidate(udid);
+	}
 	notified = 1;
 }
 
+static struct trace_phase status_phase;
+static uint64_t status_time = 0;
+static struct report_op *status_report = NULL;
+
 static void status_cb(plist_t command, plist_t status, void *unused)
 {
 	if (command && status) {
@@ -754,6 +1123,14 @@ static void status_cb(plist_t command, plist_t status, void *unused)
 		uint64_t error_code = 0;
 		instproxy_status_get_error(status, &error_name, &error_description, &error_code);
 
+		trace_phase_next(&status_phase, "device", (command_completed || error_name) ? NULL : status_name);
+		if (strcmp(command_name, "Browse") != 0) {
+			metrics_status_update(&status_time);
+		}
+		metrics_count_error(error_name, error_code);
+		report_op_status(status_report, (command_completed || error_name) ? NULL : status_name);
+		report_op_error(status_report, error_name, error_description, error_code);
+
 		/* output/handling */
 		if (!error_name) {
 			if (!strcmp(command_name, "Browse")) {
@@ -763,13 +1140,27 @@ static void status_cb(plist_t command, plist_t status, void *unused)
 				plist_t current_list = NULL;
 				instproxy_status_get_current_list(status, &total, &current_index, &current_amount, &current_list);
 				if (current_list) {
-					print_apps(current_list);
+					/* collect first, printing drops attributes only used for filtering */
+					if (list_collected) {
+						uint32_t i;
+						for (i = 0; i < plist_array_get_size(current_list); i++) {
+							plist_array_append_item(list_collected, plist_copy(plist_array_get_item(current_list, i)));
+						}
+					}
+					if (list_table) {
+						list_table_add(current_list);
+					} else if (output_format) {
+						print_apps_formatted(current_list);
+					} else {
+						print_apps(current_list);
+					}
 					plist_free(current_list);
 				}
 			} else if (status_name) {
 				/* get progress if any */
 				int percent = -1;
 				instproxy_status_get_percent_complete(status, &percent);
+				PROBE3(status, command_name, status_name, percent);
 
 				if (last_status && (strcmp(last_status, status_name))) {
 					printf("\n");
@@ -783,6 +1174,7 @@ static void status_cb(plist_t command, plist_t status, void *unused)
 				if (command_completed) {
 					printf("\n");
 				}
+				fflush(stdout);
 			}
 		} else {
 			/* report error to the user */
@@ -857,16 +1249,65 @@ static void print_usage(int argc, char **argv, int is_error)
 	"        --system        List system apps only\n"
 	"        --all           List all types of apps\n"
 	"        --xml           Print output as XML Property List\n"
+	"        --json          Print output as JSON array\n"
+	"        --ndjson        Print output as JSON with one app per line\n"
 	"        -a, --attribute ATTR  Specify attribute to return - see man page\n"
 	"            (can be passed multiple times)\n"
 	"        -b, --bundle-identifier BUNDLEID  Only query given bundle identifier\n"
 	"            (can be passed multiple times)\n"
-	"  install PATH        Install app from package file specified by PATH.\n"
+	"        --filter EXPR   Only list apps matching EXPR - see man page\n"
+	"        --sort [-]ATTR  Sort by ATTR, in descending order with a leading '-'\n"
+	"        --top N         Only list the first N apps (of each group)\n"
+	"        --group-by ATTR Group apps by the value of ATTR\n"
+	"        --all-devices   List the apps of all connected devices at once,\n"
+	"            with the UDID of the device as an additional attribute\n"
+	"        --max-age SECONDS  Use the cached app list if it is at most SECONDS\n"
+	"            old, otherwise refresh it if the installed apps changed\n"
+	"  install PATH...     Install app from package file specified by PATH.\n"
 	"                      PATH can also be a .ipcc file for carrier bundles.\n"
+	"                      Multiple packages are uploaded while the previous\n"
+	"                      one is being installed.\n"
 	"        -s, --sinf PATH  Pass an external SINF file\n"
 	"        -m, --metadata PATH  Pass an external iTunesMetadata file\n"
+	"        --stage-depth N  Upload up to N packages ahead (default: 1, 0 disables)\n"
+	"        --if-changed    Skip packages that are already installed in the same\n"
+	"            version (also applies to 'batch' and 'watch')\n"
+	"        --no-preflight  Don't check minimum OS version, device family,\n"
+	"            required capabilities, and free space before uploading\n"
+	"        --min-free-space SIZE  Stop uploading ahead if the device has less\n"
+	"            than SIZE bytes free (K/M/G suffix allowed, default: 512M)\n"
 	"  uninstall BUNDLEID  Uninstall app specified by BUNDLEID.\n"
-	"  upgrade PATH        Upgrade app from package file specified by PATH.\n"
+	"  upgrade PATH...     Upgrade app from package file specified by PATH.\n"
+	"  stage PATH...       Upload packages to the device without installing them.\n"
+	"  commit BUNDLEID...  Install previously staged packages; a staged package\n"
+	"                      can be committed multiple times.\n"
+	"  batch FILE          Run the jobs listed in FILE ('-' for stdin), one job\n"
+	"                      per line: UDID install|upgrade|uninstall ARG [PRIORITY]\n"
+	"                      UDID can be 'any' or 'any:N' to run the job on any\n"
+	"                      (N different) devices matching the given filters\n"
+	"                      like ProductType=iPhone* or ProductVersion>=16.0\n"
+	"        --max-uploads N  Upload at most N packages at once (default: 2)\n"
+	"        --device-jobs N  Run up to N jobs per device at once (default: 1)\n"
+	"  watch               Wait for devices to be connected and print every app\n"
+	"                      that is installed, upgraded, or removed on them as a\n"
+	"                      JSON record per line. Options:\n"
+	"        --provision MANIFEST  Install the packages listed in MANIFEST on\n"
+	"            every device that is connected instead, see man page for the\n"
+	"            format.\n"
+	"            --max-uploads and --device-jobs apply like for 'batch'.\n"
+	"  sync MANIFEST       Install, upgrade, and uninstall apps so that all connected\n"
+	"                      devices (or the one given with -u) match MANIFEST.\n"
+	"                      --max-uploads and --device-jobs apply like for 'batch'.\n"
+	"        --dry-run     Only print the changes that would be made.\n"
+	"  diff SOURCE TARGET...  Print the apps added, removed, or changed in\n"
+	"                      version on each TARGET compared to SOURCE. Each can\n"
+	"                      be a UDID or a file saved with list --json, --ndjson,\n"
+	"                      or --xml. --user/--system/--all and the output\n"
+	"                      formats of 'list' apply.\n"
+	"  inventory DB        Store the apps of all connected devices, or of the\n"
+	"                      one given with --udid, in the SQLite database DB.\n"
+	"                      Existing rows are updated and rows of apps that\n"
+	"                      were removed from a device are deleted.\n"
         "\n"
         "LEGACY COMMANDS (non-functional with iOS 7 or later):\n"
 	"  archive BUNDLEID    Archive app specified by BUNDLEID. Options:\n"
@@ -887,6 +1328,19 @@ static void print_usage(int argc, char **argv, int is_error)
 	"                      before reporting success of operation\n"
 	"  -h, --help          Print usage information\n"
 	"  -d, --debug         Enable communication debugging\n"
+	"  --trace FILE        Write the time spent in each phase to FILE in Chrome\n"
+	"                      trace-event format\n"
+	"  --metrics FILE      Write throughput, latency percentiles, retries, and\n"
+	"                      errors to FILE in Prometheus text format, or as JSON\n"
+	"                      if FILE ends in .json\n"
+	"  --metrics-interval SECONDS  Also write the metrics every SECONDS\n"
+	"  --report FILE       Write a JSON summary of each install, upgrade, and\n"
+	"                      uninstall with per-phase timings to FILE\n"
+#ifndef WIN32
+	"  --daemon            Run as daemon serving requests on a local socket\n"
+	"  --client            Send the command to a running daemon\n"
+	"  --socket PATH       Socket path for --daemon and --client\n"
+#endif
 	"  -v, --version       Print version information\n"
 	"\n"
 	"Homepage:    <" PACKAGE_URL ">\n"
@@ -904,9 +1358,91 @@ enum numerical_opts {
 	ARCHIVE_COPY_PATH,
 	ARCHIVE_COPY_REMOVE,
 	OUTPUT_XML,
-	OUTPUT_JSON
+	OUTPUT_JSON,
+	OUTPUT_NDJSON,
+	MAX_AGE,
+	LIST_FILTER,
+	LIST_SORT,
+	LIST_TOP,
+	LIST_GROUP_BY,
+	LIST_ALL_DEVICES,
+	STAGE_DEPTH,
+	MIN_FREE_SPACE,
+	MAX_UPLOADS,
+	DEVICE_JOBS,
+	PROVISION,
+	DRY_RUN,
+	IF_CHANGED,
+	NO_PREFLIGHT,
+	TRACE_FILE,
+	METRICS_FILE,
+	METRICS_INTERVAL,
+	REPORT_FILE,
+	DAEMON_MODE,
+	CLIENT_MODE,
+	SOCKET_PATH
 };
 
+static int parse_size(const char *str, uint64_t *size)
+{
+	char *endp = NULL;
+	uint64_t val = strtoull(str, &endp, 10);
+	if (endp == str) {
+		return -1;
+	}
+	switch (*endp) {
+		case 'G': case 'g':
+			val *= 1024;
+			/* fall through */
+		case 'M': case 'm':
+			val *= 1024;
+			/* fall through */
+		case 'K': case 'k':
+			val *= 1024;
+			endp++;
+			break;
+		case '\0':
+			break;
+		default:
+			return -1;
+	}
+	if (*endp != '\0') {
+		return -1;
+	}
+	*size = val;
+	return 0;
+}
+
+/* Parses a number between 0 and max. Returns 0 on success, -1 otherwise. */
+static int parse_number(const char *str, unsigned int max, unsigned int *value)
+{
+	char *endp = NULL;
+	unsigned long val;
+
+	if (*str < '0' || *str > '9') {
+		return -1;
+	}
+	errno = 0;
+	val = strtoul(str, &endp, 10);
+	if (errno != 0 || *endp != '\0' || val > max) {
+		return -1;
+	}
+	*value = (unsigned int)val;
+	return 0;
+}
+
+/* Parses a number between 1 and max. Returns 0 on success, -1 otherwise. */
+static int parse_count(const char *str, unsigned int max, unsigned int *count)
+{
+	unsigned int val = 0;
+
+	if (parse_number(str, max, &val) < 0 || val < 1) {
+		return -1;
+	}
+	*count = val;
+	return 0;
+}
+
 static void parse_opts(int argc, char **argv)
 {
 	static struct option longopts[] = {
@@ -923,6 +1459,13 @@ static void parse_opts(int argc, char **argv)
 		{ "all", no_argument, NULL, LIST_ALL },
 		{ "xml", no_argument, NULL, OUTPUT_XML },
 		{ "json", no_argument, NULL, OUTPUT_JSON },
+		{ "ndjson", no_argument, NULL, OUTPUT_NDJSON },
+		{ "max-age", required_argument, NULL, MAX_AGE },
+		{ "filter", required_argument, NULL, LIST_FILTER },
+		{ "sort", required_argument, NULL, LIST_SORT },
+		{ "top", required_argument, NULL, LIST_TOP },
+		{ "group-by", required_argument, NULL, LIST_GROUP_BY },
+		{ "all-devices", no_argument, NULL, LIST_ALL_DEVICES },
 		{ "sinf", required_argument, NULL, 's' },
 		{ "metadata", required_argument, NULL, 'm' },
 		{ "uninstall", no_argument, NULL, ARCHIVE_UNINSTALL },
@@ -930,9 +1473,27 @@ static void parse_opts(int argc, char **argv)
 		{ "docs-only", no_argument, NULL, ARCHIVE_DOCS_ONLY },
 		{ "copy", required_argument, NULL, ARCHIVE_COPY_PATH },
 		{ "remove", no_argument, NULL, ARCHIVE_COPY_REMOVE },
+		{ "stage-depth", required_argument, NULL, STAGE_DEPTH },
+		{ "min-free-space", required_argument, NULL, MIN_FREE_SPACE },
+		{ "max-uploads", required_argument, NULL, MAX_UPLOADS },
+		{ "device-jobs", required_argument, NULL, DEVICE_JOBS },
+		{ "provision", required_argument, NULL, PROVISION },
+		{ "dry-run", no_argument, NULL, DRY_RUN },
+		{ "if-changed", no_argument, NULL, IF_CHANGED },
+		{ "no-preflight", no_argument, NULL, NO_PREFLIGHT },
+		{ "trace", required_argument, NULL, TRACE_FILE },
+		{ "metrics", required_argument, NULL, METRICS_FILE },
+		{ "metrics-interval", required_argument, NULL, METRICS_INTERVAL },
+		{ "report", required_argument, NULL, REPORT_FILE },
+#ifndef WIN32
+		{ "daemon", no_argument, NULL, DAEMON_MODE },
+		{ "client", no_argument, NULL, CLIENT_MODE },
+		{ "socket", required_argument, NULL, SOCKET_PATH },
+#endif
 		{ NULL, 0, NULL, 0 }
 	};
 	int c;
+	unsigned int num;
 
 	while (1) {
 		c = getopt_long(argc, argv, "hu:nwdvb:a:s:m:", longopts, (int*)0);
@@ -1018,6 +1579,52 @@ static void parse_opts(int argc, char **argv)
 		case OUTPUT_JSON:
 			output_format = FORMAT_JSON;
 			break;
+		case OUTPUT_NDJSON:
+			output_format = FORMAT_NDJSON;
+			break;
+		case LIST_FILTER:
+			if (filter_expr) {
+				char *combined = NULL;
+				if (asprintf(&combined, "(%s) && (%s)", filter_expr, optarg) < 0) {
+					combined = NULL;
+				}
+				free(filter_expr);
+				filter_expr = combined;
+			} else {
+				filter_expr = strdup(optarg);
+			}
+			if (!filter_expr) {
+				fprintf(stderr, "ERROR: Out of memory parsing --filter!\n");
+				exit(2);
+			}
+			break;
+		case LIST_SORT:
+			free(list_sort_key);
+			list_sort_descending = (optarg[0] == '-');
+			list_sort_key = strdup(optarg + list_sort_descending);
+			break;
+		case LIST_TOP:
+			if (parse_count(optarg, 1000000, &list_top) < 0) {
+				fprintf(stderr, "ERROR: --top must be a number between 1 and 1000000!\n");
+				print_usage(argc, argv, 1);
+				exit(2);
+			}
+			break;
+		case LIST_GROUP_BY:
+			free(list_group_key);
+			list_group_key = strdup(optarg);
+			break;
+		case LIST_ALL_DEVICES:
+			list_all_devices = 1;
+			break;
+		case MAX_AGE:
+			if (parse_number(optarg, INT_MAX, &num) < 0) {
+				fprintf(stderr, "ERROR: --max-age must be a number of seconds!\n");
+				print_usage(argc, argv, 1);
+				exit(2);
+			}
+			max_age = (int)num;
+			break;
 		case ARCHIVE_UNINSTALL:
 			skip_uninstall = 0;
 			break;
@@ -1035,6 +1642,84 @@ static void parse_opts(int argc, char **argv)
 		case ARCHIVE_COPY_REMOVE:
 			remove_after_copy = 1;
 			break;
+		case STAGE_DEPTH:
+			if (parse_number(optarg, 64, &num) < 0) {
+				fprintf(stderr, "ERROR: --stage-depth must be a number between 0 and 64!\n");
+				print_usage(argc, argv, 1);
+				exit(2);
+			}
+			stage_depth = (int)num;
+			break;
+		case MAX_UPLOADS:
+			/* 0 would mean no limit to the scheduler */
+			if (parse_count(optarg, 1024, &max_uploads) < 0) {
+				fprintf(stderr, "ERROR: --max-uploads must be a number between 1 and 1024!\n");
+				print_usage(argc, argv, 1);
+				exit(2);
+			}
+			break;
+		case DEVICE_JOBS:
+			if (parse_count(optarg, 1024, &device_jobs) < 0) {
+				fprintf(stderr, "ERROR: --device-jobs must be a number between 1 and 1024!\n");
+				print_usage(argc, argv, 1);
+				exit(2);
+			}
+			break;
+		case DRY_RUN:
+			dry_run = 1;
+			break;
+		case IF_CHANGED:
+			if_changed = 1;
+			break;
+		case NO_PREFLIGHT:
+			preflight = 0;
+			break;
+		case TRACE_FILE:
+			free(trace_file);
+			trace_file = strdup(optarg);
+			break;
+		case METRICS_FILE:
+			free(metrics_file);
+			metrics_file = strdup(optarg);
+			break;
+		case METRICS_INTERVAL:
+			/* a day at most, the writer waits for it in microseconds */
+			if (parse_count(optarg, 86400, &metrics_interval) < 0) {
+				fprintf(stderr, "ERROR: --metrics-interval must be a number of seconds between 1 and 86400!\n");
+				print_usage(argc, argv, 1);
+				exit(2);
+			}
+			break;
+		case REPORT_FILE:
+			free(report_file);
+			report_file = strdup(optarg);
+			break;
+		case PROVISION:
+			free(provision_manifest_path);
+			provision_manifest_path = strdup(optarg);
+			break;
+		case DAEMON_MODE:
+			daemon_mode = 1;
+			break;
+		case CLIENT_MODE:
+			client_mode = 1;
+			break;
+		case SOCKET_PATH:
+			if (!*optarg) {
+				fprintf(stderr, "ERROR: socket path must not be empty!\n");
+				print_usage(argc, argv, 1);
+				exit(2);
+			}
+			free(socket_path);
+			socket_path = strdup(optarg);
+			break;
+		case MIN_FREE_SPACE:
+			if (parse_size(optarg, &min_free_space) < 0) {
+				fprintf(stderr, "ERROR: Invalid size '%s' passed to --min-free-space!\n", optarg);
+				print_usage(argc, argv, 1);
+				exit(2);
+			}
+			break;
 		default:
 			print_usage(argc, argv, 1);
 			exit(2);
@@ -1044,6 +1729,25 @@ static void parse_opts(int argc, char **argv)
         argv += optind;
 	argc -= optind;
 
+	if (filter_expr) {
+		char *error = NULL;
+		list_filter = filter_compile(filter_expr, &error);
+		if (!list_filter) {
+			fprintf(stderr, "ERROR: Invalid filter expression: %s\n", (error) ? error : filter_expr);
+			free(error);
+			exit(2);
+		}
+	}
+
+	if (daemon_mode) {
+		if (argc > 0) {
+			fprintf(stderr, "ERROR: --daemon does not take a command.\n\n");
+			print_usage(argc+optind, argv-optind, 1);
+			exit(2);
+		}
+		return;
+	}
+
 	if (argc == 0) {
 		fprintf(stderr, "ERROR: Missing command.\n\n");
 		print_usage(argc+optind, argv-optind, 1);
@@ -1068,65 +1772,161 @@ static void parse_opts(int argc, char **argv)
 		cmd = CMD_RESTORE;
 	} else if (!strcmp(cmdstr, "remove-archive")) {
 		cmd = CMD_REMOVE_ARCHIVE;
+	} else if (!strcmp(cmdstr, "batch")) {
+		cmd = CMD_BATCH;
+	} else if (!strcmp(cmdstr, "watch")) {
+		cmd = CMD_WATCH;
+	} else if (!strcmp(cmdstr, "sync")) {
+		cmd = CMD_SYNC;
+	} else if (!strcmp(cmdstr, "stage")) {
+		cmd = CMD_STAGE;
+	} else if (!strcmp(cmdstr, "commit")) {
+		cmd = CMD_COMMIT;
+	} else if (!strcmp(cmdstr, "diff")) {
+		cmd = CMD_DIFF;
+	} else if (!strcmp(cmdstr, "inventory")) {
+		cmd = CMD_INVENTORY;
 	}
 
 	switch (cmd) {
 		case CMD_LIST_APPS:
+			if (list_all_devices && udid) {
+				fprintf(stderr, "ERROR: --all-devices can't be combined with --udid.\n\n");
+				print_usage(argc+optind, argv-optind, 1);
+				exit(2);
+			}
+			if (list_sort_key || list_top || list_group_key) {
+				list_table = app_table_new(list_sort_key, list_sort_descending, list_group_key, list_top);
+			}
+			break;
 		case CMD_LIST_ARCHIVES:
 			break;
+		case CMD_WATCH:
+			break;
 		case CMD_INSTALL:
 		case CMD_UPGRADE:
+		case CMD_STAGE:
 			if (argc < 2) {
 				fprintf(stderr, "ERROR: Missing filename for '%s' command.\n\n", cmdstr);
 				print_usage(argc+optind, argv-optind, 1);
 				exit(2);
 			}
 			cmdarg = argv[1];
+			cmdargs = argv+1;
+			num_cmdargs = argc-1;
 			break;
-		case CMD_UNINSTALL:
-		case CMD_ARCHIVE:
-		case CMD_RESTORE:
-		case CMD_REMOVE_ARCHIVE:
+		case CMD_BATCH:
 			if (argc < 2) {
-				fprintf(stderr, "ERROR: Missing bundle ID for '%s' command.\n\n", cmdstr);
+				fprintf(stderr, "ERROR: Missing job file for '%s' command.\n\n", cmdstr);
 				print_usage(argc+optind, argv-optind, 1);
 				exit(2);
 			}
 			cmdarg = argv[1];
 			break;
-		default:
-			fprintf(stderr, "ERROR: Invalid command '%s'.\n\n", cmdstr);
-			print_usage(argc+optind, argv-optind, 1);
-			exit(2);
-	}
-}
-
-static int afc_upload_file(afc_client_t afc, const char* filename, const char* dstfn)
-{
-	FILE *f = NULL;
-	uint64_t af = 0;
-	char buf[1048576];
-
-	f = fopen(filename, "rb");
-	if (!f) {
-		fprintf(stderr, "fopen: %s: %s\n", filename, strerror(errno));
-		return -1;
-	}
-
-	if ((afc_file_open(afc, dstfn, AFC_FOPEN_WRONLY, &af) != AFC_E_SUCCESS) || !af) {
-		fclose(f);
+		case CMD_SYNC:
+			if (argc < 2) {
+				fprintf(stderr, "ERROR: Missing manifest for '%s' command.\n\n", cmdstr);
+				print_usage(argc+optind, argv-optind, 1);
+				exit(2);
+			}
+			cmdarg = argv[1];
+			break;
+		case CMD_DIFF:
+			if (argc < 3) {
+				fprintf(stderr, "ERROR: The '%s' command needs a source and at least one target.\n\n", cmdstr);
+				print_usage(argc+optind, argv-optind, 1);
+				exit(2);
+			}
+			cmdargs = argv+1;
+			num_cmdargs = argc-1;
+			break;
+		case CMD_INVENTORY:
+			if (argc < 2) {
+				fprintf(stderr, "ERROR: Missing database file for '%s' command.\n\n", cmdstr);
+				print_usage(argc+optind, argv-optind, 1);
+				exit(2);
+			}
+			cmdarg = argv[1];
+			break;
+		case CMD_COMMIT:
+			if (argc < 2) {
+				fprintf(stderr, "ERROR: Missing bundle ID for '%s' command.\n\n", cmdstr);
+				print_usage(argc+optind, argv-optind, 1);
+				exit(2);
+			}
+			cmdarg = argv[1];
+			cmdargs = argv+1;
+			num_cmdargs = argc-1;
+			break;
+		case CMD_UNINSTALL:
+		case CMD_ARCHIVE:
+		case CMD_RESTORE:
+		case CMD_REMOVE_ARCHIVE:
+			if (argc < 2) {
+				fprintf(stderr, "ERROR: Missing bundle ID for '%s' command.\n\n", cmdstr);
+				print_usage(argc+optind, argv-optind, 1);
+				exit(2);
+			}
+			cmdarg = argv[1];
+			break;
+		default:
+			fprintf(stderr, "ERROR: Invalid command '%s'.\n\n", cmdstr);
+			print_usage(argc+optind, argv-optind, 1);
+			exit(2);
+	}
+}
+
+#define UPLOAD_CHUNK_SIZE 1048576
+
+/* Uploads a local file. The upload is stopped if cancel is set to a
+ * non-zero value from another thread. This runs on worker threads, so the
+ * buffer is on the heap rather than the stack. */
+static int afc_upload_file(afc_client_t afc, const char* filename, const char* dstfn, const volatile int *cancel)
+{
+	FILE *f = NULL;
+	uint64_t af = 0;
+	char *buf = NULL;
+
+	f = fopen(filename, "rb");
+	if (!f) {
+		fprintf(stderr, "fopen: %s: %s\n", filename, strerror(errno));
+		return -1;
+	}
+	buf = (char*)malloc(UPLOAD_CHUNK_SIZE);
+	if (!buf) {
+		fclose(f);
+		fprintf(stderr, "ERROR: Out of memory uploading %s\n", filename);
+		return -1;
+	}
+
+	uint64_t trace_start = trace_begin();
+	afc_error_t aerr = afc_file_open(afc, dstfn, AFC_FOPEN_WRONLY, &af);
+	trace_end("afc", "afc_file_open", dstfn, trace_start, -1);
+	if ((aerr != AFC_E_SUCCESS) || !af) {
+		free(buf);
+		fclose(f);
 		fprintf(stderr, "afc_file_open on '%s' failed!\n", dstfn);
 		return -1;
 	}
 
 	size_t amount = 0;
 	do {
-		amount = fread(buf, 1, sizeof(buf), f);
+		if (cancel && *cancel) {
+			afc_file_close(afc, af);
+			free(buf);
+			fclose(f);
+			return -1;
+		}
+		amount = fread(buf, 1, UPLOAD_CHUNK_SIZE, f);
 		if (amount > 0) {
 			uint32_t written, total = 0;
 			while (total < amount) {
 				written = 0;
-				afc_error_t aerr = afc_file_write(afc, af, buf, amount, &written);
+				trace_start = trace_begin();
+				PROBE2(afc__write__begin, af, amount - total);
+				aerr = afc_file_write(afc, af, buf + total, amount - total, &written);
+				PROBE3(afc__write__end, af, written, aerr);
+				trace_end("afc", "afc_file_write", NULL, trace_start, written);
 				if (aerr != AFC_E_SUCCESS) {
 					fprintf(stderr, "AFC Write error: %d\n", aerr);
 					break;
@@ -1136,13 +1936,17 @@ static int afc_upload_file(afc_client_t afc, const char* filename, const char* d
 			if (total != amount) {
 				fprintf(stderr, "Error: wrote only %u of %u\n", total, (uint32_t)amount);
 				afc_file_close(afc, af);
+				free(buf);
 				fclose(f);
 				return -1;
 			}
 		}
 	} while (amount > 0);
 
+	trace_start = trace_begin();
 	afc_file_close(afc, af);
+	trace_end("afc", "afc_file_close", dstfn, trace_start, -1);
+	free(buf);
 	fclose(f);
 
 	return 0;
@@ -1150,7 +1954,9 @@ static int afc_upload_file(afc_client_t afc, const char* filename, const char* d
 
 static void afc_upload_dir(afc_client_t afc, const char* path, const char* afcpath)
 {
+	uint64_t trace_start = trace_begin();
 	afc_make_directory(afc, afcpath);
+	trace_end("afc", "afc_make_directory", afcpath, trace_start, -1);
 
 	DIR *dir = opendir(path);
 	if (dir) {
@@ -1187,7 +1993,7 @@ static void afc_upload_dir(afc_client_t afc, const char* path, const char* afcpa
 			if ((stat(fpath, &st) == 0) && S_ISDIR(st.st_mode)) {
 				afc_upload_dir(afc, fpath, apath);
 			} else {
-				afc_upload_file(afc, fpath, apath);
+				afc_upload_file(afc, fpath, apath, NULL);
 			}
 			free(fpath);
 			free(apath);
@@ -1227,190 +2033,4322 @@ static char *buf_from_file(const char *filename, size_t *size)
 	return ibuf;
 }
 
-int main(int argc, char **argv)
+/* Reads the Info.plist of an .ipa archive or an .app directory without
+ * touching the device. */
+static plist_t package_read_info(const char *path)
 {
-	idevice_t device = NULL;
-	lockdownd_client_t client = NULL;
-	instproxy_client_t ipc = NULL;
-	instproxy_error_t err;
-	np_client_t np = NULL;
-	afc_client_t afc = NULL;
-	lockdownd_service_descriptor_t service = NULL;
-	int res = EXIT_FAILURE;
-	char *bundleidentifier = NULL;
+	struct stat fst;
+	plist_t info = NULL;
+	char *buf = NULL;
+
+	if (stat(path, &fst) != 0) {
+		fprintf(stderr, "ERROR: stat: %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	if (S_ISDIR(fst.st_mode)) {
+		char *filename = NULL;
+		size_t filesize = 0;
+		if (asprintf(&filename, "%s/Info.plist", path) < 0) {
+			return NULL;
+		}
+		buf = buf_from_file(filename, &filesize);
+		if (buf) {
+			plist_from_memory(buf, filesize, &info, NULL);
+		}
+		free(filename);
+	} else {
+		ZipParser *zp = r_zip_open(path);
+		char *app_directory_name = NULL;
+		char *filename = NULL;
+		uint32_t len = 0;
+
+		if (!zp) {
+			fprintf(stderr, "ERROR: r_zip_open: %s\n", path);
+			return NULL;
+		}
+		if (r_get_app_directory(zp, &app_directory_name) == 0 && asprintf(&filename, "%sInfo.plist", app_directory_name) > 0) {
+			if (r_get_content(zp, filename, &buf, &len) == 0 && buf) {
+				plist_from_memory(buf, len, &info, NULL);
+			}
+			free(filename);
+		}
+		free(app_directory_name);
+		r_zip_close(zp);
+	}
+	free(buf);
+
+	if (!info) {
+		fprintf(stderr, "ERROR: Could not read Info.plist from %s\n", path);
+	}
+
+	return info;
+}
+
+/* Appends key to the array attrs unless it is contained already. Returns
+ * 1 if it was added, 0 otherwise. */
+static int attrs_add(plist_t attrs, const char *key)
+{
+	uint32_t i;
+
+	if (!key) {
+		return 0;
+	}
+	for (i = 0; i < plist_array_get_size(attrs); i++) {
+		const char *attr = plist_get_string_ptr(plist_array_get_item(attrs, i), NULL);
+		if (attr && !strcmp(attr, key)) {
+			return 0;
+		}
+	}
+	plist_array_append_item(attrs, plist_new_string(key));
+	return 1;
+}
+
+static plist_t list_client_options_new(void)
+{
+	plist_t client_opts = instproxy_client_options_new();
+	instproxy_client_options_add(client_opts, "ApplicationType", "User", NULL);
+
+	if (opt_list_system && opt_list_user) {
+		plist_dict_remove_item(client_opts, "ApplicationType");
+	} else if (opt_list_system) {
+		instproxy_client_options_add(client_opts, "ApplicationType", "System", NULL);
+	} else if (opt_list_user) {
+		instproxy_client_options_add(client_opts, "ApplicationType", "User", NULL);
+	}
+
+	if (bundle_ids) {
+		plist_dict_set_item(client_opts, "BundleIDs", plist_copy(bundle_ids));
+	}
+
+	if (!output_format && !return_attrs) {
+		return_attrs = plist_new_array();
+		plist_array_append_item(return_attrs, plist_new_string("CFBundleIdentifier"));
+		plist_array_append_item(return_attrs, plist_new_string("CFBundleShortVersionString"));
+		plist_array_append_item(return_attrs, plist_new_string("CFBundleDisplayName"));
+	}
+
+	if (return_attrs && (list_filter || list_sort_key || list_group_key)) {
+		/* filtering, sorting and grouping might need attributes that are
+		 * not printed */
+		plist_t attrs = plist_copy(return_attrs);
+		uint32_t num_attrs = plist_array_get_size(attrs);
+		int added = filter_add_attributes(list_filter, attrs);
+		added += attrs_add(attrs, list_sort_key);
+		added += attrs_add(attrs, list_group_key);
+		if (added > 0 && !list_extra_attrs) {
+			uint32_t i;
+			list_extra_attrs = plist_new_array();
+			for (i = num_attrs; i < plist_array_get_size(attrs); i++) {
+				plist_array_append_item(list_extra_attrs, plist_copy(plist_array_get_item(attrs, i)));
+			}
+		}
+		instproxy_client_options_add(client_opts, "ReturnAttributes", attrs, NULL);
+		plist_free(attrs);
+	} else if (return_attrs) {
+		instproxy_client_options_add(client_opts, "ReturnAttributes", return_attrs, NULL);
+	}
+
+	return client_opts;
+}
+
+/* Browses only the identifiers and versions of the apps selected by
+ * client_opts, which is enough to tell if a cached list is still current. */
+static char* list_signature(instproxy_client_t ipc, plist_t client_opts)
+{
+	plist_t opts = plist_copy(client_opts);
+	plist_t attrs = plist_new_array();
+	plist_t apps = NULL;
+	char *signature = NULL;
+
+	plist_array_append_item(attrs, plist_new_string("CFBundleIdentifier"));
+	plist_array_append_item(attrs, plist_new_string("CFBundleVersion"));
+	plist_dict_set_item(opts, "ReturnAttributes", attrs);
+
+	if (instproxy_browse(ipc, opts, &apps) == INSTPROXY_E_SUCCESS) {
+		signature = inventory_signature(apps);
+	}
+	plist_free(apps);
+	instproxy_client_options_free(opts);
+
+	return signature;
+}
+
+enum package_type {
+	PACKAGE_TYPE_ARCHIVE,
+	PACKAGE_TYPE_DIRECTORY,
+	PACKAGE_TYPE_IPCC
+};
+
+struct install_package {
+	const char *path;
+	enum package_type type;
+	char *pkgname;
+	char *bundleidentifier;
+	plist_t info;            /* Info.plist of the app, NULL for .ipcc */
+	plist_t client_opts;
+	uint64_t size;
+	int prepared;            /* 1 once prepare_package() succeeded, -1 if it failed */
+	struct report_op *report; /* entry for --report, not owned */
+};
+
+static void install_package_free(struct install_package *pkg)
+{
+	free(pkg->pkgname);
+	pkg->pkgname = NULL;
+	free(pkg->bundleidentifier);
+	pkg->bundleidentifier = NULL;
+	plist_free(pkg->info);
+	pkg->info = NULL;
+	if (pkg->client_opts) {
+		instproxy_client_options_free(pkg->client_opts);
+		pkg->client_opts = NULL;
+	}
+}
+
+/* The status thread of the previous asynchronous command might not have
+ * exited yet right after it reported completion; wait a bit in that case. */
+static int instproxy_retry_busy(instproxy_error_t err)
+{
+	if (err == INSTPROXY_E_OP_IN_PROGRESS) {
+		metrics_count_retry();
+		wait_ms(50);
+		return 1;
+	}
+	return 0;
+}
+
+static int afc_get_free_bytes(afc_client_t afc, uint64_t *free_bytes)
+{
+	char *val = NULL;
+	if ((afc_get_device_info_key(afc, "FSFreeBytes", &val) != AFC_E_SUCCESS) || !val) {
+		return -1;
+	}
+	*free_bytes = strtoull(val, NULL, 10);
+	free(val);
+	return 0;
+}
+
+static int read_package(struct install_package *pkg)
+{
+	plist_t sinf = NULL;
+	plist_t meta = NULL;
+	struct stat fst;
+	const char *path = pkg->path;
+
+	if (stat(path, &fst) != 0) {
+		fprintf(stderr, "ERROR: stat: %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	pkg->client_opts = instproxy_client_options_new();
+
+	/* open install package */
+	ZipParser *zp = NULL;
+
+	if ((strlen(path) > 5) && (strcmp(&path[strlen(path)-5], ".ipcc") == 0)) {
+		pkg->type = PACKAGE_TYPE_IPCC;
+
+		char* ipcc = strdup(path);
+		if (asprintf(&pkg->pkgname, "%s/%s", PKG_PATH, basename(ipcc)) < 0) {
+			fprintf(stderr, "ERROR: Out of memory allocating pkgname!?\n");
+			free(ipcc);
+			return -1;
+		}
+		free(ipcc);
+
+		instproxy_client_options_add(pkg->client_opts, "PackageType", "CarrierBundle", NULL);
+	} else if (S_ISDIR(fst.st_mode)) {
+		pkg->type = PACKAGE_TYPE_DIRECTORY;
+
+		instproxy_client_options_add(pkg->client_opts, "PackageType", "Developer", NULL);
+
+		char *dirname = strdup(path);
+		if (asprintf(&pkg->pkgname, "%s/%s", PKG_PATH, basename(dirname)) < 0) {
+			fprintf(stderr, "ERROR: Out of memory allocating pkgname!?\n");
+			free(dirname);
+			return -1;
+		}
+		free(dirname);
+
+		/* extract the CFBundleIdentifier from the package */
+
+		/* construct full filename to Info.plist */
+		char *filename = (char*)malloc(strlen(path)+11+1);
+		strcpy(filename, path);
+		strcat(filename, "/Info.plist");
+
+		size_t filesize = 0;
+		char *ibuf = buf_from_file(filename, &filesize);
+		if (!ibuf) {
+			fprintf(stderr, "ERROR: could not locate %s in app!\n", filename);
+			free(filename);
+			return -1;
+		}
+		free(filename);
+
+		plist_from_memory(ibuf, filesize, &pkg->info, NULL);
+		free(ibuf);
+
+		if (!pkg->info) {
+			fprintf(stderr, "ERROR: could not parse Info.plist!\n");
+			return -1;
+		}
+
+		plist_t bname = plist_dict_get_item(pkg->info, "CFBundleIdentifier");
+		if (bname) {
+			plist_get_string_val(bname, &pkg->bundleidentifier);
+		}
+	} else {
+		pkg->type = PACKAGE_TYPE_ARCHIVE;
+		pkg->size = fst.st_size;
+
+		zp = r_zip_open(path);
+		if (!zp) {
+			fprintf(stderr, "ERROR: r_zip_open: %s\n", path);
+			return -1;
+		}
+
+		char *zbuf = NULL;
+		uint32_t len = 0;
+		plist_t meta_dict = NULL;
+
+		if (extmeta) {
+			size_t flen = 0;
+			zbuf = buf_from_file(extmeta, &flen);
+			if (zbuf && flen) {
+				meta = plist_new_data(zbuf, flen);
+				plist_from_memory(zbuf, flen, &meta_dict, NULL);
+				free(zbuf);
+			}
+			if (!meta_dict) {
+				plist_free(meta);
+				meta = NULL;
+				fprintf(stderr, "WARNING: could not load external iTunesMetadata %s!\n", extmeta);
+			}
+			zbuf = NULL;
+		}
+
+		if (!meta && !meta_dict) {
+			/* extract iTunesMetadata.plist from package */
+
+			if (r_get_content(zp, ITUNES_METADATA_PLIST_FILENAME, &zbuf, &len) == 0) {
+				meta = plist_new_data(zbuf, len);
+				plist_from_memory(zbuf, len, &meta_dict, NULL);
+			}
+			if (!meta_dict) {
+				plist_free(meta);
+				meta = NULL;
+				fprintf(stderr, "WARNING: could not locate %s in archive!\n", ITUNES_METADATA_PLIST_FILENAME);
+			}
+			free(zbuf);
+		}
+		plist_free(meta_dict);
+
+		/* determine .app directory in archive */
+		zbuf = NULL;
+		len = 0;
+		char* filename = NULL;
+		char* app_directory_name = NULL;
+
+		if (r_get_app_directory(zp, &app_directory_name) != 0) {
+			fprintf(stderr, "ERROR: Unable to locate .app directory in archive. Make sure it is inside a 'Payload' directory.\n");
+			plist_free(meta);
+			r_zip_close(zp);
+			return -1;
+		}
+
+		/* construct full filename to Info.plist */
+		filename = (char*)malloc(strlen(app_directory_name)+10+1);
+		strcpy(filename, app_directory_name);
+		free(app_directory_name);
+		app_directory_name = NULL;
+		strcat(filename, "Info.plist");
+
+		if (r_get_content(zp, filename, &zbuf, &len) < 0) {
+			fprintf(stderr, "WARNING: could not locate %s in archive!\n", filename);
+			free(filename);
+			plist_free(meta);
+			r_zip_close(zp);
+			return -1;
+		}
+		free(filename);
+		plist_from_memory(zbuf, len, &pkg->info, NULL);
+		free(zbuf);
+
+		if (!pkg->info) {
+			fprintf(stderr, "Could not parse Info.plist!\n");
+			plist_free(meta);
+			r_zip_close(zp);
+			return -1;
+		}
+
+		char *bundleexecutable = NULL;
+
+		plist_t bname = plist_dict_get_item(pkg->info, "CFBundleExecutable");
+		if (bname) {
+			plist_get_string_val(bname, &bundleexecutable);
+		}
+
+		bname = plist_dict_get_item(pkg->info, "CFBundleIdentifier");
+		if (bname) {
+			plist_get_string_val(bname, &pkg->bundleidentifier);
+		}
+
+		if (!bundleexecutable) {
+			fprintf(stderr, "Could not determine value for CFBundleExecutable!\n");
+			plist_free(meta);
+			r_zip_close(zp);
+			return -1;
+		}
+
+		if (extsinf) {
+			size_t flen = 0;
+			zbuf = buf_from_file(extsinf, &flen);
+			if (zbuf && flen) {
+				sinf = plist_new_data(zbuf, flen);
+				free(zbuf);
+			} else {
+				fprintf(stderr, "WARNING: could not load external SINF %s!\n", extsinf);
+			}
+			zbuf = NULL;
+		}
+
+		if (!sinf) {
+			char *sinfname = NULL;
+			if (asprintf(&sinfname, "Payload/%s.app/SC_Info/%s.sinf", bundleexecutable, bundleexecutable) < 0) {
+				fprintf(stderr, "Out of memory!?\n");
+				free(bundleexecutable);
+				plist_free(meta);
+				r_zip_close(zp);
+				return -1;
+			}
+
+			/* extract .sinf from package */
+			zbuf = NULL;
+			len = 0;
+			if (r_get_content(zp, sinfname, &zbuf, &len) == 0) {
+				sinf = plist_new_data(zbuf, len);
+			} else {
+				fprintf(stderr, "WARNING: could not locate %s in archive!\n", sinfname);
+			}
+			free(sinfname);
+			free(zbuf);
+		}
+		free(bundleexecutable);
+		r_zip_close(zp);
+
+		if (asprintf(&pkg->pkgname, "%s/%s", PKG_PATH, pkg->bundleidentifier) < 0) {
+			fprintf(stderr, "Out of memory!?\n");
+			plist_free(sinf);
+			plist_free(meta);
+			return -1;
+		}
+
+		if (pkg->bundleidentifier) {
+			instproxy_client_options_add(pkg->client_opts, "CFBundleIdentifier", pkg->bundleidentifier, NULL);
+		}
+		if (sinf) {
+			instproxy_client_options_add(pkg->client_opts, "ApplicationSINF", sinf, NULL);
+			plist_free(sinf);
+		}
+		if (meta) {
+			instproxy_client_options_add(pkg->client_opts, "iTunesMetadata", meta, NULL);
+			plist_free(meta);
+		}
+	}
+
+	return 0;
+}
+
+/* Copies a prepared package to pkg->pkgname on the device. */
+static int upload_package(afc_client_t afc, struct install_package *pkg)
+{
+	const char *path = pkg->path;
+	uint64_t af = 0;
+
+	if (pkg->type == PACKAGE_TYPE_IPCC) {
+		ZipParser *zp = r_zip_open(path);
+		if (!zp) {
+			fprintf(stderr, "ERROR: r_zip_open: %s\n", path);
+			return -1;
+		}
+
+		char* ipcc = strdup(path);
+		afc_make_directory(afc, pkg->pkgname);
+
+		if (!quiet) {
+			printf("Uploading %s package contents... ", basename(ipcc));
+		}
+
+		while (r_zip_get_next_entry(zp)) {
+			const char* zname = zp->filename;
+			char* dstpath = NULL;
+			if (!zname) continue;
+
+			if (zname[strlen(zname)-1] == '/') {
+				// directory
+				if ((asprintf(&dstpath, "%s/%s/%s", PKG_PATH, basename(ipcc), zname) > 0) && dstpath) {
+					afc_make_directory(afc, dstpath);
+				}
+				free(dstpath);
+				dstpath = NULL;
+			} else {
+				uint64_t trace_start = trace_begin();
+				if ((asprintf(&dstpath, "%s/%s/%s", PKG_PATH, basename(ipcc), zname) <= 0) || !dstpath || (afc_file_open(afc, dstpath, AFC_FOPEN_WRONLY, &af) != AFC_E_SUCCESS)) {
+					fprintf(stderr, "ERROR: can't open afc://%s for writing\n", dstpath);
+					free(dstpath);
+					dstpath = NULL;
+					continue;
+				}
+				trace_end("afc", "afc_file_open", dstpath, trace_start, -1);
+				free(dstpath);
+
+				if (!r_extract_current(zp, afc, af)) {
+					afc_file_close(afc, af);
+					r_zip_close(zp);
+					free(ipcc);
+					return -1;
+				}
+
+				afc_file_close(afc, af);
+				af = 0;
+			}
+		}
+
+		r_zip_close(zp);
+		free(ipcc);
+		if (!quiet) {
+			printf("DONE.\n");
+		}
+	} else if (pkg->type == PACKAGE_TYPE_DIRECTORY) {
+		/* upload developer app directory */
+		if (!quiet) {
+			char *dirname = strdup(path);
+			printf("Uploading %s package contents... ", basename(dirname));
+			free(dirname);
+		}
+		afc_upload_dir(afc, path, pkg->pkgname);
+		if (!quiet) {
+			printf("DONE.\n");
+		}
+	} else {
+		/* copy archive to device */
+		if (!quiet) {
+			printf("Copying '%s' to device... ", path);
+		}
+
+		if (afc_upload_file(afc, path, pkg->pkgname, NULL) < 0) {
+			if (!quiet) {
+				printf("FAILED\n");
+			}
+			return -1;
+		}
+
+		if (!quiet) {
+			printf("DONE.\n");
+		}
+	}
+
+	return 0;
+}
+
+/* Reads the package from disk and fills in everything needed to upload and
+ * install it: Info.plist, SINF, iTunesMetadata, the destination name on
+ * the device, and the client options. Does not talk to the device. */
+static int prepare_package(struct install_package *pkg)
+{
+	uint64_t trace_start = trace_begin();
+	uint64_t report_start = time_now_us();
+	int res = read_package(pkg);
+	trace_end("package", "Read package", pkg->path, trace_start, (res == 0) ? (int64_t)pkg->size : -1);
+	report_op_phase(pkg->report, "Prepare", report_start);
+	if (res == 0) {
+		report_op_set_package(pkg->report, pkg->bundleidentifier, pkg->size);
+	}
+	return res;
+}
+
+/* Upload the package to PKG_PATH on the device and fill in the client
+ * options needed to install it. Returns 0 on success, -1 otherwise. */
+static int stage_package(afc_client_t afc, struct install_package *pkg)
+{
+	if (!pkg->client_opts && prepare_package(pkg) < 0) {
+		return -1;
+	}
+	uint64_t trace_start = trace_begin();
+	uint64_t report_start = time_now_us();
+	int res = upload_package(afc, pkg);
+	trace_end("afc", "Upload package", pkg->path, trace_start, (res == 0) ? (int64_t)pkg->size : -1);
+	report_op_phase(pkg->report, "Upload", report_start);
+	if (res == 0) {
+		report_op_uploaded(pkg->report, pkg->size);
+	}
+	return res;
+}
+
+/* Returns 1 if pkg would be uploaded to the same path on the device as one
+ * of pkgs[first] to pkgs[last-1], which are staged but not installed yet
+ * (e.g. two builds of the same app). */
+static int package_path_in_use(struct install_package *pkgs, int first, int last, struct install_package *pkg)
+{
+	int i;
+
+	for (i = first; i < last; i++) {
+		if (pkgs[i].pkgname && pkg->pkgname && !strcmp(pkgs[i].pkgname, pkg->pkgname)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Checks with a single-bundle lookup whether the device already has the
+ * prepared package installed in the same CFBundleVersion. Returns 1 if so,
+ * 0 if the package needs to be installed. */
+static int package_is_installed(instproxy_client_t ipc, struct install_package *pkg)
+{
+	plist_t client_opts = NULL;
+	plist_t result = NULL;
+	const char *appids[2] = { NULL, NULL };
+	instproxy_error_t err;
+	int res = 0;
+
+	/* carrier bundles don't have an app Info.plist */
+	appids[0] = pkg->bundleidentifier;
+	const char *version = plist_get_string_ptr(plist_dict_get_item(pkg->info, "CFBundleVersion"), NULL);
+	if (!appids[0] || !version) {
+		return 0;
+	}
+
+	client_opts = instproxy_client_options_new();
+	instproxy_client_options_set_return_attributes(client_opts, "CFBundleIdentifier", "CFBundleVersion", NULL);
+	do {
+		err = instproxy_lookup(ipc, appids, client_opts, &result);
+	} while (instproxy_retry_busy(err));
+	instproxy_client_options_free(client_opts);
+
+	if (err == INSTPROXY_E_SUCCESS) {
+		plist_t app = plist_dict_get_item(result, appids[0]);
+		const char *installed = plist_get_string_ptr(plist_dict_get_item(app, "CFBundleVersion"), NULL);
+		if (installed && !strcmp(installed, version)) {
+			res = 1;
+		}
+	}
+	plist_free(result);
+
+	return res;
+}
+
+/* Reads only the lockdown values preflight_package() uses; the whole
+ * default domain is much larger. */
+static plist_t preflight_device_info(lockdownd_client_t client)
+{
+	const char *keys[] = { "ProductVersion", "DeviceClass", NULL };
+	plist_t info = plist_new_dict();
+	int i;
+
+	for (i = 0; keys[i]; i++) {
+		plist_t val = NULL;
+		if (lockdownd_get_value(client, NULL, keys[i], &val) == LOCKDOWN_E_SUCCESS && val) {
+			plist_dict_set_item(info, keys[i], val);
+		}
+	}
+	return info;
+}
+
+/* The archive is uploaded and then extracted by installd, so it needs
+ * about twice its size. Returns -1 with reason set if free_bytes is less. */
+static int preflight_free_space(struct install_package *pkg, uint64_t free_bytes, char *reason, size_t reason_size)
+{
+	if (pkg->size > 0 && free_bytes < pkg->size * 2) {
+		snprintf(reason, reason_size, "Not enough free space: %" PRIu64 " bytes free, %" PRIu64 " needed", free_bytes, pkg->size * 2);
+		return -1;
+	}
+	return 0;
+}
+
+/* Checks a prepared package against the device before uploading it:
+ * MinimumOSVersion, UIDeviceFamily, UIRequiredDeviceCapabilities, and free
+ * space. device_info are the lockdown values of the device, afc may be NULL.
+ * Returns 0 if the package can be installed, -1 with reason set if not. */
+static int preflight_package(instproxy_client_t ipc, afc_client_t afc, plist_t device_info, struct install_package *pkg, char *reason, size_t reason_size)
+{
+	uint32_t i;
+
+	if (!preflight || !pkg->info) {
+		return 0;
+	}
+
+	const char *min_os = plist_get_string_ptr(plist_dict_get_item(pkg->info, "MinimumOSVersion"), NULL);
+	const char *os = plist_get_string_ptr(plist_dict_get_item(device_info, "ProductVersion"), NULL);
+	if (min_os && os && version_compare(os, min_os) < 0) {
+		snprintf(reason, reason_size, "Requires iOS %s, device has %s", min_os, os);
+		return -1;
+	}
+
+	/* 1 = iPhone/iPod touch, 2 = iPad (runs iPhone apps too), 3 = Apple TV, 4 = Apple Watch */
+	const char *devclass = plist_get_string_ptr(plist_dict_get_item(device_info, "DeviceClass"), NULL);
+	plist_t families = plist_dict_get_item(pkg->info, "UIDeviceFamily");
+	if (devclass && families) {
+		uint64_t accepted = 0;
+		int supported = 0;
+		if (!strcmp(devclass, "iPhone") || !strcmp(devclass, "iPod")) {
+			accepted = (1 << 1);
+		} else if (!strcmp(devclass, "iPad")) {
+			accepted = (1 << 1) | (1 << 2);
+		} else if (!strcmp(devclass, "AppleTV")) {
+			accepted = (1 << 3);
+		} else if (!strcmp(devclass, "Watch")) {
+			accepted = (1 << 4);
+		}
+		if (plist_get_node_type(families) == PLIST_ARRAY) {
+			for (i = 0; i < plist_array_get_size(families); i++) {
+				uint64_t family = 0;
+				plist_t node = plist_array_get_item(families, i);
+				if (plist_get_node_type(node) == PLIST_INT) {
+					plist_get_uint_val(node, &family);
+				} else if (plist_get_node_type(node) == PLIST_STRING) {
+					family = strtoull(plist_get_string_ptr(node, NULL), NULL, 10);
+				}
+				if (family < 64 && (accepted & (1ULL << family))) {
+					supported = 1;
+				}
+			}
+		} else if (plist_get_node_type(families) == PLIST_INT) {
+			uint64_t family = 0;
+			plist_get_uint_val(families, &family);
+			supported = (family < 64 && (accepted & (1ULL << family)));
+		} else {
+			supported = 1;
+		}
+		if (accepted && !supported) {
+			snprintf(reason, reason_size, "Does not support device class %s", devclass);
+			return -1;
+		}
+	}
+
+	plist_t reqcaps = plist_dict_get_item(pkg->info, "UIRequiredDeviceCapabilities");
+	if (reqcaps && ipc) {
+		char *caps[64];
+		uint32_t num_caps = 0;
+		if (plist_get_node_type(reqcaps) == PLIST_ARRAY) {
+			for (i = 0; i < plist_array_get_size(reqcaps) && num_caps < 63; i++) {
+				plist_t node = plist_array_get_item(reqcaps, i);
+				if (plist_get_node_type(node) == PLIST_STRING) {
+					plist_get_string_val(node, &caps[num_caps++]);
+				}
+			}
+		} else if (plist_get_node_type(reqcaps) == PLIST_DICT) {
+			/* only capabilities set to true are required here */
+			plist_dict_iter iter = NULL;
+			plist_dict_new_iter(reqcaps, &iter);
+			while (num_caps < 63) {
+				char *key = NULL;
+				plist_t node = NULL;
+				plist_dict_next_item(reqcaps, iter, &key, &node);
+				if (!key) {
+					break;
+				}
+				if (plist_get_node_type(node) == PLIST_BOOLEAN && plist_bool_val_is_true(node)) {
+					caps[num_caps++] = key;
+				} else {
+					free(key);
+				}
+			}
+			free(iter);
+		}
+		caps[num_caps] = NULL;
+		int match = 1;
+		if (num_caps > 0) {
+			plist_t result = NULL;
+			instproxy_error_t err;
+			do {
+				err = instproxy_check_capabilities_match(ipc, (const char**)caps, NULL, &result);
+			} while (instproxy_retry_busy(err));
+			if (err == INSTPROXY_E_SUCCESS && plist_get_node_type(result) == PLIST_BOOLEAN) {
+				match = plist_bool_val_is_true(result);
+			}
+			plist_free(result);
+		}
+		for (i = 0; i < num_caps; i++) {
+			free(caps[i]);
+		}
+		if (!match) {
+			snprintf(reason, reason_size, "Device lacks required capabilities");
+			return -1;
+		}
+	}
+
+	uint64_t free_bytes = 0;
+	if (afc && afc_get_free_bytes(afc, &free_bytes) == 0 && preflight_free_space(pkg, free_bytes, reason, reason_size) < 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Reads and checks a package in a thread while it is being uploaded. */
+struct package_check {
+	struct install_package *pkg;
+	instproxy_client_t ipc;
+	plist_t device_info;
+	int skip_installed;
+	uint64_t free_bytes;     /* taken before the upload started */
+	int have_free_bytes;
+	int result;              /* 0 to install, 1 if installed already, -1 if rejected */
+	const char *error;
+	char reason[256];
+	volatile int cancel;     /* stops the upload early */
+};
+
+static void* package_check_thread(void *arg)
+{
+	struct package_check *check = (struct package_check*)arg;
+
+	check->result = 0;
+	if (!check->pkg->client_opts && prepare_package(check->pkg) < 0) {
+		check->result = -1;
+		check->error = "InvalidPackage";
+		snprintf(check->reason, sizeof(check->reason), "Could not read package");
+	} else if (check->skip_installed && package_is_installed(check->ipc, check->pkg) == 1) {
+		check->result = 1;
+	} else if (preflight_package(check->ipc, NULL, check->device_info, check->pkg, check->reason, sizeof(check->reason)) < 0) {
+		check->result = -1;
+		check->error = "PreflightFailed";
+	} else if (preflight && check->pkg->info && check->have_free_bytes
+	           && preflight_free_space(check->pkg, check->free_bytes, check->reason, sizeof(check->reason)) < 0) {
+		check->result = -1;
+		check->error = "PreflightFailed";
+	}
+	if (check->result != 0) {
+		check->cancel = 1;
+	}
+
+	return NULL;
+}
+
+/* Stages a package with its checks (--if-changed if skip_installed is set,
+ * and the preflight checks). For archives the upload starts right away
+ * under a temporary name while another thread reads and checks the
+ * package; the final name depends on the bundle identifier, so the file is
+ * renamed once both are done. A rejected package stops the upload.
+ * Returns 0 when staged, 1 if the same version is installed already, and
+ * -1 with *error and reason set otherwise. */
+static int stage_package_checked(instproxy_client_t ipc, afc_client_t afc, plist_t device_info, struct install_package *pkg, int skip_installed, const char **error, char *reason, size_t reason_size)
+{
+	struct package_check check;
+	struct stat fst;
+	THREAD_T check_thread = THREAD_T_NULL;
+	char *tmpname = NULL;
+	const char *path = pkg->path;
+	int threaded = 0;
+	int uploaded;
+
+	memset(&check, '\0', sizeof(check));
+	check.pkg = pkg;
+	check.ipc = ipc;
+	check.device_info = device_info;
+	check.skip_installed = skip_installed;
+	/* the upload runs alongside the checks and uses up free space */
+	check.have_free_bytes = (afc_get_free_bytes(afc, &check.free_bytes) == 0);
+
+	/* directories and carrier bundles are uploaded entry by entry to a
+	 * name known up front, check them first */
+	if (pkg->client_opts || stat(path, &fst) != 0 || S_ISDIR(fst.st_mode)
+	    || ((strlen(path) > 5) && (strcmp(&path[strlen(path)-5], ".ipcc") == 0))
+	    || asprintf(&tmpname, "%s/.ideviceinstaller-%" PRIx64 ".part", PKG_PATH, time_now_us()) < 0) {
+		package_check_thread(&check);
+		if (check.result == 0 && stage_package(afc, pkg) < 0) {
+			check.result = -1;
+			check.error = "StagingFailed";
+			snprintf(check.reason, sizeof(check.reason), "Could not upload package to device");
+		}
+		goto leave;
+	}
+
+	threaded = (thread_new(&check_thread, package_check_thread, &check) == 0);
+	if (!threaded) {
+		package_check_thread(&check);
+	}
+	uint64_t trace_start = trace_begin();
+	uint64_t report_start = time_now_us();
+	uploaded = (check.cancel) ? -1 : afc_upload_file(afc, path, tmpname, &check.cancel);
+	trace_end("afc", "Upload package", path, trace_start, (uploaded == 0) ? (int64_t)fst.st_size : -1);
+	report_op_phase(pkg->report, "Upload", report_start);
+	if (uploaded == 0) {
+		report_op_uploaded(pkg->report, fst.st_size);
+	}
+	if (threaded) {
+		thread_join(check_thread);
+		thread_free(check_thread);
+	}
+
+	if (check.result == 0 && uploaded < 0) {
+		check.result = -1;
+		check.error = "StagingFailed";
+		snprintf(check.reason, sizeof(check.reason), "Could not upload package to device");
+	}
+	if (check.result == 0 && afc_rename_path(afc, tmpname, pkg->pkgname) != AFC_E_SUCCESS) {
+		check.result = -1;
+		check.error = "StagingFailed";
+		snprintf(check.reason, sizeof(check.reason), "Could not rename uploaded package");
+	}
+	if (check.result != 0) {
+		afc_remove_path(afc, tmpname);
+	}
+	free(tmpname);
+
+leave:
+	if (check.result < 0) {
+		*error = check.error;
+		snprintf(reason, reason_size, "%s", check.reason);
+		report_op_error(pkg->report, check.error, check.reason, 0);
+	}
+	return check.result;
+}
+
+/* Prepares all packages given on the command line; runs in its own thread
+ * while the connection to the device is set up. */
+static void* prepare_packages_thread(void *arg)
+{
+	struct install_package *pkgs = (struct install_package*)arg;
+	int i;
+
+	trace_thread_name("prepare");
+	for (i = 0; i < num_cmdargs; i++) {
+		if (prepare_package(&pkgs[i]) < 0) {
+			install_package_free(&pkgs[i]);
+			pkgs[i].prepared = -1;
+		} else {
+			pkgs[i].prepared = 1;
+		}
+	}
+
+	return NULL;
+}
+
+struct instproxy_connect {
+	idevice_t device;
+	lockdownd_service_descriptor_t service;
+	instproxy_client_t client;
+	instproxy_error_t error;
+};
+
+static void* instproxy_connect_thread(void *arg)
+{
+	struct instproxy_connect *conn = (struct instproxy_connect*)arg;
+	conn->error = instproxy_client_new(conn->device, conn->service, &conn->client);
+	return NULL;
+}
+
+/* Two-phase install: 'stage' uploads packages and stores the install
+ * options next to them in a small plist, 'commit' installs a staged
+ * package by bundle identifier without uploading it again. */
+#define STAGED_INFO_SUFFIX ".ideviceinstaller.plist"
+
+static char *staged_info_path(const char *key)
+{
+	char *path = NULL;
+	if (asprintf(&path, "%s/%s%s", PKG_PATH, key, STAGED_INFO_SUFFIX) < 0) {
+		return NULL;
+	}
+	return path;
+}
+
+static int afc_write_plist(afc_client_t afc, const char *path, plist_t plist)
+{
+	char *buf = NULL;
+	uint32_t len = 0;
+	uint32_t written = 0;
+	uint64_t af = 0;
+	int res = -1;
+
+	plist_to_bin(plist, &buf, &len);
+	if (!buf) {
+		return -1;
+	}
+	if (afc_file_open(afc, path, AFC_FOPEN_WRONLY, &af) == AFC_E_SUCCESS) {
+		if (afc_file_write(afc, af, buf, len, &written) == AFC_E_SUCCESS && written == len) {
+			res = 0;
+		}
+		afc_file_close(afc, af);
+	}
+	plist_mem_free(buf);
+
+	return res;
+}
+
+static plist_t afc_read_plist(afc_client_t afc, const char *path)
+{
+	char **info = NULL;
+	char *buf = NULL;
+	uint64_t size = 0;
+	uint64_t af = 0;
+	uint32_t total = 0;
+	uint32_t amount = 0;
+	plist_t plist = NULL;
+	int i;
+
+	if (afc_get_file_info(afc, path, &info) != AFC_E_SUCCESS || !info) {
+		return NULL;
+	}
+	for (i = 0; info[i] && info[i+1]; i += 2) {
+		if (!strcmp(info[i], "st_size")) {
+			size = strtoull(info[i+1], NULL, 10);
+		}
+	}
+	afc_dictionary_free(info);
+	if (size == 0 || size > 1048576) {
+		return NULL;
+	}
+
+	if (afc_file_open(afc, path, AFC_FOPEN_RDONLY, &af) != AFC_E_SUCCESS) {
+		return NULL;
+	}
+	buf = (char*)malloc(size);
+	if (!buf) {
+		afc_file_close(afc, af);
+		return NULL;
+	}
+	while (total < size && afc_file_read(afc, af, buf + total, size - total, &amount) == AFC_E_SUCCESS && amount > 0) {
+		total += amount;
+	}
+	afc_file_close(afc, af);
+	if (total == size) {
+		plist_from_memory(buf, total, &plist, NULL);
+	}
+	free(buf);
+
+	return plist;
+}
+
+static void stage_packages(afc_client_t afc, instproxy_client_t ipc, plist_t device_info, struct install_package *pkgs)
+{
+	char reason[256];
+	int i;
+
+	for (i = 0; i < num_cmdargs; i++) {
+		struct install_package *pkg = &pkgs[i];
+
+		if (pkg->prepared < 0) {
+			err_occurred = 1;
+			continue;
+		}
+		if (preflight_package(ipc, afc, device_info, pkg, reason, sizeof(reason)) < 0) {
+			fprintf(stderr, "ERROR: %s: %s\n", pkg->path, reason);
+			install_package_free(pkg);
+			err_occurred = 1;
+			continue;
+		}
+		if (stage_package(afc, pkg) < 0) {
+			install_package_free(pkg);
+			err_occurred = 1;
+			continue;
+		}
+
+		/* carrier bundles have no bundle identifier, use the file name */
+		const char *key = (pkg->bundleidentifier) ? pkg->bundleidentifier : pkg->pkgname + strlen(PKG_PATH) + 1;
+		char *infopath = staged_info_path(key);
+		plist_t staged = plist_new_dict();
+		plist_dict_set_item(staged, "PackagePath", plist_new_string(pkg->pkgname));
+		plist_dict_set_item(staged, "ClientOptions", plist_copy(pkg->client_opts));
+		if (!infopath || afc_write_plist(afc, infopath, staged) < 0) {
+			fprintf(stderr, "ERROR: Could not write afc://%s\n", (infopath) ? infopath : key);
+			err_occurred = 1;
+		} else {
+			printf("Staged '%s', use 'commit %s' to install it.\n", key, key);
+		}
+		plist_free(staged);
+		free(infopath);
+		install_package_free(pkg);
+	}
+}
+
+static void commit_packages(afc_client_t afc, instproxy_client_t ipc)
+{
+	int i;
+
+	for (i = 0; i < num_cmdargs; i++) {
+		const char *key = cmdargs[i];
+		char *infopath = staged_info_path(key);
+		plist_t staged = (infopath) ? afc_read_plist(afc, infopath) : NULL;
+		const char *pkgname = plist_get_string_ptr(plist_dict_get_item(staged, "PackagePath"), NULL);
+		plist_t client_opts = plist_dict_get_item(staged, "ClientOptions");
+		char **finfo = NULL;
+		char *linkname = NULL;
+		instproxy_error_t err;
+		int is_dir = 0;
+		int j;
+
+		free(infopath);
+		if (pkgname && (afc_get_file_info(afc, pkgname, &finfo) != AFC_E_SUCCESS || !finfo)) {
+			fprintf(stderr, "ERROR: The package staged for '%s' was used up by an earlier commit, stage it again.\n", key);
+			plist_free(staged);
+			err_occurred = 1;
+			continue;
+		}
+		if (!pkgname) {
+			fprintf(stderr, "ERROR: No staged package found for '%s'.\n", key);
+			plist_free(staged);
+			err_occurred = 1;
+			continue;
+		}
+		for (j = 0; finfo[j] && finfo[j+1]; j += 2) {
+			if (!strcmp(finfo[j], "st_ifmt") && !strcmp(finfo[j+1], "S_IFDIR")) {
+				is_dir = 1;
+			}
+		}
+		afc_dictionary_free(finfo);
+
+		/* installd consumes the package it installs from; hand it a hard
+		 * link so the staged package can be committed again later.
+		 * Directories can't be hard linked and are used up. */
+		if (is_dir) {
+			printf("NOTE: '%s' is a directory and can only be committed once, stage it again to repeat the install.\n", key);
+		} else {
+			if (asprintf(&linkname, "%s.commit", pkgname) < 0) {
+				linkname = NULL;
+			} else {
+				afc_remove_path(afc, linkname);
+				if (afc_make_link(afc, AFC_HARDLINK, pkgname, linkname) != AFC_E_SUCCESS) {
+					free(linkname);
+					linkname = NULL;
+				}
+			}
+			if (!linkname) {
+				printf("NOTE: Could not link the package staged for '%s', it is used up by this commit; stage it again to repeat the install.\n", key);
+			}
+		}
+
+		free(last_status);
+		last_status = NULL;
+		command_completed = 0;
+		notified = 0;
+		int prev_err = err_occurred;
+		err_occurred = 0;
+
+		printf("Installing '%s'\n", key);
+		do {
+			err = instproxy_install(ipc, (linkname) ? linkname : pkgname, client_opts, status_cb, NULL);
+		} while (instproxy_retry_busy(err));
+		if (err != INSTPROXY_E_SUCCESS) {
+			fprintf(stderr, "ERROR: Could not start installation of '%s' (%d)\n", key, err);
+			err_occurred = 1;
+		} else {
+			wait_for_command_complete = 1;
+			notification_expected = 1;
+			idevice_wait_for_command_to_complete();
+		}
+		err_occurred |= prev_err;
+
+		if (linkname) {
+			afc_remove_path(afc, linkname);
+			free(linkname);
+		}
+		plist_free(staged);
+
+		if (!is_device_connected) {
+			break;
+		}
+	}
+}
+
+#ifndef WIN32
+/* Daemon mode: keeps lockdown, installation_proxy, and AFC connections to
+ * each device open and serves requests from a local socket. Requests and
+ * replies are plist dictionaries, sent as binary plists prefixed with
+ * their big endian 32 bit length. Each reply carries the "Command" of the
+ * request and either the forwarded instproxy "Status" dictionary or a
+ * "Done" flag that terminates the reply stream. */
+
+/* The socket accepts requests that install arbitrary host paths, so it
+ * must not live where other users can reach or pre-create it. Outside of
+ * XDG_RUNTIME_DIR a private directory in /tmp is used, which must be
+ * owned by us and not accessible by anyone else. */
+static char *get_default_socket_path(void)
+{
+	char *path = NULL;
+	const char *rundir = getenv("XDG_RUNTIME_DIR");
+	if (rundir && *rundir) {
+		if (asprintf(&path, "%s/ideviceinstaller.sock", rundir) < 0) {
+			return NULL;
+		}
+	} else {
+		char *dir = NULL;
+		struct stat st;
+		if (asprintf(&dir, "/tmp/ideviceinstaller-%u", (unsigned int)getuid()) < 0) {
+			return NULL;
+		}
+		if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+			fprintf(stderr, "ERROR: Could not create directory %s: %s\n", dir, strerror(errno));
+			free(dir);
+			return NULL;
+		}
+		if (lstat(dir, &st) < 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077)) {
+			fprintf(stderr, "ERROR: %s is not a private directory owned by the current user\n", dir);
+			free(dir);
+			return NULL;
+		}
+		if (asprintf(&path, "%s/daemon.sock", dir) < 0) {
+			path = NULL;
+		}
+		free(dir);
+	}
+	return path;
+}
+
+/* Returns 1 if the process on the other end of fd runs as the same user */
+static int socket_peer_is_owner(int fd)
+{
+#ifdef SO_PEERCRED
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+		return 0;
+	}
+	return (cred.uid == getuid());
+#else
+	uid_t euid = 0;
+	gid_t egid = 0;
+	if (getpeereid(fd, &euid, &egid) < 0) {
+		return 0;
+	}
+	return (euid == getuid());
+#endif
+}
+
+static int socket_send_all(int fd, const char *data, size_t length)
+{
+	size_t sent = 0;
+	while (sent < length) {
+		int r = socket_send(fd, (void*)(data + sent), length - sent);
+		if (r <= 0) {
+			return -1;
+		}
+		sent += r;
+	}
+	return 0;
+}
+
+static int socket_receive_all(int fd, char *data, size_t length)
+{
+	size_t received = 0;
+	while (received < length) {
+		int r = socket_receive_timeout(fd, data + received, length - received, 0, 0);
+		if (r <= 0) {
+			return -1;
+		}
+		received += r;
+	}
+	return 0;
+}
+
+static int message_send(int fd, plist_t msg)
+{
+	char *buf = NULL;
+	uint32_t len = 0;
+	unsigned char hdr[4];
+	int res;
+
+	if ((plist_to_bin(msg, &buf, &len) != PLIST_ERR_SUCCESS) || !buf) {
+		return -1;
+	}
+	hdr[0] = (len >> 24) & 0xFF;
+	hdr[1] = (len >> 16) & 0xFF;
+	hdr[2] = (len >> 8) & 0xFF;
+	hdr[3] = len & 0xFF;
+	res = socket_send_all(fd, (const char*)hdr, sizeof(hdr));
+	if (res == 0) {
+		res = socket_send_all(fd, buf, len);
+	}
+	free(buf);
+	return res;
+}
+
+static int message_receive(int fd, plist_t *msg)
+{
+	unsigned char hdr[4];
+	uint32_t len;
+	char *buf;
+
+	*msg = NULL;
+	if (socket_receive_all(fd, (char*)hdr, sizeof(hdr)) < 0) {
+		return -1;
+	}
+	len = ((uint32_t)hdr[0] << 24) | ((uint32_t)hdr[1] << 16) | ((uint32_t)hdr[2] << 8) | hdr[3];
+	if (len == 0 || len > 0x4000000) {
+		return -1;
+	}
+	buf = (char*)malloc(len);
+	if (!buf) {
+		return -1;
+	}
+	if (socket_receive_all(fd, buf, len) < 0) {
+		free(buf);
+		return -1;
+	}
+	plist_from_memory(buf, len, msg, NULL);
+	free(buf);
+	if (!*msg || (plist_get_node_type(*msg) != PLIST_DICT)) {
+		plist_free(*msg);
+		*msg = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+static int message_send_error(int fd, const char *command, const char *error, const char *description)
+{
+	plist_t msg = plist_new_dict();
+	plist_t status = plist_new_dict();
+	plist_dict_set_item(status, "Error", plist_new_string(error));
+	if (description) {
+		plist_dict_set_item(status, "ErrorDescription", plist_new_string(description));
+	}
+	plist_dict_set_item(msg, "Command", plist_new_string(command));
+	plist_dict_set_item(msg, "Status", status);
+	int res = message_send(fd, msg);
+	plist_free(msg);
+	return res;
+}
+
+#endif
+
+/* Device sessions keep the connections to a device open across commands.
+ * They are used by the daemon and by the workers of the batch scheduler. */
+struct device_session {
+	char *udid;
+	idevice_t device;
+	lockdownd_client_t lockdown;
+	instproxy_client_t ipc;
+	afc_client_t afc;
+	plist_t info;            /* lockdown values of the device */
+	int connected;
+	mutex_t lock;
+	struct device_session *next;
+};
+
+struct session_command {
+	int fd;                  /* daemon client to forward updates to, or -1 */
+	const char *command;
+	struct device_session *session;
+	int completed;
+	int error;
+	char *error_name;
+	int updates;
+	uint64_t update_time;
+	struct trace_phase phase;
+	struct report_op *report;
+	mutex_t lock;
+	cond_t cond;
+};
+
+static struct device_session *device_sessions = NULL;
+static mutex_t device_sessions_lock;
+
+static void device_session_disconnect(struct device_session *session)
+{
+	afc_client_free(session->afc);
+	session->afc = NULL;
+	instproxy_client_free(session->ipc);
+	session->ipc = NULL;
+	lockdownd_client_free(session->lockdown);
+	session->lockdown = NULL;
+	idevice_free(session->device);
+	session->device = NULL;
+	plist_free(session->info);
+	session->info = NULL;
+}
+
+/* Make sure the lockdown and installation_proxy connections of the
+ * session are established. Must be called with session->lock held. */
+static int device_session_connect(struct device_session *session)
+{
+	lockdownd_service_descriptor_t service = NULL;
+
+	if (session->connected && session->ipc) {
+		return 0;
+	}
+	device_session_disconnect(session);
+
+	uint64_t trace_start = trace_begin();
+	if (idevice_new_with_options(&session->device, session->udid, (use_network) ? IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX) != IDEVICE_E_SUCCESS) {
+		return -1;
+	}
+	if (!session->udid) {
+		/* session_event_cb() and device_session_get() read it */
+		char *dev_udid = NULL;
+		idevice_get_udid(session->device, &dev_udid);
+		mutex_lock(&device_sessions_lock);
+		session->udid = dev_udid;
+		mutex_unlock(&device_sessions_lock);
+	}
+	trace_end("device", "Device lookup", session->udid, trace_start, -1);
+	trace_start = trace_begin();
+	if (lockdownd_client_new_with_handshake(session->device, &session->lockdown, "ideviceinstaller") != LOCKDOWN_E_SUCCESS) {
+		device_session_disconnect(session);
+		return -1;
+	}
+	lockdownd_get_value(session->lockdown, NULL, NULL, &session->info);
+	trace_end("device", "Lockdown handshake", session->udid, trace_start, -1);
+	trace_start = trace_begin();
+	if (lockdownd_start_service(session->lockdown, "com.apple.mobile.installation_proxy", &service) != LOCKDOWN_E_SUCCESS) {
+		device_session_disconnect(session);
+		return -1;
+	}
+	instproxy_error_t err = instproxy_client_new(session->device, service, &session->ipc);
+	lockdownd_service_descriptor_free(service);
+	trace_end("device", "Start installation_proxy", session->udid, trace_start, -1);
+	if (err != INSTPROXY_E_SUCCESS) {
+		device_session_disconnect(session);
+		return -1;
+	}
+	session->connected = 1;
+	return 0;
+}
+
+static int device_session_start_afc(struct device_session *session)
+{
+	lockdownd_service_descriptor_t service = NULL;
+
+	if (session->afc) {
+		return 0;
+	}
+	if (lockdownd_start_service(session->lockdown, "com.apple.afc", &service) != LOCKDOWN_E_SUCCESS) {
+		return -1;
+	}
+	afc_error_t aerr = afc_client_new(session->device, service, &session->afc);
+	lockdownd_service_descriptor_free(service);
+	if (aerr != AFC_E_SUCCESS) {
+		return -1;
+	}
+
+	char **strs = NULL;
+	if (afc_get_file_info(session->afc, PKG_PATH, &strs) != AFC_E_SUCCESS) {
+		afc_make_directory(session->afc, PKG_PATH);
+	}
+	afc_dictionary_free(strs);
+	return 0;
+}
+
+/* Returns the (unlocked) session for the given UDID, creating it if needed.
+ * Without UDID the first known session is used. A new session is added to
+ * the list before it connects, so only its own lock is held during the
+ * lockdown handshake; if the connection fails it stays in the list and the
+ * next request tries again. */
+static struct device_session *device_session_get(const char *dev_udid)
+{
+	struct device_session *session;
+	int created = 0;
+
+	mutex_lock(&device_sessions_lock);
+	for (session = device_sessions; session; session = session->next) {
+		if (!dev_udid || (session->udid && !strcmp(session->udid, dev_udid))) {
+			break;
+		}
+	}
+	if (!session) {
+		session = (struct device_session*)calloc(1, sizeof(struct device_session));
+		if (!session) {
+			mutex_unlock(&device_sessions_lock);
+			return NULL;
+		}
+		session->udid = (dev_udid) ? strdup(dev_udid) : NULL;
+		mutex_init(&session->lock);
+		session->next = device_sessions;
+		device_sessions = session;
+		created = 1;
+	}
+	mutex_unlock(&device_sessions_lock);
+
+	if (created) {
+		mutex_lock(&session->lock);
+		int res = device_session_connect(session);
+		mutex_unlock(&session->lock);
+		if (res < 0) {
+			return NULL;
+		}
+	}
+
+	return session;
+}
+
+/* Creates a new session that is not connected yet. It is added to the
+ * session list so it gets notified about device removal. */
+static struct device_session *device_session_new(const char *dev_udid)
+{
+	struct device_session *session = (struct device_session*)calloc(1, sizeof(struct device_session));
+	if (!session) {
+		return NULL;
+	}
+	session->udid = (dev_udid) ? strdup(dev_udid) : NULL;
+	mutex_init(&session->lock);
+
+	mutex_lock(&device_sessions_lock);
+	session->next = device_sessions;
+	device_sessions = session;
+	mutex_unlock(&device_sessions_lock);
+
+	return session;
+}
+
+static void device_session_free(struct device_session *session)
+{
+	struct device_session **pos;
+
+	if (!session) {
+		return;
+	}
+	mutex_lock(&device_sessions_lock);
+	for (pos = &device_sessions; *pos; pos = &(*pos)->next) {
+		if (*pos == session) {
+			*pos = session->next;
+			break;
+		}
+	}
+	mutex_unlock(&device_sessions_lock);
+
+	device_session_disconnect(session);
+	mutex_destroy(&session->lock);
+	free(session->udid);
+	free(session);
+}
+
+static void device_sessions_free(void)
+{
+	mutex_lock(&device_sessions_lock);
+	while (device_sessions) {
+		struct device_session *session = device_sessions;
+		device_sessions = session->next;
+		device_session_disconnect(session);
+		mutex_destroy(&session->lock);
+		free(session->udid);
+		free(session);
+	}
+	mutex_unlock(&device_sessions_lock);
+}
+
+static void session_event_cb(const idevice_event_t* event, void* userdata)
+{
+	struct device_session *session;
+
+	if (event->event != IDEVICE_DEVICE_REMOVE) {
+		return;
+	}
+	mutex_lock(&device_sessions_lock);
+	for (session = device_sessions; session; session = session->next) {
+		if (session->udid && !strcmp(session->udid, event->udid)) {
+			session->connected = 0;
+		}
+	}
+	mutex_unlock(&device_sessions_lock);
+}
+
+static void session_status_cb(plist_t command, plist_t status, void *user_data)
+{
+	struct session_command *req = (struct session_command*)user_data;
+	char *status_name = NULL;
+	char *error_name = NULL;
+	char *error_description = NULL;
+	uint64_t error_code = 0;
+
+	if (!status) {
+		return;
+	}
+	instproxy_status_get_name(status, &status_name);
+	instproxy_status_get_error(status, &error_name, &error_description, &error_code);
+
+	trace_phase_next(&req->phase, "device", (error_name || (status_name && !strcmp(status_name, "Complete"))) ? NULL : status_name);
+	if (strcmp(req->command, "Browse") != 0) {
+		int percent = -1;
+		instproxy_status_get_percent_complete(status, &percent);
+		PROBE3(status, req->command, status_name, percent);
+		metrics_status_update(&req->update_time);
+	}
+	metrics_count_error(error_name, error_code);
+	report_op_status(req->report, (error_name || (status_name && !strcmp(status_name, "Complete"))) ? NULL : status_name);
+	report_op_error(req->report, error_name, error_description, error_code);
+
+#ifndef WIN32
+	if (req->fd >= 0) {
+		plist_t msg = plist_new_dict();
+		plist_dict_set_item(msg, "Command", plist_new_string(req->command));
+		plist_dict_set_item(msg, "Status", plist_copy(status));
+		message_send(req->fd, msg);
+		plist_free(msg);
+	}
+#endif
+
+	mutex_lock(&req->lock);
+	req->updates++;
+	if (error_name) {
+		req->error = 1;
+		req->completed = 1;
+		if (!req->error_name) {
+			req->error_name = error_name;
+			error_name = NULL;
+		}
+	} else if (status_name && !strcmp(status_name, "Complete")) {
+		req->completed = 1;
+	}
+	cond_signal(&req->cond);
+	mutex_unlock(&req->lock);
+
+	free(status_name);
+	free(error_name);
+	free(error_description);
+}
+
+static void session_command_wait(struct session_command *req)
+{
+	mutex_lock(&req->lock);
+	while (!req->completed && req->session->connected) {
+		cond_wait_timeout(&req->cond, &req->lock, 500);
+	}
+	mutex_unlock(&req->lock);
+	trace_phase_next(&req->phase, "device", NULL);
+	report_op_status(req->report, NULL);
+	if (strcmp(req->command, "Browse") != 0) {
+		inventory_cache_invalidate(req->session->udid);
+	}
+}
+
+/* Batch mode: runs the jobs of a job file through the scheduler, using one
+ * device session per worker. */
+
+enum device_filter_op {
+	FILTER_EQ,
+	FILTER_NE,
+	FILTER_LT,
+	FILTER_LE,
+	FILTER_GT,
+	FILTER_GE
+};
+
+/* Condition on a lockdown value of the device, e.g. ProductVersion>=16.0.
+ * EQ and NE match glob patterns, the others compare versions. */
+struct device_filter {
+	char *key;
+	enum device_filter_op op;
+	char *value;
+};
+
+struct batch_job {
+	int command;
+	char *arg;
+	char *error_name;
+	int skipped;
+	struct device_filter *filters;
+	int num_filters;
+};
+
+static scheduler_t batch_sched = NULL;
+
+static const char *batch_command_name(int command)
+{
+	switch (command) {
+		case CMD_INSTALL:
+			return "Install";
+		case CMD_UPGRADE:
+			return "Upgrade";
+		case CMD_UNINSTALL:
+			return "Uninstall";
+		case CMD_SYNC:
+			return "Sync";
+		default:
+			return "Unknown";
+	}
+}
+
+static int device_filter_parse(const char *str, struct device_filter *filter)
+{
+	static const struct {
+		const char *token;
+		enum device_filter_op op;
+	} ops[] = {
+		{ "!=", FILTER_NE }, { "<=", FILTER_LE }, { ">=", FILTER_GE },
+		{ "=", FILTER_EQ }, { "<", FILTER_LT }, { ">", FILTER_GT }
+	};
+	const char *p;
+	unsigned int i;
+
+	for (p = str; *p; p++) {
+		for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+			size_t len = strlen(ops[i].token);
+			if (!strncmp(p, ops[i].token, len)) {
+				if (p == str) {
+					return -1;
+				}
+				filter->key = (char*)malloc(p - str + 1);
+				memcpy(filter->key, str, p - str);
+				filter->key[p - str] = '\0';
+				filter->op = ops[i].op;
+				filter->value = strdup(p + len);
+				return 0;
+			}
+		}
+	}
+	return -1;
+}
+
+static int device_filter_match(const struct device_filter *filter, plist_t info)
+{
+	plist_t node = plist_dict_get_item(info, filter->key);
+	char numbuf[32];
+	const char *val = NULL;
+	int cmp;
+
+	if (plist_get_node_type(node) == PLIST_STRING) {
+		val = plist_get_string_ptr(node, NULL);
+	} else if (plist_get_node_type(node) == PLIST_INT) {
+		uint64_t uval = 0;
+		plist_get_uint_val(node, &uval);
+		snprintf(numbuf, sizeof(numbuf), "%" PRIu64, uval);
+		val = numbuf;
+	} else if (plist_get_node_type(node) == PLIST_BOOLEAN) {
+		val = plist_bool_val_is_true(node) ? "true" : "false";
+	}
+	if (!val) {
+		return (filter->op == FILTER_NE);
+	}
+
+	switch (filter->op) {
+		case FILTER_EQ:
+			return glob_match(filter->value, val);
+		case FILTER_NE:
+			return !glob_match(filter->value, val);
+		default:
+			break;
+	}
+	cmp = version_compare(val, filter->value);
+	switch (filter->op) {
+		case FILTER_LT:
+			return cmp < 0;
+		case FILTER_LE:
+			return cmp <= 0;
+		case FILTER_GT:
+			return cmp > 0;
+		case FILTER_GE:
+			return cmp >= 0;
+		default:
+			return 0;
+	}
+}
+
+static void* batch_worker_init(const char *device, void *user_data)
+{
+	struct device_session *session = device_session_new(device);
+	trace_thread_name(device);
+	if (session) {
+		/* connect right away so the device info is there for matching */
+		mutex_lock(&session->lock);
+		device_session_connect(session);
+		mutex_unlock(&session->lock);
+	}
+	return session;
+}
+
+static int batch_match_job(struct sched_job *job, const char *device, void *worker_data, void *user_data)
+{
+	struct device_session *session = (struct device_session*)worker_data;
+	struct batch_job *bjob = (struct batch_job*)job->data;
+	int i;
+
+	if (!session || !session->info) {
+		return 0;
+	}
+	for (i = 0; i < bjob->num_filters; i++) {
+		if (!device_filter_match(&bjob->filters[i], session->info)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Starts workers for every connected device so they take pool jobs. */
+static void batch_add_pool_devices(void)
+{
+	idevice_info_t *devices = NULL;
+	int count = 0;
+	int i;
+
+	if (idevice_get_device_list_extended(&devices, &count) != IDEVICE_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Unable to retrieve device list!\n");
+		return;
+	}
+	for (i = 0; i < count; i++) {
+		if ((devices[i]->conn_type == CONNECTION_NETWORK) != (use_network != 0)) {
+			continue;
+		}
+		scheduler_add_device(batch_sched, devices[i]->udid);
+	}
+	idevice_device_list_extended_free(devices);
+}
+
+static void batch_job_free(struct batch_job *bjob)
+{
+	int i;
+	for (i = 0; i < bjob->num_filters; i++) {
+		free(bjob->filters[i].key);
+		free(bjob->filters[i].value);
+	}
+	free(bjob->filters);
+	free(bjob->arg);
+	free(bjob->error_name);
+	free(bjob);
+}
+
+static void batch_worker_free(void *worker_data, void *user_data)
+{
+	device_session_free((struct device_session*)worker_data);
+}
+
+static int batch_run_job(struct sched_job *job, void *worker_data, void *user_data)
+{
+	struct device_session *session = (struct device_session*)worker_data;
+	struct batch_job *bjob = (struct batch_job*)job->data;
+	struct session_command req;
+	instproxy_error_t err = INSTPROXY_E_SUCCESS;
+	uint64_t trace_start = 0;
+	int res = -1;
+
+	if (!session) {
+		bjob->error_name = strdup("OutOfMemory");
+		return -1;
+	}
+
+	memset(&req, '\0', sizeof(req));
+	req.fd = -1;
+	req.command = batch_command_name(bjob->command);
+	req.session = session;
+	req.report = report_op_new(req.command, bjob->arg, session->udid);
+	mutex_init(&req.lock);
+	cond_init(&req.cond);
+
+	mutex_lock(&session->lock);
+	if (device_session_connect(session) < 0) {
+		bjob->error_name = strdup("DeviceConnectionFailed");
+		goto leave;
+	}
+
+	if (bjob->command == CMD_INSTALL || bjob->command == CMD_UPGRADE) {
+		struct install_package pkg;
+
+		if (device_session_start_afc(session) < 0) {
+			session->connected = 0;
+			bjob->error_name = strdup("AFCConnectionFailed");
+			goto leave;
+		}
+		memset(&pkg, '\0', sizeof(pkg));
+		pkg.path = bjob->arg;
+		pkg.report = req.report;
+		const char *error = NULL;
+		char reason[256];
+		scheduler_upload_acquire(batch_sched);
+		int r = stage_package_checked(session->ipc, session->afc, session->info, &pkg, if_changed, &error, reason, sizeof(reason));
+		scheduler_upload_release(batch_sched);
+		if (r != 0) {
+			install_package_free(&pkg);
+			if (r == 1) {
+				bjob->skipped = 1;
+				res = 0;
+			} else if (asprintf(&bjob->error_name, "%s (%s)", error, reason) < 0) {
+				bjob->error_name = NULL;
+			}
+			goto leave;
+		}
+		trace_start = trace_begin();
+		do {
+			if (bjob->command == CMD_INSTALL) {
+				err = instproxy_install(session->ipc, pkg.pkgname, pkg.client_opts, session_status_cb, &req);
+			} else {
+				err = instproxy_upgrade(session->ipc, pkg.pkgname, pkg.client_opts, session_status_cb, &req);
+			}
+		} while (instproxy_retry_busy(err));
+		install_package_free(&pkg);
+	} else {
+		trace_start = trace_begin();
+		do {
+			err = instproxy_uninstall(session->ipc, bjob->arg, NULL, session_status_cb, &req);
+		} while (instproxy_retry_busy(err));
+	}
+
+	if (err != INSTPROXY_E_SUCCESS) {
+		session->connected = 0;
+		bjob->error_name = strdup("DeviceConnectionFailed");
+		goto leave;
+	}
+
+	session_command_wait(&req);
+	trace_end("device", req.command, bjob->arg, trace_start, -1);
+	if (!req.completed) {
+		session->connected = 0;
+		bjob->error_name = strdup("DeviceRemoved");
+	} else if (req.error) {
+		bjob->error_name = req.error_name;
+		req.error_name = NULL;
+	} else {
+		res = 0;
+	}
+
+leave:
+	mutex_unlock(&session->lock);
+	if (res < 0) {
+		report_op_error(req.report, (bjob->error_name) ? bjob->error_name : "Unknown", NULL, 0);
+	}
+	report_op_finish(req.report, bjob->skipped);
+	free(req.error_name);
+	cond_destroy(&req.cond);
+	mutex_destroy(&req.lock);
+
+	return res;
+}
+
+static void batch_job_done(struct sched_job *job, void *user_data)
+{
+	struct batch_job *bjob = (struct batch_job*)job->data;
+	double wait = (job->start_time - job->enqueue_time) / 1000000.0;
+	double service = (job->end_time - job->start_time) / 1000000.0;
+
+	if (job->result == 0 && bjob->skipped) {
+		printf("[%s] %s %s: SKIPPED, same version installed (took %.3fs)\n", job->device, batch_command_name(bjob->command), bjob->arg, service);
+	} else if (job->result == 0) {
+		printf("[%s] %s %s: OK (waited %.3fs, took %.3fs)\n", job->device, batch_command_name(bjob->command), bjob->arg, wait, service);
+	} else if (!job->device) {
+		printf("[any] %s %s: FAILED: NoMatchingDevice\n", batch_command_name(bjob->command), bjob->arg);
+	} else {
+		printf("[%s] %s %s: FAILED: %s (waited %.3fs, took %.3fs)\n", job->device, batch_command_name(bjob->command), bjob->arg, (bjob->error_name) ? bjob->error_name : "Unknown", wait, service);
+	}
+
+	batch_job_free(bjob);
+	free(job->device);
+	free(job);
+}
+
+/* Splits line into whitespace separated tokens in place. Double quotes can
+ * be used for tokens containing whitespace. Returns the number of tokens. */
+static int split_line(char *line, char **tokens, int max_tokens)
+{
+	int count = 0;
+	char *p = line;
+
+	while (*p && count < max_tokens) {
+		while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+			p++;
+		}
+		if (!*p || *p == '#') {
+			break;
+		}
+		if (*p == '"') {
+			tokens[count++] = ++p;
+			while (*p && *p != '"') {
+				p++;
+			}
+		} else {
+			tokens[count++] = p;
+			while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') {
+				p++;
+			}
+		}
+		if (*p) {
+			*p++ = '\0';
+		}
+	}
+
+	return count;
+}
+
+static int batch_main(void)
+{
+	struct scheduler_options opts;
+	struct sched_stats stats;
+	char line[4096];
+	int lineno = 0;
+	int res = EXIT_SUCCESS;
+	int have_pool = 0;
+	uint64_t group = 0;
+	FILE *f;
+
+	if (!strcmp(cmdarg, "-")) {
+		f = stdin;
+	} else {
+		f = fopen(cmdarg, "r");
+		if (!f) {
+			fprintf(stderr, "ERROR: fopen: %s: %s\n", cmdarg, strerror(errno));
+			return EXIT_FAILURE;
+		}
+	}
+
+	memset(&opts, '\0', sizeof(opts));
+	opts.device_workers = device_jobs;
+	opts.upload_slots = max_uploads;
+	opts.run = batch_run_job;
+	opts.worker_init = batch_worker_init;
+	opts.worker_free = batch_worker_free;
+	opts.match = batch_match_job;
+	opts.done = batch_job_done;
+	batch_sched = scheduler_new(&opts);
+	if (!batch_sched) {
+		fprintf(stderr, "ERROR: Could not create scheduler\n");
+		if (f != stdin) {
+			fclose(f);
+		}
+		return EXIT_FAILURE;
+	}
+
+	quiet = 1;
+	idevice_event_subscribe(session_event_cb, NULL);
+
+	while (fgets(line, sizeof(line), f)) {
+		char *tokens[16];
+		int command = CMD_NONE;
+		int copies = 1;
+		int priority = 0;
+		int i;
+		struct stat st;
+
+		lineno++;
+		int count = split_line(line, tokens, 16);
+		if (count == 0) {
+			continue;
+		}
+		if (count < 3) {
+			fprintf(stderr, "ERROR: %s:%d: Expected 'UDID COMMAND ARGUMENT [PRIORITY] [FILTER...]'\n", cmdarg, lineno);
+			res = EXIT_FAILURE;
+			continue;
+		}
+		if (!strcmp(tokens[1], "install")) {
+			command = CMD_INSTALL;
+		} else if (!strcmp(tokens[1], "upgrade")) {
+			command = CMD_UPGRADE;
+		} else if (!strcmp(tokens[1], "uninstall")) {
+			command = CMD_UNINSTALL;
+		} else {
+			fprintf(stderr, "ERROR: %s:%d: Unsupported command '%s'\n", cmdarg, lineno, tokens[1]);
+			res = EXIT_FAILURE;
+			continue;
+		}
+		const char *dev_udid = tokens[0];
+		if (!strcmp(dev_udid, "-")) {
+			if (!udid) {
+				fprintf(stderr, "ERROR: %s:%d: UDID '-' requires the -u option\n", cmdarg, lineno);
+				res = EXIT_FAILURE;
+				continue;
+			}
+			dev_udid = udid;
+		} else if (!strcmp(dev_udid, "any") || !strncmp(dev_udid, "any:", 4)) {
+			if (dev_udid[3] == ':') {
+				unsigned int num_copies = 0;
+				if (parse_count(dev_udid + 4, 1024, &num_copies) < 0) {
+					fprintf(stderr, "ERROR: %s:%d: Invalid device count '%s'\n", cmdarg, lineno, dev_udid + 4);
+					res = EXIT_FAILURE;
+					continue;
+				}
+				copies = (int)num_copies;
+			}
+			dev_udid = NULL;
+		}
+
+		struct device_filter *filters = NULL;
+		int num_filters = 0;
+		int invalid = 0;
+		for (i = 3; i < count; i++) {
+			char *endp = NULL;
+			long prio = strtol(tokens[i], &endp, 10);
+			if (endp != tokens[i] && *endp == '\0') {
+				priority = (int)prio;
+				continue;
+			}
+			filters = (struct device_filter*)realloc(filters, (num_filters + 1) * sizeof(struct device_filter));
+			if (device_filter_parse(tokens[i], &filters[num_filters]) < 0) {
+				fprintf(stderr, "ERROR: %s:%d: Invalid filter '%s'\n", cmdarg, lineno, tokens[i]);
+				invalid = 1;
+				break;
+			}
+			num_filters++;
+		}
+		if (!invalid && num_filters > 0 && dev_udid) {
+			fprintf(stderr, "ERROR: %s:%d: Filters are only allowed with 'any' as UDID\n", cmdarg, lineno);
+			invalid = 1;
+		}
+		if (invalid) {
+			for (i = 0; i < num_filters; i++) {
+				free(filters[i].key);
+				free(filters[i].value);
+			}
+			free(filters);
+			res = EXIT_FAILURE;
+			continue;
+		}
+
+		if (!dev_udid && !have_pool) {
+			batch_add_pool_devices();
+			have_pool = 1;
+		}
+		if (copies > 1) {
+			group++;
+		}
+
+		for (i = 0; i < copies; i++) {
+			struct batch_job *bjob = (struct batch_job*)calloc(1, sizeof(struct batch_job));
+			struct sched_job *job = (struct sched_job*)calloc(1, sizeof(struct sched_job));
+			int j;
+			bjob->command = command;
+			bjob->arg = strdup(tokens[2]);
+			if (num_filters > 0) {
+				bjob->filters = (struct device_filter*)calloc(num_filters, sizeof(struct device_filter));
+				for (j = 0; j < num_filters; j++) {
+					bjob->filters[j].key = strdup(filters[j].key);
+					bjob->filters[j].op = filters[j].op;
+					bjob->filters[j].value = strdup(filters[j].value);
+				}
+				bjob->num_filters = num_filters;
+			}
+			job->device = (dev_udid) ? strdup(dev_udid) : NULL;
+			job->group = (copies > 1) ? group : 0;
+			job->priority = priority;
+			if (command != CMD_UNINSTALL && stat(tokens[2], &st) == 0 && !S_ISDIR(st.st_mode)) {
+				job->size = st.st_size;
+			}
+			job->data = bjob;
+			if (scheduler_submit(batch_sched, job) < 0) {
+				fprintf(stderr, "ERROR: %s:%d: Could not queue job\n", cmdarg, lineno);
+				batch_job_free(bjob);
+				free(job->device);
+				free(job);
+				res = EXIT_FAILURE;
+			}
+		}
+		for (i = 0; i < num_filters; i++) {
+			free(filters[i].key);
+			free(filters[i].value);
+		}
+		free(filters);
+	}
+	if (f != stdin) {
+		fclose(f);
+	}
+
+	scheduler_wait(batch_sched);
+	scheduler_get_stats(batch_sched, &stats);
+	scheduler_free(batch_sched);
+	batch_sched = NULL;
+	idevice_event_unsubscribe();
+
+	printf("Finished %u jobs, %u failed\n", stats.completed + stats.unmatched, stats.failed);
+	if (stats.completed > 0) {
+		printf("Queue wait:   avg %.3fs, max %.3fs\n", stats.wait_total / 1000000.0 / stats.completed, stats.wait_max / 1000000.0);
+		printf("Service time: avg %.3fs, max %.3fs\n", stats.service_total / 1000000.0 / stats.completed, stats.service_max / 1000000.0);
+	}
+	if (stats.failed > 0) {
+		res = 128;
+	}
+
+	return res;
+}
+
+/* A manifest describes the desired set of apps on a device as a plist
+ * (XML, binary or JSON) dictionary:
+ *   Apps: array of dictionaries with Path (relative to the manifest), and
+ *         optionally CFBundleIdentifier, CFBundleVersion and Priority
+ *   Uninstall: array of bundle identifiers to remove
+ *   RemoveUnlisted: boolean, remove all other user apps (sync only) */
+struct manifest_app {
+	char *path;
+	char *bundle_id;
+	char *version;
+	int priority;
+};
+
+struct manifest {
+	struct manifest_app *apps;
+	int num_apps;
+	char **uninstall;
+	int num_uninstall;
+	int remove_unlisted;
+};
+
+static void manifest_free(struct manifest *manifest)
+{
+	int i;
+	for (i = 0; i < manifest->num_apps; i++) {
+		free(manifest->apps[i].path);
+		free(manifest->apps[i].bundle_id);
+		free(manifest->apps[i].version);
+	}
+	free(manifest->apps);
+	for (i = 0; i < manifest->num_uninstall; i++) {
+		free(manifest->uninstall[i]);
+	}
+	free(manifest->uninstall);
+	memset(manifest, '\0', sizeof(struct manifest));
+}
+
+static int manifest_load(const char *filename, struct manifest *manifest)
+{
+	plist_t root = NULL;
+	uint32_t i;
+
+	memset(manifest, '\0', sizeof(struct manifest));
+	plist_read_from_file(filename, &root, NULL);
+	if (!root || plist_get_node_type(root) != PLIST_DICT) {
+		fprintf(stderr, "ERROR: Could not read manifest %s\n", filename);
+		plist_free(root);
+		return -1;
+	}
+
+	char *mdir = strdup(filename);
+	const char *basedir = dirname(mdir);
+
+	plist_t apps = plist_dict_get_item(root, "Apps");
+	manifest->apps = (struct manifest_app*)calloc(plist_array_get_size(apps) + 1, sizeof(struct manifest_app));
+	for (i = 0; i < plist_array_get_size(apps); i++) {
+		plist_t app = plist_array_get_item(apps, i);
+		const char *path = plist_get_string_ptr(plist_dict_get_item(app, "Path"), NULL);
+		if (!path) {
+			fprintf(stderr, "ERROR: %s: Apps entry %u has no Path\n", filename, i);
+			free(mdir);
+			plist_free(root);
+			manifest_free(manifest);
+			return -1;
+		}
+		struct manifest_app *mapp = &manifest->apps[manifest->num_apps++];
+#ifdef WIN32
+		int is_absolute = (path[0] == '/' || path[0] == '\\' || (path[0] && path[1] == ':'));
+#else
+		int is_absolute = (path[0] == '/');
+#endif
+		if (is_absolute) {
+			mapp->path = strdup(path);
+		} else if (asprintf(&mapp->path, "%s/%s", basedir, path) < 0) {
+			mapp->path = NULL;
+		}
+		plist_t node = plist_dict_get_item(app, "CFBundleIdentifier");
+		if (node) {
+			plist_get_string_val(node, &mapp->bundle_id);
+		}
+		node = plist_dict_get_item(app, "CFBundleVersion");
+		if (node) {
+			plist_get_string_val(node, &mapp->version);
+		}
+		mapp->priority = (int)plist_dict_get_int(app, "Priority");
+	}
+	free(mdir);
+
+	plist_t uninstall = plist_dict_get_item(root, "Uninstall");
+	manifest->uninstall = (char**)calloc(plist_array_get_size(uninstall) + 1, sizeof(char*));
+	for (i = 0; i < plist_array_get_size(uninstall); i++) {
+		plist_t node = plist_array_get_item(uninstall, i);
+		if (plist_get_node_type(node) == PLIST_STRING) {
+			plist_get_string_val(node, &manifest->uninstall[manifest->num_uninstall++]);
+		}
+	}
+
+	manifest->remove_unlisted = plist_dict_get_bool(root, "RemoveUnlisted");
+	plist_free(root);
+
+	return 0;
+}
+
+/* Hot-plug provisioning: every device that shows up gets the packages of
+ * the manifest installed through the scheduler. */
+struct provision_device {
+	char *udid;
+	uint64_t plug_time;
+	uint64_t ready_time;
+	int jobs_left;
+	int failed;
+	struct provision_device *next;
+};
+
+static struct manifest provision_manifest;
+static struct provision_device *provision_devices = NULL;
+static mutex_t provision_lock;
+
+/* must be called with provision_lock held */
+static struct provision_device *provision_device_find(const char *dev_udid)
+{
+	struct provision_device *pdev;
+	for (pdev = provision_devices; pdev; pdev = pdev->next) {
+		if (!strcmp(pdev->udid, dev_udid)) {
+			break;
+		}
+	}
+	return pdev;
+}
+
+static void provision_device_submit(struct provision_device *pdev, int command, const char *arg, int priority)
+{
+	struct batch_job *bjob = (struct batch_job*)calloc(1, sizeof(struct batch_job));
+	struct sched_job *job = (struct sched_job*)calloc(1, sizeof(struct sched_job));
+	struct stat st;
+
+	bjob->command = command;
+	bjob->arg = strdup(arg);
+	job->device = strdup(pdev->udid);
+	job->priority = priority;
+	if (command != CMD_UNINSTALL && stat(arg, &st) == 0 && !S_ISDIR(st.st_mode)) {
+		job->size = st.st_size;
+	}
+	job->data = bjob;
+	pdev->jobs_left++;
+	if (scheduler_submit(batch_sched, job) < 0) {
+		pdev->jobs_left--;
+		pdev->failed++;
+		batch_job_free(bjob);
+		free(job->device);
+		free(job);
+	}
+}
+
+static void provision_event_cb(const idevice_event_t* event, void* userdata)
+{
+	struct provision_device *pdev;
+	int i;
+
+	session_event_cb(event, userdata);
+
+	if (event->event != IDEVICE_DEVICE_ADD) {
+		return;
+	}
+	if ((event->conn_type == CONNECTION_NETWORK) != (use_network != 0)) {
+		return;
+	}
+	if (udid && strcmp(udid, event->udid)) {
+		return;
+	}
+
+	mutex_lock(&provision_lock);
+	if (provision_device_find(event->udid)) {
+		/* still provisioning from an earlier plug-in */
+		mutex_unlock(&provision_lock);
+		return;
+	}
+	pdev = (struct provision_device*)calloc(1, sizeof(struct provision_device));
+	pdev->udid = strdup(event->udid);
+	pdev->plug_time = time_now_us();
+	pdev->next = provision_devices;
+	provision_devices = pdev;
+	printf("[%s] Device added, provisioning %d packages\n", pdev->udid, provision_manifest.num_apps + provision_manifest.num_uninstall);
+
+	for (i = 0; i < provision_manifest.num_uninstall; i++) {
+		provision_device_submit(pdev, CMD_UNINSTALL, provision_manifest.uninstall[i], 0);
+	}
+	for (i = 0; i < provision_manifest.num_apps; i++) {
+		provision_device_submit(pdev, CMD_INSTALL, provision_manifest.apps[i].path, provision_manifest.apps[i].priority);
+	}
+	mutex_unlock(&provision_lock);
+}
+
+static int provision_run_job(struct sched_job *job, void *worker_data, void *user_data)
+{
+	struct device_session *session = (struct device_session*)worker_data;
+	struct provision_device *pdev;
+	int connected;
+
+	mutex_lock(&session->lock);
+	connected = (device_session_connect(session) == 0);
+	mutex_unlock(&session->lock);
+
+	mutex_lock(&provision_lock);
+	pdev = provision_device_find(job->device);
+	if (connected && pdev && !pdev->ready_time) {
+		pdev->ready_time = time_now_us();
+	}
+	mutex_unlock(&provision_lock);
+
+	return batch_run_job(job, worker_data, user_data);
+}
+
+static void provision_job_done(struct sched_job *job, void *user_data)
+{
+	struct provision_device *pdev;
+	struct provision_device **pos;
+
+	mutex_lock(&provision_lock);
+	pdev = provision_device_find(job->device);
+	if (pdev) {
+		pdev->jobs_left--;
+		if (job->result != 0) {
+			pdev->failed++;
+		}
+		if (pdev->jobs_left == 0) {
+			uint64_t now = time_now_us();
+			printf("[%s] Provisioning %s: ready after %.3fs, done after %.3fs, %d failed\n", pdev->udid, (pdev->failed) ? "FAILED" : "complete",
+				(pdev->ready_time) ? (pdev->ready_time - pdev->plug_time) / 1000000.0 : 0.0,
+				(now - pdev->plug_time) / 1000000.0, pdev->failed);
+			for (pos = &provision_devices; *pos; pos = &(*pos)->next) {
+				if (*pos == pdev) {
+					*pos = pdev->next;
+					break;
+				}
+			}
+			free(pdev->udid);
+			free(pdev);
+		}
+	}
+	mutex_unlock(&provision_lock);
+
+	batch_job_done(job, user_data);
+}
+
+static int watch_main(void)
+{
+	struct scheduler_options opts;
+	struct sched_stats stats;
+
+	if (manifest_load(provision_manifest_path, &provision_manifest) < 0) {
+		return EXIT_FAILURE;
+	}
+	if (provision_manifest.num_apps + provision_manifest.num_uninstall == 0) {
+		fprintf(stderr, "ERROR: Manifest %s does not list any packages\n", provision_manifest_path);
+		manifest_free(&provision_manifest);
+		return EXIT_FAILURE;
+	}
+
+	memset(&opts, '\0', sizeof(opts));
+	opts.device_workers = device_jobs;
+	opts.upload_slots = max_uploads;
+	opts.run = provision_run_job;
+	opts.worker_init = batch_worker_init;
+	opts.worker_free = batch_worker_free;
+	opts.done = provision_job_done;
+	batch_sched = scheduler_new(&opts);
+	if (!batch_sched) {
+		fprintf(stderr, "ERROR: Could not create scheduler\n");
+		manifest_free(&provision_manifest);
+		return EXIT_FAILURE;
+	}
+
+	quiet = 1;
+	mutex_init(&provision_lock);
+
+#ifndef WIN32
+	signal(SIGINT, quit_signal_handler);
+	signal(SIGTERM, quit_signal_handler);
+#endif
+
+	printf("Waiting for devices, press Ctrl+C to stop.\n");
+	idevice_event_subscribe(provision_event_cb, NULL);
+	while (!quit_requested) {
+		wait_ms(100);
+	}
+	idevice_event_unsubscribe();
+
+	scheduler_get_stats(batch_sched, &stats);
+	scheduler_free(batch_sched);
+	batch_sched = NULL;
+
+	while (provision_devices) {
+		struct provision_device *pdev = provision_devices;
+		provision_devices = pdev->next;
+		free(pdev->udid);
+		free(pdev);
+	}
+	mutex_destroy(&provision_lock);
+	manifest_free(&provision_manifest);
+
+	printf("Finished %u jobs, %u failed\n", stats.completed, stats.failed);
+
+	return EXIT_SUCCESS;
+}
+
+/* Sync: one job per device browses the installed user apps, compares them
+ * with the manifest and queues the missing installs, upgrades and
+ * uninstalls for the same device. */
+static struct manifest sync_manifest;
+
+static void sync_submit(const char *dev_udid, int command, const char *arg, int priority)
+{
+	struct batch_job *bjob = (struct batch_job*)calloc(1, sizeof(struct batch_job));
+	struct sched_job *job = (struct sched_job*)calloc(1, sizeof(struct sched_job));
+	struct stat st;
+
+	bjob->command = command;
+	bjob->arg = strdup(arg);
+	job->device = strdup(dev_udid);
+	job->priority = priority;
+	if (command != CMD_UNINSTALL && stat(arg, &st) == 0 && !S_ISDIR(st.st_mode)) {
+		job->size = st.st_size;
+	}
+	job->data = bjob;
+	if (scheduler_submit(batch_sched, job) < 0) {
+		batch_job_free(bjob);
+		free(job->device);
+		free(job);
+	}
+}
+
+static int sync_run_job(struct sched_job *job, void *worker_data, void *user_data)
+{
+	struct device_session *session = (struct device_session*)worker_data;
+	struct batch_job *bjob = (struct batch_job*)job->data;
+	plist_t client_opts = NULL;
+	plist_t apps = NULL;
+	plist_t installed = NULL;
+	instproxy_error_t err;
+	uint32_t i;
+	int changes = 0;
+	int j;
+
+	if (bjob->command != CMD_SYNC) {
+		return batch_run_job(job, worker_data, user_data);
+	}
+	if (!session) {
+		bjob->error_name = strdup("OutOfMemory");
+		return -1;
+	}
+
+	client_opts = instproxy_client_options_new();
+	instproxy_client_options_add(client_opts, "ApplicationType", "User", NULL);
+	instproxy_client_options_set_return_attributes(client_opts, "CFBundleIdentifier", "CFBundleVersion", NULL);
+
+	mutex_lock(&session->lock);
+	if (device_session_connect(session) < 0) {
+		mutex_unlock(&session->lock);
+		instproxy_client_options_free(client_opts);
+		bjob->error_name = strdup("DeviceConnectionFailed");
+		return -1;
+	}
+	do {
+		err = instproxy_browse(session->ipc, client_opts, &apps);
+	} while (instproxy_retry_busy(err));
+	if (err != INSTPROXY_E_SUCCESS) {
+		session->connected = 0;
+	}
+	mutex_unlock(&session->lock);
+	instproxy_client_options_free(client_opts);
+
+	if (err != INSTPROXY_E_SUCCESS || !apps) {
+		plist_free(apps);
+		bjob->error_name = strdup("BrowseFailed");
+		return -1;
+	}
+
+	/* index the installed apps by bundle identifier */
+	installed = plist_new_dict();
+	for (i = 0; i < plist_array_get_size(apps); i++) {
+		plist_t app = plist_array_get_item(apps, i);
+		const char *bundle_id = plist_get_string_ptr(plist_dict_get_item(app, "CFBundleIdentifier"), NULL);
+		if (bundle_id) {
+			plist_t version = plist_dict_get_item(app, "CFBundleVersion");
+			plist_dict_set_item(installed, bundle_id, (version) ? plist_copy(version) : plist_new_string(""));
+		}
+	}
+	plist_free(apps);
+
+	for (j = 0; j < sync_manifest.num_apps; j++) {
+		struct manifest_app *mapp = &sync_manifest.apps[j];
+		plist_t node = plist_dict_get_item(installed, mapp->bundle_id);
+		if (!node) {
+			printf("[%s] install %s (%s %s)\n", job->device, mapp->bundle_id, mapp->path, (mapp->version) ? mapp->version : "");
+			if (!dry_run) {
+				sync_submit(job->device, CMD_INSTALL, mapp->path, mapp->priority);
+			}
+			changes++;
+		} else {
+			const char *version = plist_get_string_ptr(node, NULL);
+			int cmp = (mapp->version && version) ? version_compare(version, mapp->version) : 0;
+			if (cmp > 0) {
+				/* installd refuses downgrades, don't push one */
+				printf("[%s] skip %s (installed %s is newer than %s)\n", job->device, mapp->bundle_id, version, mapp->version);
+			} else if (cmp < 0) {
+				printf("[%s] upgrade %s (%s -> %s)\n", job->device, mapp->bundle_id, version, mapp->version);
+				if (!dry_run) {
+					sync_submit(job->device, CMD_UPGRADE, mapp->path, mapp->priority);
+				}
+				changes++;
+			}
+			/* whatever is left in the index is not part of the manifest */
+			plist_dict_remove_item(installed, mapp->bundle_id);
+		}
+	}
+	for (j = 0; j < sync_manifest.num_uninstall; j++) {
+		if (plist_dict_get_item(installed, sync_manifest.uninstall[j])) {
+			printf("[%s] uninstall %s\n", job->device, sync_manifest.uninstall[j]);
+			if (!dry_run) {
+				sync_submit(job->device, CMD_UNINSTALL, sync_manifest.uninstall[j], 0);
+			}
+			plist_dict_remove_item(installed, sync_manifest.uninstall[j]);
+			changes++;
+		}
+	}
+	if (sync_manifest.remove_unlisted) {
+		plist_dict_iter iter = NULL;
+		char *key = NULL;
+		plist_dict_new_iter(installed, &iter);
+		do {
+			key = NULL;
+			plist_dict_next_item(installed, iter, &key, NULL);
+			if (key) {
+				printf("[%s] uninstall %s\n", job->device, key);
+				if (!dry_run) {
+					sync_submit(job->device, CMD_UNINSTALL, key, 0);
+				}
+				changes++;
+				free(key);
+			}
+		} while (key);
+		free(iter);
+	}
+	plist_free(installed);
+
+	if (changes == 0) {
+		printf("[%s] up to date\n", job->device);
+	}
+
+	return 0;
+}
+
+static int sync_main(void)
+{
+	struct scheduler_options opts;
+	struct sched_stats stats;
+	idevice_info_t *devices = NULL;
+	int count = 0;
+	int res = EXIT_SUCCESS;
+	int i;
+
+	if (manifest_load(cmdarg, &sync_manifest) < 0) {
+		return EXIT_FAILURE;
+	}
+
+	/* packages without CFBundleIdentifier or CFBundleVersion in the
+	 * manifest are looked up once here instead of once per device */
+	for (i = 0; i < sync_manifest.num_apps; i++) {
+		struct manifest_app *mapp = &sync_manifest.apps[i];
+		if (mapp->bundle_id && mapp->version) {
+			continue;
+		}
+		plist_t info = package_read_info(mapp->path);
+		if (!info) {
+			manifest_free(&sync_manifest);
+			return EXIT_FAILURE;
+		}
+		if (!mapp->bundle_id) {
+			plist_t node = plist_dict_get_item(info, "CFBundleIdentifier");
+			if (node) {
+				plist_get_string_val(node, &mapp->bundle_id);
+			}
+		}
+		if (!mapp->version) {
+			plist_t node = plist_dict_get_item(info, "CFBundleVersion");
+			if (node) {
+				plist_get_string_val(node, &mapp->version);
+			}
+		}
+		plist_free(info);
+		if (!mapp->bundle_id) {
+			fprintf(stderr, "ERROR: Could not determine CFBundleIdentifier of %s\n", mapp->path);
+			manifest_free(&sync_manifest);
+			return EXIT_FAILURE;
+		}
+	}
+
+	memset(&opts, '\0', sizeof(opts));
+	opts.device_workers = device_jobs;
+	opts.upload_slots = max_uploads;
+	opts.run = sync_run_job;
+	opts.worker_init = batch_worker_init;
+	opts.worker_free = batch_worker_free;
+	opts.done = batch_job_done;
+	batch_sched = scheduler_new(&opts);
+	if (!batch_sched) {
+		fprintf(stderr, "ERROR: Could not create scheduler\n");
+		manifest_free(&sync_manifest);
+		return EXIT_FAILURE;
+	}
+
+	quiet = 1;
+	idevice_event_subscribe(session_event_cb, NULL);
+
+	if (udid) {
+		sync_submit(udid, CMD_SYNC, cmdarg, 0);
+	} else if (idevice_get_device_list_extended(&devices, &count) == IDEVICE_E_SUCCESS) {
+		for (i = 0; i < count; i++) {
+			if ((devices[i]->conn_type == CONNECTION_NETWORK) != (use_network != 0)) {
+				continue;
+			}
+			sync_submit(devices[i]->udid, CMD_SYNC, cmdarg, 0);
+		}
+		idevice_device_list_extended_free(devices);
+	} else {
+		fprintf(stderr, "ERROR: Unable to retrieve device list!\n");
+		res = EXIT_FAILURE;
+	}
+
+	scheduler_wait(batch_sched);
+	scheduler_get_stats(batch_sched, &stats);
+	scheduler_free(batch_sched);
+	batch_sched = NULL;
+	idevice_event_unsubscribe();
+	manifest_free(&sync_manifest);
+
+	printf("Finished %u jobs, %u failed\n", stats.completed, stats.failed);
+	if (stats.failed > 0) {
+		res = 128;
+	}
+
+	return res;
+}
+
+/* list --all-devices: browses every connected device concurrently, each on
+ * its own session, and merges the apps into one listing with a udid
+ * attribute added to every app. */
+
+struct list_device {
+	struct session_command req;
+	plist_t client_opts;
+	THREAD_T thread;
+	int threaded;
+};
+
+static mutex_t output_lock;
+
+static void list_device_status_cb(plist_t command, plist_t status, void *user_data)
+{
+	struct session_command *req = (struct session_command*)user_data;
+	uint64_t total = 0;
+	uint64_t current_index = 0;
+	uint64_t current_amount = 0;
+	plist_t current_list = NULL;
+	uint32_t i;
+
+	instproxy_status_get_current_list(status, &total, &current_index, &current_amount, &current_list);
+	if (current_list) {
+		for (i = 0; i < plist_array_get_size(current_list); i++) {
+			plist_dict_set_item(plist_array_get_item(current_list, i), "udid", plist_new_string(req->session->udid));
+		}
+		mutex_lock(&output_lock);
+		if (list_table) {
+			list_table_add(current_list);
+		} else if (output_format) {
+			print_apps_formatted(current_list);
+		} else {
+			print_apps(current_list);
+		}
+		mutex_unlock(&output_lock);
+		plist_free(current_list);
+	}
+
+	session_status_cb(command, status, req);
+}
+
+static void* list_device_thread(void *arg)
+{
+	struct list_device *ldev = (struct list_device*)arg;
+	struct device_session *session = ldev->req.session;
+	instproxy_error_t err = INSTPROXY_E_SUCCESS;
+
+	mutex_lock(&session->lock);
+	if (device_session_connect(session) < 0) {
+		ldev->req.error_name = strdup("DeviceConnectionFailed");
+		goto leave;
+	}
+	do {
+		err = instproxy_browse_with_callback(session->ipc, ldev->client_opts, list_device_status_cb, &ldev->req);
+	} while (instproxy_retry_busy(err));
+	if (err != INSTPROXY_E_SUCCESS) {
+		ldev->req.error_name = strdup("DeviceConnectionFailed");
+		goto leave;
+	}
+	session_command_wait(&ldev->req);
+	if (!ldev->req.completed && !ldev->req.error_name) {
+		ldev->req.error_name = strdup("DeviceRemoved");
+	}
+
+leave:
+	device_session_disconnect(session);
+	session->connected = 0;
+	mutex_unlock(&session->lock);
+
+	return NULL;
+}
+
+static int list_all_devices_main(void)
+{
+	idevice_info_t *devices = NULL;
+	struct list_device *ldevs = NULL;
+	plist_t client_opts = NULL;
+	int count = 0;
+	int num_ldevs = 0;
+	int failed = 0;
+	int i;
+
+	if (idevice_get_device_list_extended(&devices, &count) != IDEVICE_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Unable to retrieve device list!\n");
+		return EXIT_FAILURE;
+	}
+
+	ldevs = (struct list_device*)calloc((count > 0) ? count : 1, sizeof(struct list_device));
+	if (!ldevs) {
+		idevice_device_list_extended_free(devices);
+		return EXIT_FAILURE;
+	}
+
+	/* the options (and the columns) are set up once, before any thread */
+	client_opts = list_client_options_new();
+	list_columns_resolve();
+	mutex_init(&output_lock);
+	idevice_event_subscribe(session_event_cb, NULL);
+
+	setup_stdout_buffering();
+	if (list_table) {
+		/* printed once all devices are done */
+	} else if (output_format) {
+		print_apps_formatted_header();
+	} else {
+		print_apps_header();
+	}
+
+	for (i = 0; i < count; i++) {
+		struct list_device *ldev = &ldevs[num_ldevs];
+		if ((devices[i]->conn_type == CONNECTION_NETWORK) != (use_network != 0)) {
+			continue;
+		}
+		ldev->req.fd = -1;
+		ldev->req.command = "Browse";
+		ldev->req.session = device_session_new(devices[i]->udid);
+		if (!ldev->req.session) {
+			continue;
+		}
+		mutex_init(&ldev->req.lock);
+		cond_init(&ldev->req.cond);
+		ldev->client_opts = plist_copy(client_opts);
+		num_ldevs++;
+		ldev->threaded = (thread_new(&ldev->thread, list_device_thread, ldev) == 0);
+		if (!ldev->threaded) {
+			list_device_thread(ldev);
+		}
+	}
+	idevice_device_list_extended_free(devices);
+
+	for (i = 0; i < num_ldevs; i++) {
+		struct list_device *ldev = &ldevs[i];
+		if (ldev->threaded) {
+			thread_join(ldev->thread);
+			thread_free(ldev->thread);
+		}
+	}
+	idevice_event_unsubscribe();
+
+	if (list_table) {
+		print_app_table();
+	} else if (output_format) {
+		print_apps_formatted_footer();
+	}
+	fflush(stdout);
+
+	for (i = 0; i < num_ldevs; i++) {
+		struct list_device *ldev = &ldevs[i];
+		if (ldev->req.error_name) {
+			fprintf(stderr, "ERROR: Could not list apps on %s: %s\n", ldev->req.session->udid, ldev->req.error_name);
+			failed++;
+		}
+		free(ldev->req.error_name);
+		instproxy_client_options_free(ldev->client_opts);
+		cond_destroy(&ldev->req.cond);
+		mutex_destroy(&ldev->req.lock);
+		device_session_free(ldev->req.session);
+	}
+	free(ldevs);
+	instproxy_client_options_free(client_opts);
+	mutex_destroy(&output_lock);
+
+	if (num_ldevs == 0) {
+		fprintf(stderr, "No device found.\n");
+		return EXIT_FAILURE;
+	}
+	return (failed) ? EXIT_FAILURE : 0;
+}
+
+/* diff: compares the apps of a device or a snapshot file from list --json,
+ * --ndjson or --xml against those of other devices or snapshots. The base
+ * is indexed by CFBundleIdentifier, the targets are read concurrently and
+ * their apps joined against the index as they arrive. */
+
+struct diff_source {
+	const char *name;
+	struct inventory_index *index;   /* when reading the base */
+	struct inventory_diff *diff;     /* when reading a target */
+	struct session_command req;
+	THREAD_T thread;
+	int threaded;
+	int changes;
+};
+
+static int diff_num_targets = 0;
+static plist_t diff_client_opts = NULL;
+
+static void diff_source_add(struct diff_source *src, plist_t app)
+{
+	if (src->index) {
+		inventory_index_add(src->index, app);
+	} else {
+		inventory_diff_add(src->diff, app);
+	}
+}
+
+static void diff_print_change(enum inventory_change change, const char *bundle_id, const char *old_version, const char *new_version, void *user_data)
+{
+	struct diff_source *src = (struct diff_source*)user_data;
+	static const char *change_names[] = { "Added", "Removed", "Changed" };
+
+	src->changes++;
+	mutex_lock(&output_lock);
+	if (output_format) {
+		plist_t entry = plist_new_dict();
+		plist_dict_set_item(entry, "target", plist_new_string(src->name));
+		plist_dict_set_item(entry, "change", plist_new_string(change_names[change]));
+		plist_dict_set_item(entry, "CFBundleIdentifier", plist_new_string(bundle_id));
+		if (old_version) {
+			plist_dict_set_item(entry, "old_version", plist_new_string(old_version));
+		}
+		if (new_version) {
+			plist_dict_set_item(entry, "new_version", plist_new_string(new_version));
+		}
+		print_app_formatted(entry, 1);
+		plist_free(entry);
+	} else {
+		if (diff_num_targets > 1) {
+			printf("[%s] ", src->name);
+		}
+		switch (change) {
+			case INVENTORY_ADDED:
+				printf("Added %s %s\n", bundle_id, new_version);
+				break;
+			case INVENTORY_REMOVED:
+				printf("Removed %s %s\n", bundle_id, old_version);
+				break;
+			case INVENTORY_CHANGED:
+				printf("Changed %s %s -> %s\n", bundle_id, old_version, new_version);
+				break;
+			default:
+				break;
+		}
+	}
+	mutex_unlock(&output_lock);
+}
+
+/* Reads a line of any length into *line, growing it as needed. Returns the
+ * length of the line or -1 at the end of the file. */
+static ssize_t read_line(FILE *f, char **line, size_t *size)
+{
+	size_t len = 0;
+
+	if (!*line) {
+		*size = 4096;
+		*line = (char*)malloc(*size);
+	}
+	while (fgets(*line + len, (int)(*size - len), f)) {
+		len += strlen(*line + len);
+		if (len > 0 && (*line)[len - 1] == '\n') {
+			return len;
+		}
+		*size *= 2;
+		*line = (char*)realloc(*line, *size);
+	}
+	return (len > 0) ? (ssize_t)len : -1;
+}
+
+static int diff_read_snapshot(struct diff_source *src)
+{
+	FILE *f = fopen(src->name, "rb");
+	plist_t apps = NULL;
+	int c;
+
+	if (!f) {
+		src->req.error_name = strdup("SnapshotNotReadable");
+		return -1;
+	}
+	do {
+		c = fgetc(f);
+	} while (c == ' ' || c == '\t' || c == '\r' || c == '\n');
+
+	if (c == '{') {
+		/* --ndjson output, read one app at a time */
+		char *line = NULL;
+		size_t size = 0;
+		ssize_t len;
+		ungetc(c, f);
+		while ((len = read_line(f, &line, &size)) >= 0) {
+			plist_t app = NULL;
+			if (len <= 1) {
+				continue;
+			}
+			plist_from_json(line, (uint32_t)len, &app);
+			if (plist_get_node_type(app) != PLIST_DICT) {
+				plist_free(app);
+				src->req.error_name = strdup("InvalidSnapshot");
+				break;
+			}
+			diff_source_add(src, app);
+			plist_free(app);
+		}
+		free(line);
+		fclose(f);
+		return (src->req.error_name) ? -1 : 0;
+	}
+	fclose(f);
+
+	plist_read_from_file(src->name, &apps, NULL);
+	if (plist_get_node_type(apps) != PLIST_ARRAY) {
+		plist_free(apps);
+		src->req.error_name = strdup("InvalidSnapshot");
+		return -1;
+	}
+	uint32_t i;
+	for (i = 0; i < plist_array_get_size(apps); i++) {
+		diff_source_add(src, plist_array_get_item(apps, i));
+	}
+	plist_free(apps);
+	return 0;
+}
+
+static void diff_status_cb(plist_t command, plist_t status, void *user_data)
+{
+	struct diff_source *src = (struct diff_source*)user_data;
+	uint64_t total = 0;
+	uint64_t current_index = 0;
+	uint64_t current_amount = 0;
+	plist_t current_list = NULL;
+	uint32_t i;
+
+	instproxy_status_get_current_list(status, &total, &current_index, &current_amount, &current_list);
+	if (current_list) {
+		for (i = 0; i < plist_array_get_size(current_list); i++) {
+			diff_source_add(src, plist_array_get_item(current_list, i));
+		}
+		plist_free(current_list);
+	}
+
+	session_status_cb(command, status, &src->req);
+}
+
+static void* diff_source_thread(void *arg)
+{
+	struct diff_source *src = (struct diff_source*)arg;
+	struct device_session *session = NULL;
+	instproxy_error_t err = INSTPROXY_E_SUCCESS;
+	struct stat st;
+
+	if (stat(src->name, &st) == 0) {
+		if (diff_read_snapshot(src) == 0 && src->diff) {
+			inventory_diff_finish(src->diff);
+		}
+		return NULL;
+	}
+
+	session = device_session_new(src->name);
+	if (!session) {
+		src->req.error_name = strdup("DeviceConnectionFailed");
+		return NULL;
+	}
+	src->req.session = session;
+	mutex_lock(&session->lock);
+	if (device_session_connect(session) < 0) {
+		src->req.error_name = strdup("DeviceConnectionFailed");
+		goto leave;
+	}
+	do {
+		err = instproxy_browse_with_callback(session->ipc, diff_client_opts, diff_status_cb, src);
+	} while (instproxy_retry_busy(err));
+	if (err != INSTPROXY_E_SUCCESS) {
+		src->req.error_name = strdup("DeviceConnectionFailed");
+		goto leave;
+	}
+	session_command_wait(&src->req);
+	if (!src->req.completed && !src->req.error_name) {
+		src->req.error_name = strdup("DeviceRemoved");
+	}
+	if (!src->req.error_name && src->diff) {
+		inventory_diff_finish(src->diff);
+	}
+
+leave:
+	device_session_disconnect(session);
+	session->connected = 0;
+	mutex_unlock(&session->lock);
+
+	return NULL;
+}
+
+static int diff_main(void)
+{
+	struct diff_source *srcs = NULL;
+	struct diff_source *base = NULL;
+	int num_srcs = num_cmdargs;
+	int changes = 0;
+	int failed = 0;
+	int i;
+
+	srcs = (struct diff_source*)calloc(num_srcs, sizeof(struct diff_source));
+	if (!srcs) {
+		return EXIT_FAILURE;
+	}
+	diff_num_targets = num_srcs - 1;
+
+	/* only what is needed to compare the apps */
+	diff_client_opts = list_client_options_new();
+	plist_t attrs = plist_new_array();
+	plist_array_append_item(attrs, plist_new_string("CFBundleIdentifier"));
+	plist_array_append_item(attrs, plist_new_string("CFBundleShortVersionString"));
+	plist_array_append_item(attrs, plist_new_string("CFBundleVersion"));
+	plist_dict_set_item(diff_client_opts, "ReturnAttributes", attrs);
+	plist_dict_remove_item(diff_client_opts, "BundleIDs");
+
+	mutex_init(&output_lock);
+	idevice_event_subscribe(session_event_cb, NULL);
+
+	for (i = 0; i < num_srcs; i++) {
+		srcs[i].name = cmdargs[i];
+		srcs[i].req.fd = -1;
+		srcs[i].req.command = "Browse";
+		mutex_init(&srcs[i].req.lock);
+		cond_init(&srcs[i].req.cond);
+	}
+
+	base = &srcs[0];
+	base->index = inventory_index_new();
+	diff_source_thread(base);
+	if (base->req.error_name) {
+		fprintf(stderr, "ERROR: Could not read apps of %s: %s\n", base->name, base->req.error_name);
+		failed++;
+		goto leave;
+	}
+
+	setup_stdout_buffering();
+	if (output_format) {
+		print_apps_formatted_header();
+	}
+	for (i = 1; i < num_srcs; i++) {
+		struct diff_source *src = &srcs[i];
+		src->diff = inventory_diff_new(base->index, diff_print_change, src);
+		src->threaded = (thread_new(&src->thread, diff_source_thread, src) == 0);
+		if (!src->threaded) {
+			diff_source_thread(src);
+		}
+	}
+	for (i = 1; i < num_srcs; i++) {
+		struct diff_source *src = &srcs[i];
+		if (src->threaded) {
+			thread_join(src->thread);
+			thread_free(src->thread);
+		}
+		if (src->req.error_name) {
+			fprintf(stderr, "ERROR: Could not read apps of %s: %s\n", src->name, src->req.error_name);
+			failed++;
+		}
+		changes += src->changes;
+	}
+	if (output_format) {
+		print_apps_formatted_footer();
+	}
+	fflush(stdout);
+
+leave:
+	idevice_event_unsubscribe();
+	for (i = 0; i < num_srcs; i++) {
+		struct diff_source *src = &srcs[i];
+		inventory_diff_free(src->diff);
+		inventory_index_free(src->index);
+		free(src->req.error_name);
+		cond_destroy(&src->req.cond);
+		mutex_destroy(&src->req.lock);
+		device_session_free(src->req.session);
+	}
+	free(srcs);
+	instproxy_client_options_free(diff_client_opts);
+	diff_client_opts = NULL;
+	mutex_destroy(&output_lock);
+
+	if (failed) {
+		return 2;
+	}
+	return (changes) ? 1 : 0;
+}
+
+/* App feed: without --provision, watch keeps a notification_proxy
+ * subscription open on every connected device. The notifications don't
+ * name the app, so each one triggers a browse of only the bundle IDs and
+ * versions, which is joined against the previous one; the apps that were
+ * added or changed are then looked up with all attributes. Every change
+ * is printed as one JSON record per line. */
+struct watch_device {
+	struct device_session *session;
+	struct inventory_index *index;
+	plist_t changes;
+	int pending;             /* notifications not handled yet */
+	int running;
+	int threaded;
+	THREAD_T thread;
+	mutex_t lock;
+	cond_t cond;
+	struct watch_device *next;
+};
+
+static struct watch_device *watch_devices = NULL;
+static mutex_t watch_lock;
+static plist_t watch_browse_opts = NULL;
+static plist_t watch_lookup_opts = NULL;
+
+static void watch_notifier(const char *notification, void *user_data)
+{
+	struct watch_device *wdev = (struct watch_device*)user_data;
+
+	if (notification && (!strcmp(notification, NP_APP_INSTALLED) || !strcmp(notification, NP_APP_UNINSTALLED))) {
+		inventory_cache_invalidate(wdev->session->udid);
+		mutex_lock(&wdev->lock);
+		wdev->pending++;
+		cond_signal(&wdev->cond);
+		mutex_unlock(&wdev->lock);
+	}
+}
+
+static void watch_collect_change(enum inventory_change change, const char *bundle_id, const char *old_version, const char *new_version, void *user_data)
+{
+	struct watch_device *wdev = (struct watch_device*)user_data;
+	static const char *change_names[] = { "Added", "Removed", "Changed" };
+
+	plist_t entry = plist_new_dict();
+	plist_dict_set_item(entry, "udid", plist_new_string(wdev->session->udid));
+	plist_dict_set_item(entry, "change", plist_new_string(change_names[change]));
+	plist_dict_set_item(entry, "CFBundleIdentifier", plist_new_string(bundle_id));
+	if (old_version) {
+		plist_dict_set_item(entry, "old_version", plist_new_string(old_version));
+	}
+	if (new_version) {
+		plist_dict_set_item(entry, "new_version", plist_new_string(new_version));
+	}
+	plist_array_append_item(wdev->changes, entry);
+}
+
+/* Browses the bundle IDs and versions and joins them against the index of
+ * the previous browse, which is replaced. The changes are appended to
+ * wdev->changes unless this is the first browse. */
+static int watch_device_refresh(struct watch_device *wdev)
+{
+	struct inventory_index *index = NULL;
+	struct inventory_diff *diff = NULL;
+	plist_t apps = NULL;
+	instproxy_error_t err;
+	uint32_t i;
+
+	do {
+		err = instproxy_browse(wdev->session->ipc, watch_browse_opts, &apps);
+	} while (instproxy_retry_busy(err));
+	if (err != INSTPROXY_E_SUCCESS) {
+		return -1;
+	}
+
+	index = inventory_index_new();
+	if (wdev->index) {
+		diff = inventory_diff_new(wdev->index, watch_collect_change, wdev);
+	}
+	for (i = 0; i < plist_array_get_size(apps); i++) {
+		plist_t app = plist_array_get_item(apps, i);
+		inventory_index_add(index, app);
+		if (diff) {
+			inventory_diff_add(diff, app);
+		}
+	}
+	if (diff) {
+		inventory_diff_finish(diff);
+		inventory_diff_free(diff);
+	}
+	plist_free(apps);
+
+	inventory_index_free(wdev->index);
+	wdev->index = index;
+
+	return 0;
+}
+
+/* Looks up the apps that were added or changed and prints the changes */
+static void watch_device_report(struct watch_device *wdev)
+{
+	uint32_t num_changes = plist_array_get_size(wdev->changes);
+	const char **appids = NULL;
+	plist_t result = NULL;
+	uint32_t num_appids = 0;
+	uint32_t i;
+
+	if (num_changes == 0) {
+		return;
+	}
+
+	appids = (const char**)calloc(num_changes + 1, sizeof(char*));
+	for (i = 0; i < num_changes; i++) {
+		plist_t entry = plist_array_get_item(wdev->changes, i);
+		if (!plist_dict_get_item(entry, "new_version")) {
+			continue;
+		}
+		appids[num_appids++] = plist_get_string_ptr(plist_dict_get_item(entry, "CFBundleIdentifier"), NULL);
+	}
+	if (num_appids > 0) {
+		instproxy_error_t err;
+		do {
+			err = instproxy_lookup(wdev->session->ipc, appids, watch_lookup_opts, &result);
+		} while (instproxy_retry_busy(err));
+	}
+	free(appids);
+
+	mutex_lock(&output_lock);
+	for (i = 0; i < num_changes; i++) {
+		plist_t entry = plist_array_get_item(wdev->changes, i);
+		plist_t app = plist_dict_get_item(result, plist_get_string_ptr(plist_dict_get_item(entry, "CFBundleIdentifier"), NULL));
+		if (app) {
+			plist_dict_set_item(entry, "app", plist_copy(app));
+		}
+		json_write_node(stdout, entry, 0, 0);
+		putchar('\n');
+	}
+	fflush(stdout);
+	mutex_unlock(&output_lock);
+
+	plist_free(result);
+	plist_free(wdev->changes);
+	wdev->changes = plist_new_array();
+}
+
+static void* watch_device_thread(void *arg)
+{
+	struct watch_device *wdev = (struct watch_device*)arg;
+	struct device_session *session = wdev->session;
+	lockdownd_service_descriptor_t service = NULL;
+	np_client_t np = NULL;
+	const char *noties[3] = { NP_APP_INSTALLED, NP_APP_UNINSTALLED, NULL };
+
+	mutex_lock(&session->lock);
+	if (device_session_connect(session) < 0) {
+		fprintf(stderr, "ERROR: [%s] Could not connect to device\n", session->udid);
+		goto leave;
+	}
+	if (lockdownd_start_service(session->lockdown, "com.apple.mobile.notification_proxy", &service) != LOCKDOWN_E_SUCCESS
+	    || np_client_new(session->device, service, &np) != NP_E_SUCCESS) {
+		fprintf(stderr, "ERROR: [%s] Could not start com.apple.mobile.notification_proxy\n", session->udid);
+		goto leave;
+	}
+	/* subscribe before the first browse so no change is missed */
+	np_set_notify_callback(np, watch_notifier, wdev);
+	np_observe_notifications(np, noties);
+	if (watch_device_refresh(wdev) < 0) {
+		fprintf(stderr, "ERROR: [%s] Could not list apps\n", session->udid);
+		goto leave;
+	}
+	fprintf(stderr, "[%s] Watching %u apps\n", session->udid, inventory_index_size(wdev->index));
+
+	while (!quit_requested && session->connected) {
+		mutex_lock(&wdev->lock);
+		while (!wdev->pending && !quit_requested && session->connected) {
+			cond_wait_timeout(&wdev->cond, &wdev->lock, 500);
+		}
+		wdev->pending = 0;
+		mutex_unlock(&wdev->lock);
+		if (quit_requested || !session->connected) {
+			break;
+		}
+		if (watch_device_refresh(wdev) < 0) {
+			fprintf(stderr, "ERROR: [%s] Could not list apps\n", session->udid);
+			break;
+		}
+		watch_device_report(wdev);
+	}
+
+leave:
+	if (np) {
+		np_client_free(np);
+	}
+	lockdownd_service_descriptor_free(service);
+	device_session_disconnect(session);
+	session->connected = 0;
+	mutex_unlock(&session->lock);
+
+	mutex_lock(&wdev->lock);
+	inventory_index_free(wdev->index);
+	wdev->index = NULL;
+	wdev->running = 0;
+	mutex_unlock(&wdev->lock);
+
+	return NULL;
+}
+
+static void watch_event_cb(const idevice_event_t* event, void* userdata)
+{
+	struct watch_device *wdev;
+
+	session_event_cb(event, userdata);
+
+	if ((event->conn_type == CONNECTION_NETWORK) != (use_network != 0)) {
+		return;
+	}
+	if (udid && strcmp(udid, event->udid)) {
+		return;
+	}
+
+	mutex_lock(&watch_lock);
+	for (wdev = watch_devices; wdev; wdev = wdev->next) {
+		if (!strcmp(wdev->session->udid, event->udid)) {
+			break;
+		}
+	}
+	if (event->event == IDEVICE_DEVICE_REMOVE) {
+		if (wdev) {
+			mutex_lock(&wdev->lock);
+			cond_signal(&wdev->cond);
+			mutex_unlock(&wdev->lock);
+			fprintf(stderr, "[%s] Device removed\n", event->udid);
+		}
+		mutex_unlock(&watch_lock);
+		return;
+	}
+	if (event->event != IDEVICE_DEVICE_ADD) {
+		mutex_unlock(&watch_lock);
+		return;
+	}
+	if (wdev) {
+		mutex_lock(&wdev->lock);
+		int running = wdev->running;
+		mutex_unlock(&wdev->lock);
+		if (running) {
+			mutex_unlock(&watch_lock);
+			return;
+		}
+		/* plugged in again */
+		if (wdev->threaded) {
+			thread_join(wdev->thread);
+			thread_free(wdev->thread);
+		}
+	} else {
+		wdev = (struct watch_device*)calloc(1, sizeof(struct watch_device));
+		wdev->session = device_session_new(event->udid);
+		wdev->changes = plist_new_array();
+		mutex_init(&wdev->lock);
+		cond_init(&wdev->cond);
+		wdev->next = watch_devices;
+		watch_devices = wdev;
+	}
+	wdev->pending = 0;
+	wdev->running = 1;
+	wdev->threaded = (thread_new(&wdev->thread, watch_device_thread, wdev) == 0);
+	if (!wdev->threaded) {
+		fprintf(stderr, "ERROR: [%s] Could not start thread\n", event->udid);
+		wdev->running = 0;
+	}
+	mutex_unlock(&watch_lock);
+}
+
+static int watch_apps_main(void)
+{
+	watch_lookup_opts = list_client_options_new();
+	plist_dict_remove_item(watch_lookup_opts, "BundleIDs");
+	watch_browse_opts = plist_copy(watch_lookup_opts);
+	plist_t attrs = plist_new_array();
+	plist_array_append_item(attrs, plist_new_string("CFBundleIdentifier"));
+	plist_array_append_item(attrs, plist_new_string("CFBundleShortVersionString"));
+	plist_array_append_item(attrs, plist_new_string("CFBundleVersion"));
+	plist_dict_set_item(watch_browse_opts, "ReturnAttributes", attrs);
+	if (bundle_ids) {
+		plist_dict_set_item(watch_browse_opts, "BundleIDs", plist_copy(bundle_ids));
+	}
+
+	mutex_init(&output_lock);
+	mutex_init(&watch_lock);
+
+#ifndef WIN32
+	signal(SIGINT, quit_signal_handler);
+	signal(SIGTERM, quit_signal_handler);
+#endif
+
+	fprintf(stderr, "Watching for app changes, press Ctrl+C to stop.\n");
+	idevice_event_subscribe(watch_event_cb, NULL);
+	while (!quit_requested) {
+		wait_ms(100);
+	}
+	idevice_event_unsubscribe();
+
+	while (watch_devices) {
+		struct watch_device *wdev = watch_devices;
+		watch_devices = wdev->next;
+		mutex_lock(&wdev->lock);
+		cond_signal(&wdev->cond);
+		mutex_unlock(&wdev->lock);
+		if (wdev->threaded) {
+			thread_join(wdev->thread);
+			thread_free(wdev->thread);
+		}
+		plist_free(wdev->changes);
+		cond_destroy(&wdev->cond);
+		mutex_destroy(&wdev->lock);
+		device_session_free(wdev->session);
+		free(wdev);
+	}
+	mutex_destroy(&watch_lock);
+	mutex_destroy(&output_lock);
+	instproxy_client_options_free(watch_browse_opts);
+	instproxy_client_options_free(watch_lookup_opts);
+	watch_browse_opts = NULL;
+	watch_lookup_opts = NULL;
+
+	return EXIT_SUCCESS;
+}
+
+/* inventory: writes the apps of one or all connected devices into a SQLite
+ * database. Every device is browsed in its own thread; the rows are
+ * upserted as the chunks arrive, and rows of apps that are gone from a
+ * device are deleted once its browse is complete. */
+
+#ifdef HAVE_SQLITE3
+struct inventory_device {
+	struct session_command req;
+	THREAD_T thread;
+	int threaded;
+	int began;
+	int64_t scan;
+	uint32_t stored;
+	uint32_t removed;
+	uint64_t start_time;
+	uint64_t end_time;
+};
+
+static struct inventory_db *inventory = NULL;
+static plist_t inventory_client_opts = NULL;
+
+static void inventory_status_cb(plist_t command, plist_t status, void *user_data)
+{
+	struct inventory_device *idev = (struct inventory_device*)user_data;
+	uint64_t total = 0;
+	uint64_t current_index = 0;
+	uint64_t current_amount = 0;
+	plist_t current_list = NULL;
+	uint32_t i;
+
+	instproxy_status_get_current_list(status, &total, &current_index, &current_amount, &current_list);
+	if (current_list) {
+		/* the database is shared by all device threads */
+		mutex_lock(&output_lock);
+		for (i = 0; i < plist_array_get_size(current_list); i++) {
+			if (inventory_db_store_app(inventory, idev->req.session->udid, idev->scan, plist_array_get_item(current_list, i)) == 0) {
+				idev->stored++;
+			}
+		}
+		mutex_unlock(&output_lock);
+		plist_free(current_list);
+	}
+
+	session_status_cb(command, status, &idev->req);
+}
+
+static void* inventory_device_thread(void *arg)
+{
+	struct inventory_device *idev = (struct inventory_device*)arg;
+	struct device_session *session = idev->req.session;
+	instproxy_error_t err = INSTPROXY_E_SUCCESS;
+	int res;
+
+	idev->start_time = time_now_us();
+	mutex_lock(&session->lock);
+	if (device_session_connect(session) < 0) {
+		idev->req.error_name = strdup("DeviceConnectionFailed");
+		goto leave;
+	}
+	mutex_lock(&output_lock);
+	res = inventory_db_begin_scan(inventory, session->udid, session->info, &idev->scan);
+	mutex_unlock(&output_lock);
+	if (res < 0) {
+		idev->req.error_name = strdup("DatabaseError");
+		goto leave;
+	}
+	idev->began = 1;
+	do {
+		err = instproxy_browse_with_callback(session->ipc, inventory_client_opts, inventory_status_cb, idev);
+	} while (instproxy_retry_busy(err));
+	if (err != INSTPROXY_E_SUCCESS) {
+		idev->req.error_name = strdup("DeviceConnectionFailed");
+		goto leave;
+	}
+	session_command_wait(&idev->req);
+	if (!idev->req.completed && !idev->req.error_name) {
+		idev->req.error_name = strdup("DeviceRemoved");
+	}
+
+leave:
+	if (idev->began) {
+		/* only a complete browse tells which apps are gone */
+		mutex_lock(&output_lock);
+		res = inventory_db_end_scan(inventory, session->udid, idev->scan, (idev->req.completed && !idev->req.error), &idev->removed);
+		mutex_unlock(&output_lock);
+		if (res < 0 && !idev->req.error_name) {
+			idev->req.error_name = strdup("DatabaseError");
+		}
+	}
+	device_session_disconnect(session);
+	session->connected = 0;
+	mutex_unlock(&session->lock);
+	idev->end_time = time_now_us();
+
+	return NULL;
+}
+
+static int inventory_main(void)
+{
+	idevice_info_t *devices = NULL;
+	struct inventory_device *idevs = NULL;
+	int count = 0;
+	int num_idevs = 0;
+	int failed = 0;
+	int i;
+
+	inventory = inventory_db_open(cmdarg);
+	if (!inventory) {
+		fprintf(stderr, "ERROR: Could not open inventory database %s\n", cmdarg);
+		return EXIT_FAILURE;
+	}
+
+	if (udid) {
+		count = 1;
+	} else if (idevice_get_device_list_extended(&devices, &count) != IDEVICE_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Unable to retrieve device list!\n");
+		inventory_db_close(inventory);
+		return EXIT_FAILURE;
+	}
+
+	idevs = (struct inventory_device*)calloc((count > 0) ? count : 1, sizeof(struct inventory_device));
+	if (!idevs) {
+		if (devices) {
+			idevice_device_list_extended_free(devices);
+		}
+		inventory_db_close(inventory);
+		return EXIT_FAILURE;
+	}
+
+	/* the stale rows of a device are only deleted after a browse of all
+	 * of its apps, so neither the app type nor bundle IDs are restricted */
+	inventory_client_opts = instproxy_client_options_new();
+	plist_t attrs = plist_new_array();
+	plist_array_append_item(attrs, plist_new_string("CFBundleIdentifier"));
+	plist_array_append_item(attrs, plist_new_string("CFBundleVersion"));
+	plist_array_append_item(attrs, plist_new_string("CFBundleShortVersionString"));
+	plist_array_append_item(attrs, plist_new_string("CFBundleDisplayName"));
+	plist_array_append_item(attrs, plist_new_string("ApplicationType"));
+	plist_array_append_item(attrs, plist_new_string("SignerIdentity"));
+	plist_array_append_item(attrs, plist_new_string("StaticDiskUsage"));
+	plist_array_append_item(attrs, plist_new_string("DynamicDiskUsage"));
+	plist_dict_set_item(inventory_client_opts, "ReturnAttributes", attrs);
+
+	mutex_init(&output_lock);
+	idevice_event_subscribe(session_event_cb, NULL);
+
+	for (i = 0; i < count; i++) {
+		struct inventory_device *idev = &idevs[num_idevs];
+		if (devices) {
+			if ((devices[i]->conn_type == CONNECTION_NETWORK) != (use_network != 0)) {
+				continue;
+			}
+			idev->req.session = device_session_new(devices[i]->udid);
+		} else {
+			idev->req.session = device_session_new(udid);
+		}
+		if (!idev->req.session) {
+			continue;
+		}
+		idev->req.fd = -1;
+		idev->req.command = "Browse";
+		mutex_init(&idev->req.lock);
+		cond_init(&idev->req.cond);
+		num_idevs++;
+		idev->threaded = (thread_new(&idev->thread, inventory_device_thread, idev) == 0);
+		if (!idev->threaded) {
+			inventory_device_thread(idev);
+		}
+	}
+	if (devices) {
+		idevice_device_list_extended_free(devices);
+	}
+
+	for (i = 0; i < num_idevs; i++) {
+		struct inventory_device *idev = &idevs[i];
+		if (idev->threaded) {
+			thread_join(idev->thread);
+			thread_free(idev->thread);
+		}
+		if (idev->req.error_name) {
+			fprintf(stderr, "ERROR: Could not take inventory of %s: %s\n", idev->req.session->udid, idev->req.error_name);
+			failed++;
+		} else {
+			printf("[%s] %u apps stored, %u removed (took %.3fs)\n", idev->req.session->udid, idev->stored, idev->removed, (double)(idev->end_time - idev->start_time) / 1000000.0);
+		}
+	}
+	idevice_event_unsubscribe();
+
+	for (i = 0; i < num_idevs; i++) {
+		struct inventory_device *idev = &idevs[i];
+		free(idev->req.error_name);
+		cond_destroy(&idev->req.cond);
+		mutex_destroy(&idev->req.lock);
+		device_session_free(idev->req.session);
+	}
+	free(idevs);
+	instproxy_client_options_free(inventory_client_opts);
+	inventory_client_opts = NULL;
+	inventory_db_close(inventory);
+	inventory = NULL;
+	mutex_destroy(&output_lock);
+
+	if (num_idevs == 0) {
+		fprintf(stderr, "No device found.\n");
+		return EXIT_FAILURE;
+	}
+	return (failed) ? EXIT_FAILURE : 0;
+}
+#endif
+
+#ifndef WIN32
+/* Runs the given request on a connected session. Returns -1 if the device
+ * connection failed so the caller can reconnect and retry. */
+static int daemon_run_request(struct session_command *req, plist_t request)
+{
+	struct device_session *session = req->session;
+	instproxy_error_t err = INSTPROXY_E_SUCCESS;
+	const char *command = req->command;
+	const char *arg = plist_get_string_ptr(plist_dict_get_item(request, "Argument"), NULL);
+
+	req->completed = 0;
+	req->error = 0;
+
+	if (!strcmp(command, "Browse")) {
+		plist_t client_opts = plist_copy(plist_dict_get_item(request, "ClientOptions"));
+		if (!client_opts) {
+			client_opts = instproxy_client_options_new();
+		}
+		do {
+			err = instproxy_browse_with_callback(session->ipc, client_opts, session_status_cb, req);
+		} while (instproxy_retry_busy(err));
+		instproxy_client_options_free(client_opts);
+	} else if (!strcmp(command, "Install") || !strcmp(command, "Upgrade")) {
+		struct install_package pkg;
+
+		if (!arg) {
+			message_send_error(req->fd, command, "InvalidRequest", "Missing package path");
+			return 0;
+		}
+		if (device_session_start_afc(session) < 0) {
+			return -1;
+		}
+		memset(&pkg, '\0', sizeof(pkg));
+		pkg.path = arg;
+		const char *error = NULL;
+		char reason[256];
+		int skip_installed = plist_bool_val_is_true(plist_dict_get_item(request, "SkipInstalled"));
+		int r = stage_package_checked(session->ipc, session->afc, session->info, &pkg, skip_installed, &error, reason, sizeof(reason));
+		if (r != 0) {
+			install_package_free(&pkg);
+			if (r == 1) {
+				plist_t msg = plist_new_dict();
+				plist_dict_set_item(msg, "Command", plist_new_string(command));
+				plist_dict_set_item(msg, "Skipped", plist_new_bool(1));
+				message_send(req->fd, msg);
+				plist_free(msg);
+			} else {
+				message_send_error(req->fd, command, error, reason);
+			}
+			return 0;
+		}
+		do {
+			if (!strcmp(command, "Install")) {
+				err = instproxy_install(session->ipc, pkg.pkgname, pkg.client_opts, session_status_cb, req);
+			} else {
+				err = instproxy_upgrade(session->ipc, pkg.pkgname, pkg.client_opts, session_status_cb, req);
+			}
+		} while (instproxy_retry_busy(err));
+		install_package_free(&pkg);
+	} else if (!strcmp(command, "Uninstall")) {
+		if (!arg) {
+			message_send_error(req->fd, command, "InvalidRequest", "Missing bundle identifier");
+			return 0;
+		}
+		do {
+			err = instproxy_uninstall(session->ipc, arg, NULL, session_status_cb, req);
+		} while (instproxy_retry_busy(err));
+	} else {
+		message_send_error(req->fd, command, "InvalidRequest", "Unknown command");
+		return 0;
+	}
+
+	if (err != INSTPROXY_E_SUCCESS) {
+		return -1;
+	}
+	session_command_wait(req);
+	if (!req->completed) {
+		return -1;
+	}
+	return 0;
+}
+
+static void daemon_handle_request(int fd, plist_t request)
+{
+	struct session_command req;
+	const char *command = plist_get_string_ptr(plist_dict_get_item(request, "Command"), NULL);
+	const char *dev_udid = plist_get_string_ptr(plist_dict_get_item(request, "UDID"), NULL);
+
+	if (!command) {
+		message_send_error(fd, "Unknown", "InvalidRequest", "Missing command");
+		return;
+	}
+	if (!dev_udid) {
+		dev_udid = udid;
+	}
+
+	memset(&req, '\0', sizeof(req));
+	req.fd = fd;
+	req.command = command;
+	req.session = device_session_get(dev_udid);
+	if (!req.session) {
+		message_send_error(fd, command, "DeviceNotFound", "Could not connect to device");
+	} else {
+		mutex_init(&req.lock);
+		cond_init(&req.cond);
+		mutex_lock(&req.session->lock);
+		int res = -1;
+		int tries = 0;
+		/* a warm connection might have gone stale, reconnect once */
+		while (res < 0 && tries++ < 2) {
+			if (device_session_connect(req.session) < 0) {
+				break;
+			}
+			res = daemon_run_request(&req, request);
+			if (res < 0) {
+				req.session->connected = 0;
+				if (req.updates > 0) {
+					break;
+				}
+			}
+		}
+		mutex_unlock(&req.session->lock);
+		cond_destroy(&req.cond);
+		mutex_destroy(&req.lock);
+		free(req.error_name);
+		if (res < 0 && !req.completed) {
+			message_send_error(fd, command, "DeviceConnectionFailed", "Lost connection to device");
+		}
+	}
+
+	plist_t msg = plist_new_dict();
+	plist_dict_set_item(msg, "Command", plist_new_string(command));
+	plist_dict_set_item(msg, "Done", plist_new_bool(1));
+	message_send(fd, msg);
+	plist_free(msg);
+}
+
+/* client threads are detached, daemon_main() waits for this to drop to 0
+ * before the device sessions they use are freed */
+static int daemon_clients = 0;
+static mutex_t daemon_clients_lock;
+static cond_t daemon_clients_cond;
+
+static void* daemon_client_thread(void *arg)
+{
+	int fd = (int)(intptr_t)arg;
+	plist_t request = NULL;
+
+	while (!quit_requested) {
+		/* don't block in message_receive() so an idle client can't hold
+		 * up the shutdown */
+		int r = socket_check_fd(fd, FDM_READ, 1000);
+		if (r == -ETIMEDOUT) {
+			continue;
+		}
+		if (r < 0 || message_receive(fd, &request) < 0) {
+			break;
+		}
+		daemon_handle_request(fd, request);
+		plist_free(request);
+		request = NULL;
+	}
+	socket_close(fd);
+
+	mutex_lock(&daemon_clients_lock);
+	daemon_clients--;
+	cond_signal(&daemon_clients_cond);
+	mutex_unlock(&daemon_clients_lock);
+
+	return NULL;
+}
+
+static int daemon_main(void)
+{
+	int fd = socket_connect_unix(socket_path);
+	if (fd >= 0) {
+		socket_close(fd);
+		fprintf(stderr, "ERROR: Another daemon is already listening on %s\n", socket_path);
+		return EXIT_FAILURE;
+	}
+	unlink(socket_path);
+
+	/* only we may connect, clients are also checked in the accept loop */
+	mode_t old_umask = umask(0177);
+	fd = socket_create_unix(socket_path);
+	umask(old_umask);
+	if (fd < 0) {
+		fprintf(stderr, "ERROR: Could not create socket %s\n", socket_path);
+		return EXIT_FAILURE;
+	}
+	chmod(socket_path, 0600);
+
+	signal(SIGINT, quit_signal_handler);
+	signal(SIGTERM, quit_signal_handler);
+
+	mutex_init(&daemon_clients_lock);
+	cond_init(&daemon_clients_cond);
+	idevice_event_subscribe(session_event_cb, NULL);
+
+	printf("Listening on %s\n", socket_path);
+	while (!quit_requested) {
+		if (socket_check_fd(fd, FDM_READ, 1000) <= 0) {
+			continue;
+		}
+		int cfd = socket_accept(fd, 0);
+		if (cfd < 0) {
+			continue;
+		}
+		if (!socket_peer_is_owner(cfd)) {
+			fprintf(stderr, "WARNING: Rejected connection from another user\n");
+			socket_close(cfd);
+			continue;
+		}
+		THREAD_T th;
+		mutex_lock(&daemon_clients_lock);
+		daemon_clients++;
+		mutex_unlock(&daemon_clients_lock);
+		if (thread_new(&th, daemon_client_thread, (void*)(intptr_t)cfd) != 0) {
+			socket_close(cfd);
+			mutex_lock(&daemon_clients_lock);
+			daemon_clients--;
+			mutex_unlock(&daemon_clients_lock);
+			continue;
+		}
+		thread_detach(th);
+	}
+
+	socket_close(fd);
+	unlink(socket_path);
+
+	/* requests in flight still use their device session */
+	mutex_lock(&daemon_clients_lock);
+	while (daemon_clients > 0) {
+		cond_wait_timeout(&daemon_clients_cond, &daemon_clients_lock, 500);
+	}
+	mutex_unlock(&daemon_clients_lock);
+	cond_destroy(&daemon_clients_cond);
+	mutex_destroy(&daemon_clients_lock);
+
+	idevice_event_unsubscribe();
+	device_sessions_free();
+
+	return EXIT_SUCCESS;
+}
+
+/* Sends request and renders the forwarded status updates until the daemon
+ * is done with it. Returns 0 on success, -1 if the connection was lost. */
+static int client_run_request(int fd, plist_t request, const char *arg)
+{
+	plist_t msg = NULL;
+	int res = -1;
+
+	if (message_send(fd, request) < 0) {
+		fprintf(stderr, "ERROR: Could not send request to daemon\n");
+		return -1;
+	}
+	free(last_status);
+	last_status = NULL;
+	command_completed = 0;
+	while (message_receive(fd, &msg) == 0) {
+		if (plist_dict_get_item(msg, "Done")) {
+			res = 0;
+			break;
+		}
+		if (plist_dict_get_item(msg, "Skipped")) {
+			printf("Skipping '%s', the same version is already installed.\n", arg);
+		} else {
+			plist_t status = plist_dict_get_item(msg, "Status");
+			status_cb(msg, status, NULL);
+		}
+		plist_free(msg);
+		msg = NULL;
+	}
+	plist_free(msg);
+	if (res != 0) {
+		fprintf(stderr, "ERROR: Lost connection to daemon\n");
+	}
+	return res;
+}
+
+/* Thin client: forwards the command line request to the daemon and renders
+ * the forwarded status updates just like a direct invocation would. Each
+ * package of an install or upgrade is sent as a request of its own. */
+static int client_main(void)
+{
+	plist_t request = plist_new_dict();
+	const char *command = NULL;
+	int res = EXIT_FAILURE;
+	int i;
+
+	switch (cmd) {
+		case CMD_LIST_APPS:
+			command = "Browse";
+			plist_dict_set_item(request, "ClientOptions", list_client_options_new());
+			break;
+		case CMD_INSTALL:
+			command = "Install";
+			break;
+		case CMD_UPGRADE:
+			command = "Upgrade";
+			break;
+		case CMD_UNINSTALL:
+			command = "Uninstall";
+			break;
+		default:
+			fprintf(stderr, "ERROR: This command is not supported in client mode.\n");
+			plist_free(request);
+			return 2;
+	}
+	plist_dict_set_item(request, "Command", plist_new_string(command));
+	if (udid) {
+		plist_dict_set_item(request, "UDID", plist_new_string(udid));
+	}
+	if (if_changed) {
+		plist_dict_set_item(request, "SkipInstalled", plist_new_bool(1));
+	}
+
+	int fd = socket_connect_unix(socket_path);
+	if (fd < 0) {
+		fprintf(stderr, "ERROR: Could not connect to daemon at %s\n", socket_path);
+		plist_free(request);
+		return EXIT_FAILURE;
+	}
+
+	setup_stdout_buffering();
+	if (cmd == CMD_LIST_APPS && list_table) {
+		/* printed once the listing is complete */
+	} else if (cmd == CMD_LIST_APPS) {
+		if (output_format) {
+			print_apps_formatted_header();
+		} else {
+			print_apps_header();
+		}
+	} else if (cmd == CMD_UNINSTALL) {
+		printf("Uninstalling '%s'\n", cmdarg);
+	}
+
+	if (cmd == CMD_INSTALL || cmd == CMD_UPGRADE) {
+		res = 0;
+		for (i = 0; i < num_cmdargs && res == 0; i++) {
+			/* the daemon opens the package, resolve it here */
+			char *abspath = realpath(cmdargs[i], NULL);
+			plist_dict_set_item(request, "Argument", plist_new_string((abspath) ? abspath : cmdargs[i]));
+			free(abspath);
+			res = client_run_request(fd, request, cmdargs[i]);
+		}
+	} else {
+		if (cmdarg) {
+			plist_dict_set_item(request, "Argument", plist_new_string(cmdarg));
+		}
+		res = client_run_request(fd, request, cmdarg);
+	}
+	if (res != 0) {
+		res = EXIT_FAILURE;
+	} else if (cmd == CMD_LIST_APPS && list_table) {
+		print_app_table();
+	} else if (cmd == CMD_LIST_APPS && output_format) {
+		print_apps_formatted_footer();
+	}
+
+	plist_free(request);
+	socket_close(fd);
+	if (err_occurred && !res) {
+		res = 128;
+	}
+	return res;
+}
+#endif
+
+int main(int argc, char **argv)
+{
+	idevice_t device = NULL;
+	lockdownd_client_t client = NULL;
+	instproxy_client_t ipc = NULL;
+	instproxy_error_t err;
+	np_client_t np = NULL;
+	afc_client_t afc = NULL;
+	lockdownd_service_descriptor_t service = NULL;
+	lockdownd_service_descriptor_t afc_service = NULL;
+	lockdownd_service_descriptor_t np_service = NULL;
+	plist_t device_info = NULL;
+	struct install_package *pkgs = NULL;
+	THREAD_T prepare_thread = THREAD_T_NULL;
+	int preparing = 0;
+	char *cache_file = NULL;
+	plist_t cached_apps = NULL;
+	char *cached_signature = NULL;
+	char *signature = NULL;
+	int res = EXIT_FAILURE;
+
+#ifndef WIN32
+	signal(SIGPIPE, SIG_IGN);
+#endif
+	parse_opts(argc, argv);
+
+	argc -= optind;
+	argv += optind;
+
+	mutex_init(&device_sessions_lock);
+
+	if (trace_file) {
+		if (trace_open(trace_file) < 0) {
+			fprintf(stderr, "ERROR: Could not open trace file %s\n", trace_file);
+			goto leave_cleanup;
+		}
+		trace_thread_name("main");
+	}
+	if (metrics_file && metrics_open(metrics_file, metrics_interval) < 0) {
+		fprintf(stderr, "ERROR: Could not write metrics file %s\n", metrics_file);
+		goto leave_cleanup;
+	}
+	if (report_file && report_open(report_file) < 0) {
+		fprintf(stderr, "ERROR: Could not write report file %s\n", report_file);
+		goto leave_cleanup;
+	}
+
+	if (cmd == CMD_BATCH) {
+		res = batch_main();
+		goto leave_cleanup;
+	} else if (cmd == CMD_WATCH) {
+		res = (provision_manifest_path) ? watch_main() : watch_apps_main();
+		goto leave_cleanup;
+	} else if (cmd == CMD_SYNC) {
+		res = sync_main();
+		goto leave_cleanup;
+	} else if (cmd == CMD_LIST_APPS && list_all_devices) {
+		res = list_all_devices_main();
+		goto leave_cleanup;
+	} else if (cmd == CMD_DIFF) {
+		res = diff_main();
+		goto leave_cleanup;
+	} else if (cmd == CMD_INVENTORY) {
+#ifdef HAVE_SQLITE3
+		res = inventory_main();
+#else
+		fprintf(stderr, "ERROR: This build of %s has no SQLite support.\n", PACKAGE_NAME);
+#endif
+		goto leave_cleanup;
+	}
 
 #ifndef WIN32
-	signal(SIGPIPE, SIG_IGN);
+	if (daemon_mode || client_mode) {
+		if (!socket_path) {
+			socket_path = get_default_socket_path();
+			if (!socket_path) {
+				goto leave_cleanup;
+			}
+		}
+		res = (daemon_mode) ? daemon_main() : client_main();
+		goto leave_cleanup;
+	}
 #endif
-	parse_opts(argc, argv);
 
-	argc -= optind;
-	argv += optind;
+	int uses_afc = (cmd == CMD_INSTALL || cmd == CMD_UPGRADE || cmd == CMD_STAGE || cmd == CMD_COMMIT);
+	int uses_np = use_notifier && (uses_afc || cmd == CMD_RESTORE || cmd == CMD_ARCHIVE);
+
+	/* read the packages while the device connection is set up */
+	if (cmd == CMD_INSTALL || cmd == CMD_UPGRADE || cmd == CMD_STAGE) {
+		int i;
+		pkgs = (struct install_package*)calloc(num_cmdargs, sizeof(struct install_package));
+		for (i = 0; i < num_cmdargs; i++) {
+			pkgs[i].path = cmdargs[i];
+			if (cmd != CMD_STAGE) {
+				pkgs[i].report = report_op_new((cmd == CMD_INSTALL) ? "Install" : "Upgrade", cmdargs[i], udid);
+			}
+		}
+		if (thread_new(&prepare_thread, prepare_packages_thread, pkgs) == 0) {
+			preparing = 1;
+		} else {
+			prepare_packages_thread(pkgs);
+		}
+	}
 
+	PROBE1(phase, "lookup");
+	uint64_t trace_start = trace_begin();
 	if (IDEVICE_E_SUCCESS != idevice_new_with_options(&device, udid, (use_network) ? IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX)) {
 		if (udid) {
 			fprintf(stderr, "No device found with udid %s.\n", udid);
 		} else {
 			fprintf(stderr, "No device found.\n");
 		}
-		return EXIT_FAILURE;
+		goto leave_cleanup;
 	}
 
 	if (!udid) {
 		idevice_get_udid(device, &udid);
 	}
+	trace_end("device", "Device lookup", udid, trace_start, -1);
+
+	if (cmd == CMD_LIST_APPS && max_age >= 0) {
+		plist_t client_opts = list_client_options_new();
+		uint64_t age = 0;
+		cache_file = inventory_cache_path(udid, client_opts);
+		instproxy_client_options_free(client_opts);
+		if (cache_file) {
+			cached_apps = inventory_cache_load(cache_file, &cached_signature, &age);
+		}
+		if (cached_apps && age <= (uint64_t)max_age) {
+			setup_stdout_buffering();
+			print_app_list(cached_apps);
+			res = 0;
+			goto leave_cleanup;
+		}
+	}
 
+	PROBE1(phase, "handshake");
+	trace_start = trace_begin();
 	lockdownd_error_t lerr = lockdownd_client_new_with_handshake(device, &client, "ideviceinstaller");
 	if (lerr != LOCKDOWN_E_SUCCESS) {
 		fprintf(stderr, "Could not connect to lockdownd: %s. Exiting.\n", lockdownd_strerror(lerr));
 		goto leave_cleanup;
 	}
+	trace_end("device", "Lockdown handshake", udid, trace_start, -1);
 
-	if (use_notifier) {
-		lerr =lockdownd_start_service(client, "com.apple.mobile.notification_proxy", &service);
-		if (lerr != LOCKDOWN_E_SUCCESS) {
-			fprintf(stderr,	"Could not start com.apple.mobile.notification_proxy: %s\n", lockdownd_strerror(lerr));
-			goto leave_cleanup;
-		}
+run_again:
+	if (service) {
+		lockdownd_service_descriptor_free(service);
+	}
+	service = NULL;
 
-		np_error_t nperr = np_client_new(device, service, &np);
+	/* The service requests share the lockdown connection and are sent one
+	 * after another, but connecting to the services themselves, including
+	 * the SSL handshake, is done concurrently. notification_proxy is only
+	 * started for commands that wait for a notification. */
+	PROBE1(phase, "services");
+	trace_start = trace_begin();
+	lerr = lockdownd_start_service(client, "com.apple.mobile.installation_proxy", &service);
+	if (lerr != LOCKDOWN_E_SUCCESS) {
+		fprintf(stderr, "Could not start com.apple.mobile.installation_proxy: %s\n", lockdownd_strerror(lerr));
+		goto leave_cleanup;
+	}
 
-		if (service) {
-			lockdownd_service_descriptor_free(service);
+	if (uses_afc && !afc) {
+		lerr = lockdownd_start_service(client, "com.apple.afc", &afc_service);
+		if (lerr != LOCKDOWN_E_SUCCESS) {
+			fprintf(stderr, "Could not start com.apple.afc: %s\n", lockdownd_strerror(lerr));
+			goto leave_cleanup;
 		}
-		service = NULL;
+	}
 
-		if (nperr != NP_E_SUCCESS) {
-			fprintf(stderr, "Could not connect to notification_proxy!\n");
+	if (uses_np && !np) {
+		lerr = lockdownd_start_service(client, "com.apple.mobile.notification_proxy", &np_service);
+		if (lerr != LOCKDOWN_E_SUCCESS) {
+			fprintf(stderr,	"Could not start com.apple.mobile.notification_proxy: %s\n", lockdownd_strerror(lerr));
 			goto leave_cleanup;
 		}
+	}
 
-		np_set_notify_callback(np, notifier, NULL);
-
-		const char *noties[3] = { NP_APP_INSTALLED, NP_APP_UNINSTALLED, NULL };
+	trace_end("device", "Start services", udid, trace_start, -1);
 
-		np_observe_notifications(np, noties);
+	PROBE1(phase, "connect");
+	trace_start = trace_begin();
+	struct instproxy_connect ipc_conn = { device, service, NULL, INSTPROXY_E_UNKNOWN_ERROR };
+	THREAD_T ipc_thread = THREAD_T_NULL;
+	int ipc_threaded = 0;
+	if (afc_service || np_service) {
+		ipc_threaded = (thread_new(&ipc_thread, instproxy_connect_thread, &ipc_conn) == 0);
+	}
+	if (!ipc_threaded) {
+		instproxy_connect_thread(&ipc_conn);
 	}
 
-run_again:
-	if (service) {
-		lockdownd_service_descriptor_free(service);
+	/* device values for the preflight checks, read while
+	 * installation_proxy connects */
+	if (uses_afc && !device_info) {
+		device_info = preflight_device_info(client);
 	}
-	service = NULL;
 
-	lerr = lockdownd_start_service(client, "com.apple.mobile.installation_proxy", &service);
-	if (lerr != LOCKDOWN_E_SUCCESS) {
-		fprintf(stderr, "Could not start com.apple.mobile.installation_proxy: %s\n", lockdownd_strerror(lerr));
-		goto leave_cleanup;
+	afc_error_t afc_err = AFC_E_SUCCESS;
+	if (afc_service) {
+		afc_err = afc_client_new(device, afc_service, &afc);
+		lockdownd_service_descriptor_free(afc_service);
+		afc_service = NULL;
 	}
 
-	err = instproxy_client_new(device, service, &ipc);
+	np_error_t nperr = NP_E_SUCCESS;
+	if (np_service) {
+		nperr = np_client_new(device, np_service, &np);
+		lockdownd_service_descriptor_free(np_service);
+		np_service = NULL;
+		if (nperr == NP_E_SUCCESS) {
+			np_set_notify_callback(np, notifier, NULL);
 
-	if (service) {
-		lockdownd_service_descriptor_free(service);
+			const char *noties[3] = { NP_APP_INSTALLED, NP_APP_UNINSTALLED, NULL };
+
+			np_observe_notifications(np, noties);
+		}
+	}
+
+	if (ipc_threaded) {
+		thread_join(ipc_thread);
+		thread_free(ipc_thread);
 	}
+	ipc = ipc_conn.client;
+	err = ipc_conn.error;
+	trace_end("device", "Connect services", udid, trace_start, -1);
+
+	lockdownd_service_descriptor_free(service);
 	service = NULL;
 
 	if (err != INSTPROXY_E_SUCCESS) {
 		fprintf(stderr, "Could not connect to installation_proxy!\n");
 		goto leave_cleanup;
 	}
+	if (afc_err != AFC_E_SUCCESS) {
+		fprintf(stderr, "Could not connect to AFC!\n");
+		goto leave_cleanup;
+	}
+	if (nperr != NP_E_SUCCESS) {
+		fprintf(stderr, "Could not connect to notification_proxy!\n");
+		goto leave_cleanup;
+	}
 
-	setbuf(stdout, NULL);
+	setup_stdout_buffering();
 
 	free(last_status);
 	last_status = NULL;
 
 	notification_expected = 0;
+	PROBE1(phase, "command");
 
 	if (cmd == CMD_LIST_APPS) {
-		plist_t client_opts = instproxy_client_options_new();
-		instproxy_client_options_add(client_opts, "ApplicationType", "User", NULL);
-		plist_t apps = NULL;
-
-		if (opt_list_system && opt_list_user) {
-			plist_dict_remove_item(client_opts, "ApplicationType");
-		} else if (opt_list_system) {
-			instproxy_client_options_add(client_opts, "ApplicationType", "System", NULL);
-		} else if (opt_list_user) {
-			instproxy_client_options_add(client_opts, "ApplicationType", "User", NULL);
-		}
-
-		if (bundle_ids) {
-			plist_dict_set_item(client_opts, "BundleIDs", plist_copy(bundle_ids));
-		}
-
-		if (!output_format && !return_attrs) {
-			return_attrs = plist_new_array();
-			plist_array_append_item(return_attrs, plist_new_string("CFBundleIdentifier"));
-			plist_array_append_item(return_attrs, plist_new_string("CFBundleShortVersionString"));
-			plist_array_append_item(return_attrs, plist_new_string("CFBundleDisplayName"));
-		}
-
-		if (return_attrs) {
-			instproxy_client_options_add(client_opts, "ReturnAttributes", return_attrs, NULL);
-		}
-
-		if (output_format) {
-			err = instproxy_browse(ipc, client_opts, &apps);
-
-			if (!apps || (plist_get_node_type(apps) != PLIST_ARRAY)) {
-				fprintf(stderr, "ERROR: instproxy_browse returnd an invalid plist!\n");
+		plist_t client_opts = list_client_options_new();
+
+		if (cache_file) {
+			signature = list_signature(ipc, client_opts);
+			if (signature && cached_apps && !strcmp(signature, cached_signature)) {
+				/* no app changed since the list was cached */
+				inventory_cache_save(cache_file, cached_apps, signature);
+				instproxy_client_options_free(client_opts);
+				print_app_list(cached_apps);
+				res = 0;
 				goto leave_cleanup;
 			}
-			char *buf = NULL;
-			uint32_t len = 0;
-			if (output_format == FORMAT_XML) {
-				plist_err_t perr = plist_to_xml(apps, &buf, &len);
-				if (perr != PLIST_ERR_SUCCESS) {
-					fprintf(stderr, "ERROR: Failed to convert data to XML format (%d).\n", perr);
-				}
-			} else if (output_format == FORMAT_JSON) {
-				/* for JSON, we need to convert some stuff since it doesn't support PLIST_DATA nodes */
-				plist_array_iter aiter = NULL;
-				plist_array_new_iter(apps, &aiter);
-				plist_t entry = NULL;
-				do {
-					plist_array_next_item(apps, aiter, &entry);
-					if (!entry) break;
-					plist_t items = plist_dict_get_item(entry, "UIApplicationShortcutItems");
-					plist_array_iter inner = NULL;
-					plist_array_new_iter(items, &inner);
-					plist_t item = NULL;
-					do {
-						plist_array_next_item(items, inner, &item);
-						if (!item) break;
-						plist_t userinfo = plist_dict_get_item(item, "UIApplicationShortcutItemUserInfo");
-						if (userinfo) {
-							plist_t data_node = plist_dict_get_item(userinfo, "data");
-
-							if (data_node) {
-								char *strbuf = NULL;
-								uint32_t buflen = 0;
-								plist_write_to_string(data_node, &strbuf, &buflen, PLIST_FORMAT_LIMD, PLIST_OPT_NO_NEWLINE);
-								plist_set_string_val(data_node, strbuf);
-								free(strbuf);
-							}
-						}
-					} while (item);
-					free(inner);
-				} while (entry);
-				free(aiter);
-				plist_err_t perr = plist_to_json(apps, &buf, &len, 1);
-				if (perr != PLIST_ERR_SUCCESS) {
-					fprintf(stderr, "ERROR: Failed to convert data to JSON format (%d).\n", perr);
-				}
-			}
-			if (buf) {
-				puts(buf);
-				free(buf);
+			if (signature) {
+				list_collected = plist_new_array();
 			}
-			plist_free(apps);
-			res = 0;
-			goto leave_cleanup;
 		}
 
-		print_apps_header();
+		if (list_table) {
+			/* printed once the browse is complete */
+		} else if (output_format) {
+			print_apps_formatted_header();
+		} else {
+			print_apps_header();
+		}
 
 		err = instproxy_browse_with_callback(ipc, client_opts, status_cb, NULL);
 		if (err == INSTPROXY_E_RECEIVE_TIMEOUT) {
@@ -1425,35 +6363,18 @@ run_again:
 
 		wait_for_command_complete = 1;
 		notification_expected = 0;
-	} else if (cmd == CMD_INSTALL || cmd == CMD_UPGRADE) {
-		plist_t sinf = NULL;
-		plist_t meta = NULL;
-		char *pkgname = NULL;
-		struct stat fst;
-		uint64_t af = 0;
-
-		lockdownd_service_descriptor_free(service);
-		service = NULL;
-
-		lerr = lockdownd_start_service(client, "com.apple.afc", &service);
-		if (lerr != LOCKDOWN_E_SUCCESS) {
-			fprintf(stderr, "Could not start com.apple.afc: %s\n", lockdownd_strerror(lerr));
-			goto leave_cleanup;
-		}
+	} else if (cmd == CMD_INSTALL || cmd == CMD_UPGRADE || cmd == CMD_STAGE || cmd == CMD_COMMIT) {
+		int num_pkgs = 0;
+		int staged = 0;
+		int failed = 0;
+		int skipped = 0;
+		int pipelining = (stage_depth > 0);
+		char reason[256];
+		int i;
 
 		lockdownd_client_free(client);
 		client = NULL;
 
-		if (afc_client_new(device, service, &afc) != AFC_E_SUCCESS) {
-			fprintf(stderr, "Could not connect to AFC!\n");
-			goto leave_cleanup;
-		}
-
-		if (stat(cmdarg, &fst) != 0) {
-			fprintf(stderr, "ERROR: stat: %s: %s\n", cmdarg, strerror(errno));
-			goto leave_cleanup;
-		}
-
 		char **strs = NULL;
 		if (afc_get_file_info(afc, PKG_PATH, &strs) != AFC_E_SUCCESS) {
 			if (afc_make_directory(afc, PKG_PATH) != AFC_E_SUCCESS) {
@@ -1461,7 +6382,7 @@ run_again:
 			}
 		}
 		if (strs) {
-			int i = 0;
+			i = 0;
 			while (strs[i]) {
 				free(strs[i]);
 				i++;
@@ -1469,292 +6390,175 @@ run_again:
 			free(strs);
 		}
 
-		plist_t client_opts = instproxy_client_options_new();
-
-		/* open install package */
-		ZipParser *zp = NULL;
-
-		if ((strlen(cmdarg) > 5) && (strcmp(&cmdarg[strlen(cmdarg)-5], ".ipcc") == 0)) {
-			zp = r_zip_open(cmdarg);
-			if (!zp) {
-				fprintf(stderr, "ERROR: r_zip_open: %s\n", cmdarg);
-				goto leave_cleanup;
-			}
-
-			char* ipcc = strdup(cmdarg);
-			if ((asprintf(&pkgname, "%s/%s", PKG_PATH, basename(ipcc)) > 0) && pkgname) {
-				afc_make_directory(afc, pkgname);
-			}
-
-			printf("Uploading %s package contents... ", basename(ipcc));
-
-			while (r_zip_get_next_entry(zp)) {
-				const char* zname = zp->filename;
-				char* dstpath = NULL;
-				if (!zname) continue;
-				
-				if (zname[strlen(zname)-1] == '/') {
-					// directory
-					if ((asprintf(&dstpath, "%s/%s/%s", PKG_PATH, basename(ipcc), zname) > 0) && dstpath) {
-						afc_make_directory(afc, dstpath);						}
-					free(dstpath);
-					dstpath = NULL;
-				} else {
-					if ((asprintf(&dstpath, "%s/%s/%s", PKG_PATH, basename(ipcc), zname) <= 0) || !dstpath || (afc_file_open(afc, dstpath, AFC_FOPEN_WRONLY, &af) != AFC_E_SUCCESS)) {
-						fprintf(stderr, "ERROR: can't open afc://%s for writing\n", dstpath);
-						free(dstpath);
-						dstpath = NULL;
-						continue;
-					}
-
-					if (!r_extract_current(zp, afc, af)) {
-						afc_file_close(afc, af);
-						r_zip_close(zp);
-						goto leave_cleanup;
-					}
-
-					afc_file_close(afc, af);
-					af = 0;
-				}
-			}
-
-			r_zip_close(zp);
-			free(ipcc);
-			printf("DONE.\n");
-
-			instproxy_client_options_add(client_opts, "PackageType", "CarrierBundle", NULL);
-		} else if (S_ISDIR(fst.st_mode)) {
-			/* upload developer app directory */
-			instproxy_client_options_add(client_opts, "PackageType", "Developer", NULL);
-
-			if (asprintf(&pkgname, "%s/%s", PKG_PATH, basename(cmdarg)) < 0) {
-				fprintf(stderr, "ERROR: Out of memory allocating pkgname!?\n");
-				goto leave_cleanup;
-			}
-
-			printf("Uploading %s package contents... ", basename(cmdarg));
-			afc_upload_dir(afc, cmdarg, pkgname);
-			printf("DONE.\n");
-
-			/* extract the CFBundleIdentifier from the package */
-
-			/* construct full filename to Info.plist */
-			char *filename = (char*)malloc(strlen(cmdarg)+11+1);
-			strcpy(filename, cmdarg);
-			strcat(filename, "/Info.plist");
-
-			struct stat st;
-			FILE *fp = NULL;
-
-			if (stat(filename, &st) == -1 || (fp = fopen(filename, "r")) == NULL) {
-				fprintf(stderr, "ERROR: could not locate %s in app!\n", filename);
-				free(filename);
-				goto leave_cleanup;
-			}
-			size_t filesize = st.st_size;
-			char *ibuf = malloc(filesize * sizeof(char));
-			size_t amount = fread(ibuf, 1, filesize, fp);
-			if (amount != filesize) {
-				fprintf(stderr, "ERROR: could not read %u bytes from %s\n", (uint32_t)filesize, filename);
-				free(filename);
-				goto leave_cleanup;
-			}
-			fclose(fp);
-			free(filename);
-
-			plist_t info = NULL;
-			plist_from_memory(ibuf, filesize, &info, NULL);
-			free(ibuf);
+		is_device_connected = 1;
+		if (preparing) {
+			thread_join(prepare_thread);
+			thread_free(prepare_thread);
+			preparing = 0;
+		}
+		if (cmd == CMD_STAGE) {
+			stage_packages(afc, ipc, device_info, pkgs);
+			res = 0;
+			goto leave_cleanup;
+		} else if (cmd == CMD_COMMIT) {
+			commit_packages(afc, ipc);
+			res = 0;
+			goto leave_cleanup;
+		}
 
-			if (!info) {
-				fprintf(stderr, "ERROR: could not parse Info.plist!\n");
-				goto leave_cleanup;
+		PROBE1(phase, "preflight");
+		/* read all packages and reject the ones the device can't install
+		 * before spending any time on uploads */
+		for (i = 0; i < num_cmdargs; i++) {
+			struct install_package *pkg = &pkgs[i];
+			report_op_set_device(pkg->report, udid);
+			if (pkg->prepared < 0) {
+				report_op_error(pkg->report, "PackageReadFailed", NULL, 0);
+				report_op_finish(pkg->report, 0);
+				failed++;
+				continue;
 			}
-
-			plist_t bname = plist_dict_get_item(info, "CFBundleIdentifier");
-			if (bname) {
-				plist_get_string_val(bname, &bundleidentifier);
+			if (if_changed && package_is_installed(ipc, pkg) == 1) {
+				printf("Skipping '%s', the same version is already installed.\n", cmdargs[i]);
+				report_op_finish(pkg->report, 1);
+				install_package_free(pkg);
+				skipped++;
+				continue;
 			}
-			plist_free(info);
-			info = NULL;
-		} else {
-			zp = r_zip_open(cmdarg);
-			if (!zp) {
-				fprintf(stderr, "ERROR: r_zip_open: %s\n", cmdarg);
-				goto leave_cleanup;
+			trace_start = trace_begin();
+			uint64_t report_start = time_now_us();
+			int preflight_res = preflight_package(ipc, afc, device_info, pkg, reason, sizeof(reason));
+			trace_end("package", "Preflight", pkg->path, trace_start, -1);
+			report_op_phase(pkg->report, "Preflight", report_start);
+			if (preflight_res < 0) {
+				fprintf(stderr, "ERROR: Not installing '%s': %s\n", cmdargs[i], reason);
+				report_op_error(pkg->report, "PreflightFailed", reason, 0);
+				report_op_finish(pkg->report, 0);
+				install_package_free(pkg);
+				failed++;
+				continue;
 			}
-
-			char *zbuf = NULL;
-			uint32_t len = 0;
-			plist_t meta_dict = NULL;
-
-			if (extmeta) {
-				size_t flen = 0;
-				zbuf = buf_from_file(extmeta, &flen);
-				if (zbuf && flen) {
-					meta = plist_new_data(zbuf, flen);
-					plist_from_memory(zbuf, flen, &meta_dict, NULL);
-					free(zbuf);
-				}
-				if (!meta_dict) {
-					plist_free(meta);
-					meta = NULL;
-					fprintf(stderr, "WARNING: could not load external iTunesMetadata %s!\n", extmeta);
-				}
-				zbuf = NULL;
+			if (num_pkgs != i) {
+				pkgs[num_pkgs] = *pkg;
+				memset(pkg, '\0', sizeof(struct install_package));
 			}
+			num_pkgs++;
+		}
 
-			if (!meta && !meta_dict) {
-				/* extract iTunesMetadata.plist from package */
-				
-				if (r_get_content(zp, ITUNES_METADATA_PLIST_FILENAME, &zbuf, &len) == 0) {
-					meta = plist_new_data(zbuf, len);
-					plist_from_memory(zbuf, len, &meta_dict, NULL);
+		/* While package i is being installed by the device, the next
+		 * packages (up to stage_depth) are uploaded in the meantime. */
+		for (i = 0; i < num_pkgs; i++) {
+			if (staged == i) {
+				PROBE1(phase, "upload");
+				if (stage_package(afc, &pkgs[i]) < 0) {
+					report_op_error(pkgs[i].report, "UploadFailed", NULL, 0);
+					report_op_finish(pkgs[i].report, 0);
+					install_package_free(&pkgs[i]);
+					failed++;
+					staged++;
+					continue;
 				}
-				if (!meta_dict) {
-					plist_free(meta);
-					meta = NULL;
-					fprintf(stderr, "WARNING: could not locate %s in archive!\n", ITUNES_METADATA_PLIST_FILENAME);
-				}
-				free(zbuf);
-			}
-
-			/* determine .app directory in archive */
-			zbuf = NULL;
-			len = 0;
-			plist_t info = NULL;
-			char* filename = NULL;
-			char* app_directory_name = NULL;
-
-			if (r_get_app_directory(zp, &app_directory_name) != 0) {
-				fprintf(stderr, "ERROR: Unable to locate .app directory in archive. Make sure it is inside a 'Payload' directory.\n");
-				r_zip_close(zp);
-				goto leave_cleanup;
-			}
-
-			/* construct full filename to Info.plist */
-			filename = (char*)malloc(strlen(app_directory_name)+10+1);
-			strcpy(filename, app_directory_name);
-			free(app_directory_name);
-			app_directory_name = NULL;
-			strcat(filename, "Info.plist");
-
-			if (r_get_content(zp, filename, &zbuf, &len) < 0) {
-				fprintf(stderr, "WARNING: could not locate %s in archive!\n", filename);
-				free(filename);
-				r_zip_close(zp);
-				goto leave_cleanup;
-			}
-			free(filename);
-			plist_from_memory(zbuf, len, &info, NULL);
-			free(zbuf);
-
-			if (!info) {
-				fprintf(stderr, "Could not parse Info.plist!\n");
-				r_zip_close(zp);
-				goto leave_cleanup;
+				staged++;
 			}
 
-			char *bundleexecutable = NULL;
-
-			plist_t bname = plist_dict_get_item(info, "CFBundleExecutable");
-			if (bname) {
-				plist_get_string_val(bname, &bundleexecutable);
-			}
-
-			bname = plist_dict_get_item(info, "CFBundleIdentifier");
-			if (bname) {
-				plist_get_string_val(bname, &bundleidentifier);
-			}
-			plist_free(info);
-			info = NULL;
+			free(last_status);
+			last_status = NULL;
+			command_completed = 0;
+			notified = 0;
+			status_time = 0;
+			int prev_err = err_occurred;
+			err_occurred = 0;
 
-			if (!bundleexecutable) {
-				fprintf(stderr, "Could not determine value for CFBundleExecutable!\n");
-				r_zip_close(zp);
-				goto leave_cleanup;
+			if (cmd == CMD_INSTALL) {
+				printf("Installing '%s'\n", pkgs[i].bundleidentifier);
+			} else {
+				printf("Upgrading '%s'\n", pkgs[i].bundleidentifier);
 			}
-
-			if (extsinf) {
-				size_t flen = 0;
-				zbuf = buf_from_file(extsinf, &flen);
-				if (zbuf && flen) {
-					sinf = plist_new_data(zbuf, flen);
-					free(zbuf);
+			PROBE1(phase, "install");
+			trace_start = trace_begin();
+			status_report = pkgs[i].report;
+			do {
+				if (cmd == CMD_INSTALL) {
+					err = instproxy_install(ipc, pkgs[i].pkgname, pkgs[i].client_opts, status_cb, NULL);
 				} else {
-					fprintf(stderr, "WARNING: could not load external SINF %s!\n", extsinf);
+					err = instproxy_upgrade(ipc, pkgs[i].pkgname, pkgs[i].client_opts, status_cb, NULL);
 				}
-				zbuf = NULL;
-			}
+			} while (instproxy_retry_busy(err));
 
-			if (!sinf) {
-				char *sinfname = NULL;
-				if (asprintf(&sinfname, "Payload/%s.app/SC_Info/%s.sinf", bundleexecutable, bundleexecutable) < 0) {
-					fprintf(stderr, "Out of memory!?\n");
-					r_zip_close(zp);
-					goto leave_cleanup;
+			if (err != INSTPROXY_E_SUCCESS) {
+				fprintf(stderr, "ERROR: Could not start installation of '%s' (%d)\n", pkgs[i].path, err);
+				report_op_error(pkgs[i].report, "RequestFailed", NULL, (uint64_t)err);
+				err_occurred = 1;
+			} else {
+				while (pipelining && (staged < num_pkgs) && (staged <= i + stage_depth)) {
+					/* installd is still reading the file of the package
+					 * with the same name, stage it when it is its turn */
+					if (package_path_in_use(pkgs, i, staged, &pkgs[staged])) {
+						break;
+					}
+					/* the size of directories and .ipcc files isn't known
+					 * up front, so the free space can't be checked */
+					if (pkgs[staged].size == 0) {
+						break;
+					}
+					uint64_t free_bytes = 0;
+					if (afc_get_free_bytes(afc, &free_bytes) == 0 && free_bytes < min_free_space + pkgs[staged].size) {
+						fprintf(stderr, "NOTE: Device is low on free space (%" PRIu64 " bytes), disabling pipelined upload.\n", free_bytes);
+						pipelining = 0;
+						break;
+					}
+					if (stage_package(afc, &pkgs[staged]) < 0) {
+						report_op_error(pkgs[staged].report, "UploadFailed", NULL, 0);
+						report_op_finish(pkgs[staged].report, 0);
+						install_package_free(&pkgs[staged]);
+						failed++;
+						pkgs[staged].path = NULL;
+					}
+					staged++;
 				}
-				free(bundleexecutable);
 
-				/* extract .sinf from package */
-				zbuf = NULL;
-				len = 0;
-				if (r_get_content(zp, sinfname, &zbuf, &len) == 0) {
-					sinf = plist_new_data(zbuf, len);
-				} else {
-					fprintf(stderr, "WARNING: could not locate %s in archive!\n", sinfname);
-				}
-				free(sinfname);
-				free(zbuf);
+				wait_for_command_complete = 1;
+				notification_expected = 1;
+				idevice_wait_for_command_to_complete();
 			}
-
-			/* copy archive to device */
-			pkgname = NULL;
-			if (asprintf(&pkgname, "%s/%s", PKG_PATH, bundleidentifier) < 0) {
-				fprintf(stderr, "Out of memory!?\n");
-				r_zip_close(zp);
-				goto leave_cleanup;
+			trace_phase_next(&status_phase, "device", NULL);
+			trace_end("device", (cmd == CMD_INSTALL) ? "Install" : "Upgrade", pkgs[i].bundleidentifier, trace_start, (int64_t)pkgs[i].size);
+			if (!is_device_connected && !command_completed) {
+				report_op_error(pkgs[i].report, "DeviceRemoved", NULL, 0);
 			}
+			report_op_finish(pkgs[i].report, 0);
+			status_report = NULL;
 
-			printf("Copying '%s' to device... ", cmdarg);
-
-			if (afc_upload_file(afc, cmdarg, pkgname) < 0) {
-				printf("FAILED\n");
-				free(pkgname);
-				r_zip_close(zp);
-				goto leave_cleanup;
+			if (err_occurred) {
+				failed++;
 			}
+			err_occurred |= prev_err;
+			install_package_free(&pkgs[i]);
 
-			printf("DONE.\n");
-
-			if (bundleidentifier) {
-				instproxy_client_options_add(client_opts, "CFBundleIdentifier", bundleidentifier, NULL);
-			}
-			if (sinf) {
-				instproxy_client_options_add(client_opts, "ApplicationSINF", sinf, NULL);
+			/* skip packages that failed to stage while pipelining */
+			while ((i + 1 < num_pkgs) && (i + 1 < staged) && !pkgs[i + 1].path) {
+				i++;
 			}
-			if (meta) {
-				instproxy_client_options_add(client_opts, "iTunesMetadata", meta, NULL);
+
+			if (!is_device_connected) {
+				break;
 			}
 		}
-		if (zp) {
-			r_zip_close(zp);
+		if (num_cmdargs > 1) {
+			if (skipped) {
+				printf("%d of %d packages installed successfully, %d skipped.\n", num_cmdargs - skipped - failed, num_cmdargs - skipped, skipped);
+			} else {
+				printf("%d of %d packages installed successfully.\n", num_cmdargs - failed, num_cmdargs);
+			}
 		}
-
-		/* perform installation or upgrade */
-		if (cmd == CMD_INSTALL) {
-			printf("Installing '%s'\n", bundleidentifier);
-			instproxy_install(ipc, pkgname, client_opts, status_cb, NULL);
-		} else {
-			printf("Upgrading '%s'\n", bundleidentifier);
-			instproxy_upgrade(ipc, pkgname, client_opts, status_cb, NULL);
+		if (failed) {
+			err_occurred = 1;
 		}
-		instproxy_client_options_free(client_opts);
-		free(pkgname);
-		wait_for_command_complete = 1;
-		notification_expected = 1;
+		res = 0;
+		goto leave_cleanup;
 	} else if (cmd == CMD_UNINSTALL) {
 		printf("Uninstalling '%s'\n", cmdarg);
+		status_report = report_op_new("Uninstall", cmdarg, udid);
 		instproxy_uninstall(ipc, cmdarg, NULL, status_cb, NULL);
 		wait_for_command_complete = 1;
 		notification_expected = 0;
@@ -1780,11 +6584,9 @@ run_again:
 				if (perr != PLIST_ERR_SUCCESS) {
 					fprintf(stderr, "ERROR: Failed to convert data to XML format (%d).\n", perr);
 				}
-			} else if (output_format == FORMAT_JSON) {
-				plist_err_t perr = plist_to_json(dict, &buf, &len, 1);
-				if (perr != PLIST_ERR_SUCCESS) {
-					fprintf(stderr, "ERROR: Failed to convert data to JSON format (%d).\n", perr);
-				}
+			} else {
+				json_write_node(stdout, dict, (output_format == FORMAT_JSON), 0);
+				putchar('\n');
 			}
 			if (buf) {
 				puts(buf);
@@ -2031,22 +6833,76 @@ run_again:
 	client = NULL;
 
 	idevice_wait_for_command_to_complete();
+	if (cmd == CMD_LIST_APPS && list_table) {
+		print_app_table();
+	} else if (cmd == CMD_LIST_APPS && output_format) {
+		print_apps_formatted_footer();
+	}
+	if (list_collected && !err_occurred) {
+		inventory_cache_save(cache_file, list_collected, signature);
+	}
 	res = 0;
 
 leave_cleanup:
+	PROBE1(phase, "cleanup");
+	if (preparing) {
+		thread_join(prepare_thread);
+		thread_free(prepare_thread);
+	}
+	if (pkgs) {
+		int i;
+		for (i = 0; i < num_cmdargs; i++) {
+			install_package_free(&pkgs[i]);
+		}
+		free(pkgs);
+	}
+	lockdownd_service_descriptor_free(afc_service);
+	lockdownd_service_descriptor_free(np_service);
 	np_client_free(np);
 	instproxy_client_free(ipc);
 	afc_client_free(afc);
 	lockdownd_client_free(client);
 	idevice_free(device);
+	plist_free(device_info);
+	if (cmd == CMD_INSTALL || cmd == CMD_UPGRADE || cmd == CMD_UNINSTALL || cmd == CMD_RESTORE || cmd == CMD_COMMIT) {
+		inventory_cache_invalidate(udid);
+	}
+	free(cache_file);
+	plist_free(cached_apps);
+	filter_free(list_filter);
+	app_table_free(list_table);
+	free(list_sort_key);
+	free(list_group_key);
+	plist_free(list_extra_attrs);
+	free(filter_expr);
+	free(cached_signature);
+	free(signature);
+	plist_free(list_collected);
+
+	if (trace_close() < 0) {
+		fprintf(stderr, "ERROR: Could not write trace file %s\n", trace_file);
+	}
+	free(trace_file);
+	if (metrics_close() < 0) {
+		fprintf(stderr, "ERROR: Could not write metrics file %s\n", metrics_file);
+	}
+	free(metrics_file);
+	report_op_finish(status_report, 0);
+	if (report_close() < 0) {
+		fprintf(stderr, "ERROR: Could not write report file %s\n", report_file);
+	}
+	free(report_file);
 
+	mutex_destroy(&device_sessions_lock);
+	free(socket_path);
+	free(provision_manifest_path);
 	free(udid);
 	free(copy_path);
 	free(extsinf);
 	free(extmeta);
-	free(bundleidentifier);
 	plist_free(bundle_ids);
 	plist_free(return_attrs);
+	free(list_columns);
 
 	if (err_occurred && !res) {
 		res = 128;
@@ -0,0 +1,335 @@
+/*
+ * inventory.c
+ * SQLite store for app inventories of many devices
+ *
+ *
+ * Copyright (C) 2026 ideviceinstaller contributors
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include <sqlite3.h>
+
+#include "inventory.h"
+
+/* scan is the number of the last scan of the device, every row of apps
+ * carries the scan it was last seen in. version is plain TEXT and compares
+ * as a string ("10.0" < "9.0"), so version_key holds it with every number
+ * zero padded to compare in version order with any SQLite client. It is
+ * indexed together with bundle_id for lookups like "which devices run X
+ * below version Y", type separately. */
+static const char *inventory_schema =
+	"CREATE TABLE IF NOT EXISTS devices ("
+	" udid TEXT PRIMARY KEY,"
+	" name TEXT,"
+	" product_type TEXT,"
+	" product_version TEXT,"
+	" scan INTEGER NOT NULL,"
+	" last_scan INTEGER NOT NULL"
+	");"
+	"CREATE TABLE IF NOT EXISTS apps ("
+	" udid TEXT NOT NULL,"
+	" bundle_id TEXT NOT NULL,"
+	" version TEXT,"
+	" version_key TEXT,"
+	" short_version TEXT,"
+	" name TEXT,"
+	" type TEXT,"
+	" signer TEXT,"
+	" static_disk_usage INTEGER,"
+	" dynamic_disk_usage INTEGER,"
+	" scan INTEGER NOT NULL,"
+	" PRIMARY KEY (udid, bundle_id)"
+	") WITHOUT ROWID;";
+
+static const char *inventory_indexes =
+	"DROP INDEX IF EXISTS apps_bundle_id_version;"
+	"CREATE INDEX IF NOT EXISTS apps_bundle_id_version_key ON apps (bundle_id, version_key);"
+	"CREATE INDEX IF NOT EXISTS apps_type ON apps (type);";
+
+#define VERSION_KEY_DIGITS 10
+
+struct inventory_db {
+	sqlite3 *db;
+	sqlite3_stmt *select_scan;
+	sqlite3_stmt *upsert_device;
+	sqlite3_stmt *upsert_app;
+	sqlite3_stmt *delete_stale;
+	int in_transaction;
+	unsigned int pending;
+};
+
+static int db_exec(struct inventory_db *idb, const char *sql)
+{
+	char *errmsg = NULL;
+	if (sqlite3_exec(idb->db, sql, NULL, NULL, &errmsg) != SQLITE_OK) {
+		fprintf(stderr, "ERROR: SQLite: %s\n", (errmsg) ? errmsg : sqlite3_errmsg(idb->db));
+		sqlite3_free(errmsg);
+		return -1;
+	}
+	return 0;
+}
+
+static int db_prepare(struct inventory_db *idb, const char *sql, sqlite3_stmt **stmt)
+{
+	if (sqlite3_prepare_v2(idb->db, sql, -1, stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "ERROR: SQLite: %s\n", sqlite3_errmsg(idb->db));
+		return -1;
+	}
+	return 0;
+}
+
+/* Adds columns missing in databases created by earlier versions */
+static int db_migrate(struct inventory_db *idb)
+{
+	sqlite3_stmt *stmt = NULL;
+
+	if (sqlite3_prepare_v2(idb->db, "SELECT version_key FROM apps LIMIT 0", -1, &stmt, NULL) == SQLITE_OK) {
+		sqlite3_finalize(stmt);
+		return 0;
+	}
+	/* filled in by the next inventory */
+	return db_exec(idb, "ALTER TABLE apps ADD COLUMN version_key TEXT");
+}
+
+static int db_begin(struct inventory_db *idb)
+{
+	if (idb->in_transaction) {
+		return 0;
+	}
+	if (db_exec(idb, "BEGIN") < 0) {
+		return -1;
+	}
+	idb->in_transaction = 1;
+	idb->pending = 0;
+	return 0;
+}
+
+static int db_commit(struct inventory_db *idb)
+{
+	if (!idb->in_transaction) {
+		return 0;
+	}
+	idb->in_transaction = 0;
+	idb->pending = 0;
+	return db_exec(idb, "COMMIT");
+}
+
+/* Runs the bound statement stmt to completion and resets it */
+static int db_step(struct inventory_db *idb, sqlite3_stmt *stmt)
+{
+	int rc = sqlite3_step(stmt);
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+	if (rc != SQLITE_DONE && rc != SQLITE_ROW) {
+		fprintf(stderr, "ERROR: SQLite: %s\n", sqlite3_errmsg(idb->db));
+		return -1;
+	}
+	return 0;
+}
+
+static void bind_string(sqlite3_stmt *stmt, int idx, plist_t dict, const char *key)
+{
+	const char *str = plist_get_string_ptr(plist_dict_get_item(dict, key), NULL);
+	if (str) {
+		sqlite3_bind_text(stmt, idx, str, -1, SQLITE_TRANSIENT);
+	} else {
+		sqlite3_bind_null(stmt, idx);
+	}
+}
+
+/* Binds version with every numeric component zero padded, e.g. "9.0" as
+ * "0000000009.0000000000", so that keys compare like version_compare() */
+static void bind_version_key(sqlite3_stmt *stmt, int idx, plist_t dict, const char *key)
+{
+	const char *version = plist_get_string_ptr(plist_dict_get_item(dict, key), NULL);
+	const char *p;
+	size_t components = 1;
+	size_t len = 0;
+	char *buf;
+
+	if (!version) {
+		sqlite3_bind_null(stmt, idx);
+		return;
+	}
+	for (p = version; *p; p++) {
+		if (*p == '.') {
+			components++;
+		}
+	}
+	buf = malloc(components * (VERSION_KEY_DIGITS + 1) + 1);
+	if (!buf) {
+		sqlite3_bind_null(stmt, idx);
+		return;
+	}
+	p = version;
+	while (1) {
+		uint64_t val = strtoull(p, NULL, 10) % 10000000000ULL;
+		len += snprintf(buf + len, VERSION_KEY_DIGITS + 2, "%s%0*" PRIu64, (len > 0) ? "." : "", VERSION_KEY_DIGITS, val);
+		p = strchr(p, '.');
+		if (!p) {
+			break;
+		}
+		p++;
+	}
+	sqlite3_bind_text(stmt, idx, buf, (int)len, free);
+}
+
+static void bind_uint(sqlite3_stmt *stmt, int idx, plist_t dict, const char *key)
+{
+	plist_t node = plist_dict_get_item(dict, key);
+	if (plist_get_node_type(node) == PLIST_INT) {
+		uint64_t uval = 0;
+		plist_get_uint_val(node, &uval);
+		sqlite3_bind_int64(stmt, idx, (sqlite3_int64)uval);
+	} else {
+		sqlite3_bind_null(stmt, idx);
+	}
+}
+
+struct inventory_db* inventory_db_open(const char *path)
+{
+	struct inventory_db *idb = calloc(1, sizeof(struct inventory_db));
+	if (!idb) {
+		return NULL;
+	}
+	if (sqlite3_open(path, &idb->db) != SQLITE_OK) {
+		fprintf(stderr, "ERROR: Could not open %s: %s\n", path, sqlite3_errmsg(idb->db));
+		sqlite3_close(idb->db);
+		free(idb);
+		return NULL;
+	}
+	sqlite3_busy_timeout(idb->db, 5000);
+
+	/* WAL lets queries run while an inventory is written */
+	if (db_exec(idb, "PRAGMA journal_mode=WAL; PRAGMA synchronous=NORMAL;") < 0
+	 || db_exec(idb, inventory_schema) < 0
+	 || db_migrate(idb) < 0
+	 || db_exec(idb, inventory_indexes) < 0
+	 || db_prepare(idb, "SELECT scan FROM devices WHERE udid = ?1", &idb->select_scan) < 0
+	 || db_prepare(idb, "INSERT INTO devices (udid, name, product_type, product_version, scan, last_scan)"
+	                    " VALUES (?1, ?2, ?3, ?4, ?5, ?6)"
+	                    " ON CONFLICT (udid) DO UPDATE SET name = excluded.name, product_type = excluded.product_type,"
+	                    " product_version = excluded.product_version, scan = excluded.scan, last_scan = excluded.last_scan",
+	                    &idb->upsert_device) < 0
+	 || db_prepare(idb, "INSERT INTO apps (udid, bundle_id, version, short_version, name, type, signer,"
+	                    " static_disk_usage, dynamic_disk_usage, scan, version_key)"
+	                    " VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10, ?11)"
+	                    " ON CONFLICT (udid, bundle_id) DO UPDATE SET version = excluded.version,"
+	                    " version_key = excluded.version_key, short_version = excluded.short_version, name = excluded.name, type = excluded.type,"
+	                    " signer = excluded.signer, static_disk_usage = excluded.static_disk_usage,"
+	                    " dynamic_disk_usage = excluded.dynamic_disk_usage, scan = excluded.scan",
+	                    &idb->upsert_app) < 0
+	 || db_prepare(idb, "DELETE FROM apps WHERE udid = ?1 AND scan < ?2", &idb->delete_stale) < 0) {
+		inventory_db_close(idb);
+		return NULL;
+	}
+
+	return idb;
+}
+
+int inventory_db_begin_scan(struct inventory_db *idb, const char *udid, plist_t device_info, int64_t *scan)
+{
+	int64_t last = 0;
+
+	if (db_begin(idb) < 0) {
+		return -1;
+	}
+	sqlite3_bind_text(idb->select_scan, 1, udid, -1, SQLITE_TRANSIENT);
+	if (sqlite3_step(idb->select_scan) == SQLITE_ROW) {
+		last = sqlite3_column_int64(idb->select_scan, 0);
+	}
+	sqlite3_reset(idb->select_scan);
+	sqlite3_clear_bindings(idb->select_scan);
+	*scan = last + 1;
+
+	sqlite3_bind_text(idb->upsert_device, 1, udid, -1, SQLITE_TRANSIENT);
+	bind_string(idb->upsert_device, 2, device_info, "DeviceName");
+	bind_string(idb->upsert_device, 3, device_info, "ProductType");
+	bind_string(idb->upsert_device, 4, device_info, "ProductVersion");
+	sqlite3_bind_int64(idb->upsert_device, 5, *scan);
+	sqlite3_bind_int64(idb->upsert_device, 6, (sqlite3_int64)time(NULL));
+	return db_step(idb, idb->upsert_device);
+}
+
+int inventory_db_store_app(struct inventory_db *idb, const char *udid, int64_t scan, plist_t app)
+{
+	if (!plist_dict_get_item(app, "CFBundleIdentifier")) {
+		return 0;
+	}
+	if (db_begin(idb) < 0) {
+		return -1;
+	}
+	sqlite3_bind_text(idb->upsert_app, 1, udid, -1, SQLITE_TRANSIENT);
+	bind_string(idb->upsert_app, 2, app, "CFBundleIdentifier");
+	bind_string(idb->upsert_app, 3, app, "CFBundleVersion");
+	bind_string(idb->upsert_app, 4, app, "CFBundleShortVersionString");
+	bind_string(idb->upsert_app, 5, app, "CFBundleDisplayName");
+	bind_string(idb->upsert_app, 6, app, "ApplicationType");
+	bind_string(idb->upsert_app, 7, app, "SignerIdentity");
+	bind_uint(idb->upsert_app, 8, app, "StaticDiskUsage");
+	bind_uint(idb->upsert_app, 9, app, "DynamicDiskUsage");
+	sqlite3_bind_int64(idb->upsert_app, 10, scan);
+	bind_version_key(idb->upsert_app, 11, app, "CFBundleVersion");
+	if (db_step(idb, idb->upsert_app) < 0) {
+		return -1;
+	}
+	if (++idb->pending >= INVENTORY_BATCH_SIZE) {
+		return db_commit(idb);
+	}
+	return 0;
+}
+
+int inventory_db_end_scan(struct inventory_db *idb, const char *udid, int64_t scan, int complete, uint32_t *removed)
+{
+	*removed = 0;
+	if (complete) {
+		if (db_begin(idb) < 0) {
+			return -1;
+		}
+		sqlite3_bind_text(idb->delete_stale, 1, udid, -1, SQLITE_TRANSIENT);
+		sqlite3_bind_int64(idb->delete_stale, 2, scan);
+		if (db_step(idb, idb->delete_stale) < 0) {
+			return -1;
+		}
+		*removed = (uint32_t)sqlite3_changes(idb->db);
+	}
+	return db_commit(idb);
+}
+
+void inventory_db_close(struct inventory_db *idb)
+{
+	if (!idb) {
+		return;
+	}
+	db_commit(idb);
+	sqlite3_finalize(idb->select_scan);
+	sqlite3_finalize(idb->upsert_device);
+	sqlite3_finalize(idb->upsert_app);
+	sqlite3_finalize(idb->delete_stale);
+	sqlite3_close(idb->db);
+	free(idb);
+}
@@ -0,0 +1,58 @@
+/*
+ * inventory.h
+ * SQLite store for app inventories of many devices
+ *
+ *
+ * Copyright (C) 2026 ideviceinstaller contributors
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifndef __INVENTORY_H
+#define __INVENTORY_H
+
+#include <stdint.h>
+#include <plist/plist.h>
+
+/* The database has a devices table with one row per device and an apps
+ * table with one row per app and device, see inventory.c for the schema.
+ * Writes are batched into transactions of up to INVENTORY_BATCH_SIZE rows.
+ * None of the functions are thread safe. */
+struct inventory_db;
+
+#define INVENTORY_BATCH_SIZE 1000
+
+/* Opens or creates the database file at path. Returns NULL on error. */
+struct inventory_db* inventory_db_open(const char *path);
+
+/* Starts a new scan of the device with the given UDID, recording the
+ * lockdown values in device_info. Sets scan to the number identifying the
+ * rows written during this scan. Returns 0 on success. */
+int inventory_db_begin_scan(struct inventory_db *db, const char *udid, plist_t device_info, int64_t *scan);
+
+/* Inserts or updates the row of the app record app on the device. */
+int inventory_db_store_app(struct inventory_db *db, const char *udid, int64_t scan, plist_t app);
+
+/* Finishes a scan. If complete is set, apps of the device that were not
+ * stored during the scan are deleted and their number is stored in
+ * removed. Commits all pending writes. */
+int inventory_db_end_scan(struct inventory_db *db, const char *udid, int64_t scan, int complete, uint32_t *removed);
+
+/* Commits pending writes and closes the database. */
+void inventory_db_close(struct inventory_db *db);
+
+#endif
@@ -0,0 +1,289 @@
+/*
+ * json.c
+ * Streaming JSON writer for plist nodes
+ *
+ *
+ * Copyright (C) 2026 ideviceinstaller contributors
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+#include <time.h>
+
+#include "json.h"
+
+#define ONES  0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+
+/* Checks 8 bytes at once for a control character, '"' or '\\'. Bytes
+ * >= 0x80 (UTF-8 sequences) are passed through. This may report a false
+ * positive after a byte that needs escaping, which only costs the slow
+ * path for that block. */
+static int block_needs_escape(uint64_t w)
+{
+	uint64_t ctrl = (w - 0x2020202020202020ULL) & ~w & HIGHS;
+	uint64_t quote = w ^ (ONES * '"');
+	uint64_t bslash = w ^ (ONES * '\\');
+	quote = (quote - ONES) & ~quote & HIGHS;
+	bslash = (bslash - ONES) & ~bslash & HIGHS;
+	return (ctrl | quote | bslash) != 0;
+}
+
+static void write_escaped_char(FILE *out, unsigned char c)
+{
+	switch (c) {
+		case '"':
+			fputs("\\\"", out);
+			break;
+		case '\\':
+			fputs("\\\\", out);
+			break;
+		case '\b':
+			fputs("\\b", out);
+			break;
+		case '\f':
+			fputs("\\f", out);
+			break;
+		case '\n':
+			fputs("\\n", out);
+			break;
+		case '\r':
+			fputs("\\r", out);
+			break;
+		case '\t':
+			fputs("\\t", out);
+			break;
+		default:
+			if (c < 0x20) {
+				fprintf(out, "\\u%04x", c);
+			} else {
+				fputc(c, out);
+			}
+			break;
+	}
+}
+
+void json_write_string(FILE *out, const char *str, size_t len)
+{
+	const unsigned char *p = (const unsigned char*)str;
+	const unsigned char *end = p + len;
+	const unsigned char *run = p;
+
+	fputc('"', out);
+	while (p < end) {
+		/* skip over blocks that can be copied verbatim */
+		while (end - p >= 8) {
+			uint64_t w;
+			memcpy(&w, p, 8);
+			if (block_needs_escape(w)) {
+				break;
+			}
+			p += 8;
+		}
+		if (p >= end) {
+			break;
+		}
+		unsigned char c = *p;
+		if (c < 0x20 || c == '"' || c == '\\') {
+			if (p > run) {
+				fwrite(run, 1, p - run, out);
+			}
+			write_escaped_char(out, c);
+			run = p + 1;
+		}
+		p++;
+	}
+	if (end > run) {
+		fwrite(run, 1, end - run, out);
+	}
+	fputc('"', out);
+}
+
+void json_write_base64(FILE *out, const unsigned char *data, size_t len)
+{
+	static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	char buf[256];
+	size_t n = 0;
+	size_t i;
+
+	fputc('"', out);
+	for (i = 0; i + 2 < len; i += 3) {
+		uint32_t v = (data[i] << 16) | (data[i+1] << 8) | data[i+2];
+		buf[n++] = b64[(v >> 18) & 0x3f];
+		buf[n++] = b64[(v >> 12) & 0x3f];
+		buf[n++] = b64[(v >> 6) & 0x3f];
+		buf[n++] = b64[v & 0x3f];
+		if (n > sizeof(buf) - 4) {
+			fwrite(buf, 1, n, out);
+			n = 0;
+		}
+	}
+	if (i < len) {
+		uint32_t v = data[i] << 16;
+		if (i + 1 < len) {
+			v |= data[i+1] << 8;
+		}
+		buf[n++] = b64[(v >> 18) & 0x3f];
+		buf[n++] = b64[(v >> 12) & 0x3f];
+		buf[n++] = (i + 1 < len) ? b64[(v >> 6) & 0x3f] : '=';
+		buf[n++] = '=';
+	}
+	fwrite(buf, 1, n, out);
+	fputc('"', out);
+}
+
+static void write_indent(FILE *out, int depth)
+{
+	int i;
+	fputc('\n', out);
+	for (i = 0; i < depth; i++) {
+		fputs("  ", out);
+	}
+}
+
+void json_write_node(FILE *out, plist_t node, int pretty, int depth)
+{
+	switch (plist_get_node_type(node)) {
+		case PLIST_DICT: {
+			plist_dict_iter iter = NULL;
+			int count = 0;
+			plist_dict_new_iter(node, &iter);
+			fputc('{', out);
+			while (1) {
+				char *key = NULL;
+				plist_t val = NULL;
+				plist_dict_next_item(node, iter, &key, &val);
+				if (!key) {
+					break;
+				}
+				if (count++ > 0) {
+					fputc(',', out);
+				}
+				if (pretty) {
+					write_indent(out, depth + 1);
+				}
+				json_write_string(out, key, strlen(key));
+				fputs((pretty) ? ": " : ":", out);
+				json_write_node(out, val, pretty, depth + 1);
+				free(key);
+			}
+			free(iter);
+			if (pretty && count > 0) {
+				write_indent(out, depth);
+			}
+			fputc('}', out);
+			break;
+		}
+		case PLIST_ARRAY: {
+			uint32_t i;
+			uint32_t count = plist_array_get_size(node);
+			fputc('[', out);
+			for (i = 0; i < count; i++) {
+				if (i > 0) {
+					fputc(',', out);
+				}
+				if (pretty) {
+					write_indent(out, depth + 1);
+				}
+				json_write_node(out, plist_array_get_item(node, i), pretty, depth + 1);
+			}
+			if (pretty && count > 0) {
+				write_indent(out, depth);
+			}
+			fputc(']', out);
+			break;
+		}
+		case PLIST_STRING:
+		case PLIST_KEY: {
+			uint64_t len = 0;
+			const char *str = plist_get_string_ptr(node, &len);
+			json_write_string(out, (str) ? str : "", (str) ? (size_t)len : 0);
+			break;
+		}
+		case PLIST_INT:
+			if (plist_int_val_is_negative(node)) {
+				int64_t val = 0;
+				plist_get_int_val(node, &val);
+				fprintf(out, "%" PRId64, val);
+			} else {
+				uint64_t val = 0;
+				plist_get_uint_val(node, &val);
+				fprintf(out, "%" PRIu64, val);
+			}
+			break;
+		case PLIST_REAL: {
+			double val = 0;
+			plist_get_real_val(node, &val);
+			if (isfinite(val)) {
+				fprintf(out, "%.17g", val);
+			} else {
+				fputs("null", out);
+			}
+			break;
+		}
+		case PLIST_BOOLEAN:
+			fputs((plist_bool_val_is_true(node)) ? "true" : "false", out);
+			break;
+		case PLIST_DATA: {
+			uint64_t len = 0;
+			const char *data = plist_get_data_ptr(node, &len);
+			json_write_base64(out, (const unsigned char*)data, (data) ? (size_t)len : 0);
+			break;
+		}
+		case PLIST_DATE: {
+			int64_t sec = 0;
+			time_t t;
+			struct tm tm;
+			char buf[32];
+#ifdef HAVE_PLIST_UNIX_DATE
+			plist_get_unix_date_val(node, &sec);
+#else
+			/* seconds since 2001-01-01 */
+			int32_t date_sec = 0;
+			int32_t date_usec = 0;
+			plist_get_date_val(node, &date_sec, &date_usec);
+			sec = (int64_t)date_sec + 978307200;
+#endif
+			t = (time_t)sec;
+#ifdef WIN32
+			gmtime_s(&tm, &t);
+#else
+			gmtime_r(&t, &tm);
+#endif
+			strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", &tm);
+			json_write_string(out, buf, strlen(buf));
+			break;
+		}
+		case PLIST_UID: {
+			uint64_t val = 0;
+			plist_get_uid_val(node, &val);
+			fprintf(out, "%" PRIu64, val);
+			break;
+		}
+		default:
+			fputs("null", out);
+			break;
+	}
+}
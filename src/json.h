@@ -0,0 +1,45 @@
+/*
+ * json.h
+ * Streaming JSON writer for plist nodes
+ *
+ *
+ * Copyright (C) 2026 ideviceinstaller contributors
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifndef __JSON_H
+#define __JSON_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <plist/plist.h>
+
+/* Writes node as JSON. With pretty set, containers are spread over
+ * multiple lines indented by two spaces per level, starting at depth;
+ * otherwise the output is compact and on one line. DATA nodes are written
+ * as base64 strings, DATE nodes as ISO 8601 strings, and UID nodes as
+ * numbers. */
+void json_write_node(FILE *out, plist_t node, int pretty, int depth);
+
+/* Writes len bytes of UTF-8 str as a quoted and escaped JSON string. */
+void json_write_string(FILE *out, const char *str, size_t len);
+
+/* Writes len bytes of data as a quoted base64 string. */
+void json_write_base64(FILE *out, const unsigned char *data, size_t len);
+
+#endif
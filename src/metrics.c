@@ -0,0 +1,470 @@
+/*
+ * metrics.c
+ * Aggregated counters and latency histograms
+ *
+ *
+ * Copyright (C) 2026 ideviceinstaller contributors
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <libimobiledevice-glue/thread.h>
+
+#include "metrics.h"
+#include "trace.h"
+#include "json.h"
+#include "utils.h"
+
+/* Values below 2^SUB_BITS are counted exactly, larger ones in buckets of
+ * 2^(SUB_BITS-1) per power of two. Values are capped at 2^MAX_BITS. */
+#define SUB_BITS 7
+#define SUB_HALF (1 << (SUB_BITS - 1))
+#define MAX_BITS 40
+#define NUM_BUCKETS ((MAX_BITS - SUB_BITS + 2) * SUB_HALF)
+
+struct histogram {
+	uint64_t counts[NUM_BUCKETS];
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+};
+
+enum metrics_histogram {
+	HIST_AFC_OPEN,
+	HIST_AFC_WRITE,
+	HIST_AFC_CLOSE,
+	HIST_AFC_MKDIR,
+	HIST_READ_PACKAGE,
+	HIST_UPLOAD,
+	HIST_INSTALL,
+	HIST_UNINSTALL,
+	HIST_STATUS_INTERVAL,
+	NUM_HISTOGRAMS
+};
+
+static const struct {
+	const char *cat;         /* span the histogram is fed from */
+	const char *span;
+	const char *name;
+	const char *label;       /* name="value" label or NULL */
+	const char *help;
+} histogram_info[NUM_HISTOGRAMS] = {
+	{ "afc", "afc_file_open", "afc_op_duration_seconds", "op=\"open\"", "Duration of AFC operations" },
+	{ "afc", "afc_file_write", "afc_op_duration_seconds", "op=\"write\"", NULL },
+	{ "afc", "afc_file_close", "afc_op_duration_seconds", "op=\"close\"", NULL },
+	{ "afc", "afc_make_directory", "afc_op_duration_seconds", "op=\"make_directory\"", NULL },
+	{ "package", "Read package", "package_read_duration_seconds", NULL, "Time to read a package and its metadata" },
+	{ "afc", "Upload package", "upload_duration_seconds", NULL, "Time to upload a package" },
+	{ "device", "Install", "install_duration_seconds", NULL, "Time from the install request until the device reports completion" },
+	{ "device", "Uninstall", "uninstall_duration_seconds", NULL, "Time from the uninstall request until the device reports completion" },
+	{ NULL, NULL, "status_interval_seconds", NULL, "Time between two status updates of a command" }
+};
+
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+#define NUM_QUANTILES (sizeof(quantiles) / sizeof(quantiles[0]))
+
+struct error_counter {
+	char *name;
+	uint64_t code;
+	uint64_t count;
+	struct error_counter *next;
+};
+
+static volatile int metrics_enabled = 0;
+static char *metrics_path = NULL;
+static int metrics_json = 0;
+static mutex_t metrics_lock;
+static struct histogram *histograms = NULL;
+static uint64_t upload_bytes = 0;
+static uint64_t upload_us = 0;
+static uint64_t afc_write_bytes = 0;
+static uint64_t retries = 0;
+static struct error_counter *errors = NULL;
+static uint64_t start_time = 0;
+
+static unsigned int interval_s = 0;
+static int writer_running = 0;
+static THREAD_T writer_thread;
+static cond_t writer_cond;
+
+static uint32_t bucket_index(uint64_t value)
+{
+	uint32_t msb = 0;
+	uint64_t v;
+
+	if (value < (1 << SUB_BITS)) {
+		return (uint32_t)value;
+	}
+	if (value >= (1ULL << MAX_BITS)) {
+		value = (1ULL << MAX_BITS) - 1;
+	}
+	for (v = value; v > 1; v >>= 1) {
+		msb++;
+	}
+	uint32_t shift = msb - (SUB_BITS - 1);
+	return shift * SUB_HALF + (uint32_t)(value >> shift);
+}
+
+/* Returns the highest value counted in the bucket */
+static uint64_t bucket_value(uint32_t index)
+{
+	if (index < (1 << SUB_BITS)) {
+		return index;
+	}
+	uint32_t shift = index / SUB_HALF - 1;
+	uint64_t sub = index % SUB_HALF + SUB_HALF;
+	return ((sub + 1) << shift) - 1;
+}
+
+/* must be called with metrics_lock held */
+static void histogram_add(struct histogram *h, uint64_t value)
+{
+	h->counts[bucket_index(value)]++;
+	if (h->count == 0 || value < h->min) {
+		h->min = value;
+	}
+	if (value > h->max) {
+		h->max = value;
+	}
+	h->count++;
+	h->sum += value;
+}
+
+static uint64_t histogram_quantile(const struct histogram *h, double q)
+{
+	uint64_t rank = (uint64_t)(q * h->count + 0.5);
+	uint64_t seen = 0;
+	uint32_t i;
+
+	if (rank < 1) {
+		rank = 1;
+	}
+	for (i = 0; i < NUM_BUCKETS; i++) {
+		seen += h->counts[i];
+		if (seen >= rank) {
+			uint64_t value = bucket_value(i);
+			return (value > h->max) ? h->max : value;
+		}
+	}
+	return h->max;
+}
+
+static void metrics_span(const char *cat, const char *name, const char *detail, uint64_t start, uint64_t dur, int64_t bytes)
+{
+	int i;
+
+	/* the device handles upgrades just like installs */
+	if (!strcmp(cat, "device") && !strcmp(name, "Upgrade")) {
+		name = "Install";
+	}
+	for (i = 0; i < NUM_HISTOGRAMS; i++) {
+		if (histogram_info[i].span && !strcmp(histogram_info[i].span, name) && !strcmp(histogram_info[i].cat, cat)) {
+			break;
+		}
+	}
+	if (i == NUM_HISTOGRAMS) {
+		return;
+	}
+
+	mutex_lock(&metrics_lock);
+	histogram_add(&histograms[i], dur);
+	if (i == HIST_AFC_WRITE && bytes > 0) {
+		afc_write_bytes += bytes;
+	} else if (i == HIST_UPLOAD && bytes > 0) {
+		upload_bytes += bytes;
+		upload_us += dur;
+	}
+	mutex_unlock(&metrics_lock);
+}
+
+void metrics_count_retry(void)
+{
+	if (!metrics_enabled) {
+		return;
+	}
+	mutex_lock(&metrics_lock);
+	retries++;
+	mutex_unlock(&metrics_lock);
+}
+
+void metrics_count_error(const char *name, uint64_t code)
+{
+	struct error_counter *ec;
+
+	if (!metrics_enabled || !name) {
+		return;
+	}
+	mutex_lock(&metrics_lock);
+	for (ec = errors; ec; ec = ec->next) {
+		if (ec->code == code && !strcmp(ec->name, name)) {
+			break;
+		}
+	}
+	if (!ec) {
+		ec = (struct error_counter*)calloc(1, sizeof(struct error_counter));
+		if (ec) {
+			ec->name = strdup(name);
+			ec->code = code;
+			ec->next = errors;
+			errors = ec;
+		}
+	}
+	if (ec) {
+		ec->count++;
+	}
+	mutex_unlock(&metrics_lock);
+}
+
+void metrics_status_update(uint64_t *last)
+{
+	uint64_t now;
+
+	if (!metrics_enabled) {
+		return;
+	}
+	now = time_now_us();
+	if (*last) {
+		mutex_lock(&metrics_lock);
+		histogram_add(&histograms[HIST_STATUS_INTERVAL], now - *last);
+		mutex_unlock(&metrics_lock);
+	}
+	*last = now;
+}
+
+/* Prometheus label values need '\\', '"' and newlines escaped */
+static void write_label_value(FILE *f, const char *str)
+{
+	for (; *str; str++) {
+		if (*str == '\\' || *str == '"') {
+			fputc('\\', f);
+			fputc(*str, f);
+		} else if (*str == '\n') {
+			fputs("\\n", f);
+		} else {
+			fputc(*str, f);
+		}
+	}
+}
+
+static void write_prometheus(FILE *f)
+{
+	struct error_counter *ec;
+	const char *prev_name = NULL;
+	unsigned int q;
+	int i;
+
+	fprintf(f, "# HELP ideviceinstaller_uptime_seconds Time since the metrics were started\n");
+	fprintf(f, "# TYPE ideviceinstaller_uptime_seconds gauge\n");
+	fprintf(f, "ideviceinstaller_uptime_seconds %.3f\n", (time_now_us() - start_time) / 1000000.0);
+
+	for (i = 0; i < NUM_HISTOGRAMS; i++) {
+		const struct histogram *h = &histograms[i];
+		const char *label = histogram_info[i].label;
+		if (!prev_name || strcmp(prev_name, histogram_info[i].name)) {
+			fprintf(f, "# HELP ideviceinstaller_%s %s\n", histogram_info[i].name, histogram_info[i].help);
+			fprintf(f, "# TYPE ideviceinstaller_%s summary\n", histogram_info[i].name);
+			prev_name = histogram_info[i].name;
+		}
+		if (h->count > 0) {
+			for (q = 0; q < NUM_QUANTILES; q++) {
+				fprintf(f, "ideviceinstaller_%s{%s%squantile=\"%g\"} %.6f\n", histogram_info[i].name, (label) ? label : "", (label) ? "," : "", quantiles[q], histogram_quantile(h, quantiles[q]) / 1000000.0);
+			}
+		}
+		fprintf(f, "ideviceinstaller_%s_sum%s%s%s %.6f\n", histogram_info[i].name, (label) ? "{" : "", (label) ? label : "", (label) ? "}" : "", h->sum / 1000000.0);
+		fprintf(f, "ideviceinstaller_%s_count%s%s%s %" PRIu64 "\n", histogram_info[i].name, (label) ? "{" : "", (label) ? label : "", (label) ? "}" : "", h->count);
+	}
+
+	fprintf(f, "# HELP ideviceinstaller_upload_bytes_total Bytes of packages uploaded\n");
+	fprintf(f, "# TYPE ideviceinstaller_upload_bytes_total counter\n");
+	fprintf(f, "ideviceinstaller_upload_bytes_total %" PRIu64 "\n", upload_bytes);
+	fprintf(f, "# HELP ideviceinstaller_upload_throughput_bytes_per_second Average upload throughput\n");
+	fprintf(f, "# TYPE ideviceinstaller_upload_throughput_bytes_per_second gauge\n");
+	fprintf(f, "ideviceinstaller_upload_throughput_bytes_per_second %.0f\n", (upload_us) ? upload_bytes * 1000000.0 / upload_us : 0.0);
+	fprintf(f, "# HELP ideviceinstaller_afc_write_bytes_total Bytes written through AFC\n");
+	fprintf(f, "# TYPE ideviceinstaller_afc_write_bytes_total counter\n");
+	fprintf(f, "ideviceinstaller_afc_write_bytes_total %" PRIu64 "\n", afc_write_bytes);
+	fprintf(f, "# HELP ideviceinstaller_retries_total Requests retried because installation_proxy was busy\n");
+	fprintf(f, "# TYPE ideviceinstaller_retries_total counter\n");
+	fprintf(f, "ideviceinstaller_retries_total %" PRIu64 "\n", retries);
+	fprintf(f, "# HELP ideviceinstaller_errors_total Errors reported by the device\n");
+	fprintf(f, "# TYPE ideviceinstaller_errors_total counter\n");
+	for (ec = errors; ec; ec = ec->next) {
+		fputs("ideviceinstaller_errors_total{error=\"", f);
+		write_label_value(f, ec->name);
+		fprintf(f, "\",code=\"0x%08" PRIx64 "\"} %" PRIu64 "\n", ec->code, ec->count);
+	}
+}
+
+static void write_json(FILE *f)
+{
+	struct error_counter *ec;
+	unsigned int q;
+	int i;
+
+	fprintf(f, "{\n  \"uptime_seconds\": %.3f,\n  \"histograms\": [", (time_now_us() - start_time) / 1000000.0);
+	for (i = 0; i < NUM_HISTOGRAMS; i++) {
+		const struct histogram *h = &histograms[i];
+		const char *label = histogram_info[i].label;
+		fprintf(f, "%s\n    { \"name\": \"%s\"", (i > 0) ? "," : "", histogram_info[i].name);
+		if (label) {
+			/* op="write" */
+			const char *value = strchr(label, '"') + 1;
+			fprintf(f, ", \"op\": \"%.*s\"", (int)(strlen(value) - 1), value);
+		}
+		fprintf(f, ", \"count\": %" PRIu64 ", \"sum\": %.6f", h->count, h->sum / 1000000.0);
+		if (h->count > 0) {
+			fprintf(f, ", \"min\": %.6f, \"max\": %.6f, \"mean\": %.6f", h->min / 1000000.0, h->max / 1000000.0, (double)h->sum / h->count / 1000000.0);
+			for (q = 0; q < NUM_QUANTILES; q++) {
+				fprintf(f, ", \"p%g\": %.6f", quantiles[q] * 100, histogram_quantile(h, quantiles[q]) / 1000000.0);
+			}
+		}
+		fputs(" }", f);
+	}
+	fprintf(f, "\n  ],\n  \"upload_bytes\": %" PRIu64 ",\n", upload_bytes);
+	fprintf(f, "  \"upload_throughput_bytes_per_second\": %.0f,\n", (upload_us) ? upload_bytes * 1000000.0 / upload_us : 0.0);
+	fprintf(f, "  \"afc_write_bytes\": %" PRIu64 ",\n", afc_write_bytes);
+	fprintf(f, "  \"retries\": %" PRIu64 ",\n  \"errors\": [", retries);
+	for (ec = errors; ec; ec = ec->next) {
+		fprintf(f, "%s\n    { \"error\": ", (ec != errors) ? "," : "");
+		json_write_string(f, ec->name, strlen(ec->name));
+		fprintf(f, ", \"code\": %" PRIu64 ", \"count\": %" PRIu64 " }", ec->code, ec->count);
+	}
+	fputs((errors) ? "\n  ]\n}\n" : "]\n}\n", f);
+}
+
+/* The file is replaced as a whole, so the textfile collector never reads
+ * a partial file. */
+static int metrics_write(void)
+{
+	FILE *f = output_file_open(metrics_path);
+
+	if (!f) {
+		return -1;
+	}
+	mutex_lock(&metrics_lock);
+	if (metrics_json) {
+		write_json(f);
+	} else {
+		write_prometheus(f);
+	}
+	mutex_unlock(&metrics_lock);
+
+	return output_file_commit(f, metrics_path);
+}
+
+static void* metrics_writer(void *arg)
+{
+	mutex_lock(&metrics_lock);
+	while (writer_running) {
+		uint64_t deadline = time_now_us() + interval_s * 1000000ULL;
+		while (writer_running && time_now_us() < deadline) {
+			cond_wait_timeout(&writer_cond, &metrics_lock, 1000);
+		}
+		if (!writer_running) {
+			break;
+		}
+		mutex_unlock(&metrics_lock);
+		metrics_write();
+		mutex_lock(&metrics_lock);
+	}
+	mutex_unlock(&metrics_lock);
+
+	return NULL;
+}
+
+int metrics_open(const char *path, unsigned int interval)
+{
+	size_t len = strlen(path);
+
+	if (metrics_enabled || output_file_check(path) < 0) {
+		return -1;
+	}
+	histograms = (struct histogram*)calloc(NUM_HISTOGRAMS, sizeof(struct histogram));
+	if (!histograms) {
+		return -1;
+	}
+	metrics_path = strdup(path);
+	metrics_json = (len > 5 && !strcmp(path + len - 5, ".json"));
+	start_time = time_now_us();
+	mutex_init(&metrics_lock);
+	cond_init(&writer_cond);
+
+	if (trace_add_sink(metrics_span) < 0) {
+		cond_destroy(&writer_cond);
+		mutex_destroy(&metrics_lock);
+		free(metrics_path);
+		metrics_path = NULL;
+		free(histograms);
+		histograms = NULL;
+		return -1;
+	}
+	metrics_enabled = 1;
+
+	if (interval > 0) {
+		interval_s = interval;
+		writer_running = 1;
+		if (thread_new(&writer_thread, metrics_writer, NULL) != 0) {
+			writer_running = 0;
+		}
+	}
+
+	return 0;
+}
+
+int metrics_close(void)
+{
+	struct error_counter *ec;
+	int res;
+
+	if (!metrics_enabled) {
+		return 0;
+	}
+	if (writer_running) {
+		mutex_lock(&metrics_lock);
+		writer_running = 0;
+		cond_signal(&writer_cond);
+		mutex_unlock(&metrics_lock);
+		thread_join(writer_thread);
+		thread_free(writer_thread);
+	}
+	res = metrics_write();
+	metrics_enabled = 0;
+
+	while (errors) {
+		ec = errors;
+		errors = ec->next;
+		free(ec->name);
+		free(ec);
+	}
+	cond_destroy(&writer_cond);
+	mutex_destroy(&metrics_lock);
+	free(histograms);
+	histograms = NULL;
+	free(metrics_path);
+	metrics_path = NULL;
+
+	return res;
+}
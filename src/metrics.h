@@ -0,0 +1,55 @@
+/*
+ * metrics.h
+ * Aggregated counters and latency histograms
+ *
+ *
+ * Copyright (C) 2026 ideviceinstaller contributors
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifndef __METRICS_H
+#define __METRICS_H
+
+#include <stdint.h>
+
+/* Metrics for --metrics are aggregated in memory: latencies go into
+ * log-linear histograms with about 1% resolution, so percentiles can be
+ * reported without keeping the samples. The file is written in the
+ * Prometheus textfile format, or as JSON if its name ends in .json, at
+ * metrics_close() and every interval seconds if one is given. The spans
+ * of the trace module are the main source. All functions may be called
+ * from any thread and do nothing unless metrics_open() was called. */
+
+/* Starts collecting metrics for path. Returns 0 on success. */
+int metrics_open(const char *path, unsigned int interval);
+
+/* Writes the metrics a last time and stops collecting. Returns 0 on
+ * success. */
+int metrics_close(void);
+
+/* Counts a retry of a busy installation_proxy */
+void metrics_count_retry(void);
+
+/* Counts an error reported by the device */
+void metrics_count_error(const char *name, uint64_t code);
+
+/* Records the time since the previous status update of the same command,
+ * last holds the time of the previous update and is updated. */
+void metrics_status_update(uint64_t *last);
+
+#endif
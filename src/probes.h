@@ -0,0 +1,54 @@
+/*
+ * probes.h
+ * USDT probes for bpftrace and perf
+ *
+ *
+ * Copyright (C) 2026 ideviceinstaller contributors
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifndef __PROBES_H
+#define __PROBES_H
+
+/* Statically defined tracing probes, added with configure --enable-usdt.
+ * They show up as usdt:ideviceinstaller:NAME in bpftrace and perf and
+ * cost a single nop while nothing is attached; without --enable-usdt they
+ * compile to nothing. See contrib/bpftrace for examples.
+ *
+ *   phase(name)                       main moves on to the named phase
+ *   zip__entry__begin()               r_zip_get_next_entry() is called,
+ *                                     before the previous entry is skipped
+ *   zip__entry__end(name, csize, size)  a ZIP entry header was read
+ *   afc__write__begin(handle, len)    before every afc_file_write()
+ *   afc__write__end(handle, written, error)  after it returned
+ *   status(command, status, percent)  installation_proxy status update
+ */
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+#define PROBE(name) DTRACE_PROBE(ideviceinstaller, name)
+#define PROBE1(name, a) DTRACE_PROBE1(ideviceinstaller, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(ideviceinstaller, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(ideviceinstaller, name, a, b, c)
+#else
+#define PROBE(name) do { } while (0)
+#define PROBE1(name, a) do { } while (0)
+#define PROBE2(name, a, b) do { } while (0)
+#define PROBE3(name, a, b, c) do { } while (0)
+#endif
+
+#endif
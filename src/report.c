@@ -0,0 +1,318 @@
+/*
+ * report.c
+ * Machine readable summary of install operations
+ *
+ *
+ * Copyright (C) 2026 ideviceinstaller contributors
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include <libimobiledevice-glue/thread.h>
+
+#include "report.h"
+#include "json.h"
+#include "utils.h"
+
+struct report_phase {
+	char *name;
+	uint64_t us;
+};
+
+struct report_op {
+	char *command;
+	char *path;
+	char *device;
+	char *bundle_id;
+	uint64_t size;
+	uint64_t uploaded;
+	uint64_t upload_us;
+	uint64_t start;
+	uint64_t end;
+	int finished;
+	int skipped;
+	struct report_phase *phases;
+	uint32_t num_phases;
+	char *status;            /* device phase in progress */
+	uint64_t status_start;
+	char *error_name;
+	char *error_description;
+	uint64_t error_code;
+	struct report_op *next;
+};
+
+static char *report_path = NULL;
+static time_t report_time = 0;
+static mutex_t report_lock;
+static struct report_op *ops = NULL;
+static struct report_op **ops_tail = &ops;
+
+int report_open(const char *path)
+{
+	if (report_path || output_file_check(path) < 0) {
+		return -1;
+	}
+
+	mutex_init(&report_lock);
+	report_time = time(NULL);
+	report_path = strdup(path);
+
+	return 0;
+}
+
+struct report_op* report_op_new(const char *command, const char *path, const char *device)
+{
+	struct report_op *op;
+
+	if (!report_path) {
+		return NULL;
+	}
+	op = (struct report_op*)calloc(1, sizeof(struct report_op));
+	if (!op) {
+		return NULL;
+	}
+	op->command = strdup(command);
+	op->path = (path) ? strdup(path) : NULL;
+	op->device = (device) ? strdup(device) : NULL;
+	op->start = time_now_us();
+
+	mutex_lock(&report_lock);
+	*ops_tail = op;
+	ops_tail = &op->next;
+	mutex_unlock(&report_lock);
+
+	return op;
+}
+
+void report_op_set_device(struct report_op *op, const char *device)
+{
+	if (!op || !device) {
+		return;
+	}
+	mutex_lock(&report_lock);
+	free(op->device);
+	op->device = strdup(device);
+	mutex_unlock(&report_lock);
+}
+
+void report_op_set_package(struct report_op *op, const char *bundle_id, uint64_t size)
+{
+	if (!op) {
+		return;
+	}
+	mutex_lock(&report_lock);
+	if (bundle_id) {
+		free(op->bundle_id);
+		op->bundle_id = strdup(bundle_id);
+	}
+	op->size = size;
+	mutex_unlock(&report_lock);
+}
+
+/* must be called with report_lock held */
+static void report_op_add_phase(struct report_op *op, const char *name, uint64_t us)
+{
+	if (op->num_phases > 0 && !strcmp(op->phases[op->num_phases-1].name, name)) {
+		op->phases[op->num_phases-1].us += us;
+		return;
+	}
+	struct report_phase *phases = (struct report_phase*)realloc(op->phases, (op->num_phases + 1) * sizeof(struct report_phase));
+	if (!phases) {
+		return;
+	}
+	op->phases = phases;
+	op->phases[op->num_phases].name = strdup(name);
+	op->phases[op->num_phases].us = us;
+	op->num_phases++;
+}
+
+void report_op_phase(struct report_op *op, const char *name, uint64_t start)
+{
+	uint64_t now;
+
+	if (!op) {
+		return;
+	}
+	now = time_now_us();
+	mutex_lock(&report_lock);
+	report_op_add_phase(op, name, (now > start) ? now - start : 0);
+	if (!strcmp(name, "Upload")) {
+		op->upload_us += (now > start) ? now - start : 0;
+	}
+	mutex_unlock(&report_lock);
+}
+
+void report_op_uploaded(struct report_op *op, uint64_t bytes)
+{
+	if (!op) {
+		return;
+	}
+	mutex_lock(&report_lock);
+	op->uploaded += bytes;
+	mutex_unlock(&report_lock);
+}
+
+void report_op_status(struct report_op *op, const char *status)
+{
+	uint64_t now;
+
+	if (!op) {
+		return;
+	}
+	now = time_now_us();
+	mutex_lock(&report_lock);
+	if (op->status && (!status || strcmp(op->status, status))) {
+		report_op_add_phase(op, op->status, now - op->status_start);
+		free(op->status);
+		op->status = NULL;
+	}
+	if (status && !op->status) {
+		op->status = strdup(status);
+		op->status_start = now;
+	}
+	mutex_unlock(&report_lock);
+}
+
+void report_op_error(struct report_op *op, const char *name, const char *description, uint64_t code)
+{
+	if (!op || !name) {
+		return;
+	}
+	mutex_lock(&report_lock);
+	if (!op->error_name) {
+		op->error_name = strdup(name);
+		op->error_description = (description) ? strdup(description) : NULL;
+		op->error_code = code;
+	}
+	mutex_unlock(&report_lock);
+}
+
+void report_op_finish(struct report_op *op, int skipped)
+{
+	if (!op) {
+		return;
+	}
+	report_op_status(op, NULL);
+	mutex_lock(&report_lock);
+	op->end = time_now_us();
+	op->finished = 1;
+	op->skipped = skipped;
+	mutex_unlock(&report_lock);
+}
+
+static void write_string_member(FILE *f, const char *key, const char *value)
+{
+	fprintf(f, ",\n      \"%s\": ", key);
+	if (value) {
+		json_write_string(f, value, strlen(value));
+	} else {
+		fputs("null", f);
+	}
+}
+
+static void write_op(FILE *f, const struct report_op *op)
+{
+	const char *result;
+	uint32_t i;
+
+	if (!op->finished) {
+		result = "Incomplete";
+	} else if (op->error_name) {
+		result = "Failed";
+	} else if (op->skipped) {
+		result = "Skipped";
+	} else {
+		result = "Success";
+	}
+	fputs("    {\n      \"command\": ", f);
+	json_write_string(f, op->command, strlen(op->command));
+	write_string_member(f, "path", op->path);
+	write_string_member(f, "device", op->device);
+	write_string_member(f, "bundle_id", op->bundle_id);
+	fprintf(f, ",\n      \"result\": \"%s\"", result);
+	fprintf(f, ",\n      \"package_size\": %" PRIu64, op->size);
+	fprintf(f, ",\n      \"bytes_uploaded\": %" PRIu64, op->uploaded);
+	fprintf(f, ",\n      \"upload_throughput_bytes_per_second\": %.0f", (op->upload_us) ? op->uploaded * 1000000.0 / op->upload_us : 0.0);
+	fprintf(f, ",\n      \"duration_seconds\": %.6f", ((op->end) ? op->end - op->start : time_now_us() - op->start) / 1000000.0);
+	fputs(",\n      \"phases\": [", f);
+	for (i = 0; i < op->num_phases; i++) {
+		fprintf(f, "%s\n        { \"name\": ", (i > 0) ? "," : "");
+		json_write_string(f, op->phases[i].name, strlen(op->phases[i].name));
+		fprintf(f, ", \"seconds\": %.6f }", op->phases[i].us / 1000000.0);
+	}
+	fputs((op->num_phases > 0) ? "\n      ]" : "]", f);
+	write_string_member(f, "error", op->error_name);
+	write_string_member(f, "error_description", op->error_description);
+	fprintf(f, ",\n      \"error_code\": %" PRIu64 "\n    }", op->error_code);
+}
+
+int report_close(void)
+{
+	struct report_op *op;
+	FILE *f;
+	int res = -1;
+
+	if (!report_path) {
+		return 0;
+	}
+
+	mutex_lock(&report_lock);
+	f = output_file_open(report_path);
+	if (f) {
+		fprintf(f, "{\n  \"version\": \"%s\",\n  \"timestamp\": %" PRId64 ",\n  \"operations\": [", PACKAGE_VERSION, (int64_t)report_time);
+		for (op = ops; op; op = op->next) {
+			fputs((op != ops) ? ",\n" : "\n", f);
+			write_op(f, op);
+		}
+		fputs((ops) ? "\n  ]\n}\n" : "]\n}\n", f);
+		res = output_file_commit(f, report_path);
+	}
+
+	while (ops) {
+		uint32_t i;
+		op = ops;
+		ops = op->next;
+		for (i = 0; i < op->num_phases; i++) {
+			free(op->phases[i].name);
+		}
+		free(op->phases);
+		free(op->command);
+		free(op->path);
+		free(op->device);
+		free(op->bundle_id);
+		free(op->status);
+		free(op->error_name);
+		free(op->error_description);
+		free(op);
+	}
+	ops_tail = &ops;
+	mutex_unlock(&report_lock);
+	mutex_destroy(&report_lock);
+	free(report_path);
+	report_path = NULL;
+
+	return res;
+}
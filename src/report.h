@@ -0,0 +1,69 @@
+/*
+ * report.h
+ * Machine readable summary of install operations
+ *
+ *
+ * Copyright (C) 2026 ideviceinstaller contributors
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifndef __REPORT_H
+#define __REPORT_H
+
+#include <stdint.h>
+
+/* The report for --report has one entry per install, upgrade, or
+ * uninstall with the package, the bytes uploaded, the time spent in each
+ * phase (reading the package, uploading it, and every status reported by
+ * the device), and the final error. It is written as JSON at
+ * report_close(). All functions may be called from any thread; the
+ * report_op_*() functions do nothing if op is NULL, which is what
+ * report_op_new() returns unless report_open() was called. */
+struct report_op;
+
+/* Starts collecting operations for path. Returns 0 on success. */
+int report_open(const char *path);
+
+/* Writes the report and frees all operations. Returns 0 on success. */
+int report_close(void);
+
+/* Adds an operation like "Install" of the package or bundle ID at path */
+struct report_op* report_op_new(const char *command, const char *path, const char *device);
+
+void report_op_set_device(struct report_op *op, const char *device);
+
+void report_op_set_package(struct report_op *op, const char *bundle_id, uint64_t size);
+
+/* Adds the time from start (as returned by time_now_us()) until now to
+ * the phase name. Consecutive phases of the same name are merged. */
+void report_op_phase(struct report_op *op, const char *name, uint64_t start);
+
+void report_op_uploaded(struct report_op *op, uint64_t bytes);
+
+/* Ends the device phase started by the previous status, and starts one
+ * for status unless it is NULL. */
+void report_op_status(struct report_op *op, const char *status);
+
+/* Records the error the operation failed with. Only the first error of
+ * an operation is kept. description may be NULL. */
+void report_op_error(struct report_op *op, const char *name, const char *description, uint64_t code);
+
+/* Marks the operation as done, or as skipped if skipped is set */
+void report_op_finish(struct report_op *op, int skipped);
+
+#endif
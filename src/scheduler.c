@@ -0,0 +1,425 @@
+/*
+ * scheduler.c
+ * Job scheduler with per-device queues and concurrency limits
+ *
+ * Copyright (C) 2026 ideviceinstaller contributors
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+
+#include <libimobiledevice-glue/thread.h>
+
+#include "scheduler.h"
+#include "utils.h"
+
+struct device_queue {
+	char *device;
+	struct sched_job *jobs;
+	uint64_t *groups;
+	unsigned int num_groups;
+	cond_t cond;
+	unsigned int num_workers;
+	THREAD_T *workers;
+	struct device_queue *next;
+};
+
+struct scheduler {
+	struct scheduler_options opts;
+	mutex_t lock;
+	cond_t done_cond;
+	cond_t upload_cond;
+	unsigned int uploads_free;
+	unsigned int pending;
+	unsigned int workers;
+	unsigned int idle_workers;    /* workers that found nothing to do since work_seq changed */
+	uint64_t work_seq;
+	uint64_t seq;
+	int quit;
+	struct sched_stats stats;
+	struct device_queue *queues;
+	struct sched_job *pool;
+};
+
+struct worker_args {
+	scheduler_t sched;
+	struct device_queue *queue;
+};
+
+static int job_before(const struct sched_job *a, const struct sched_job *b)
+{
+	if (a->priority != b->priority) {
+		return a->priority > b->priority;
+	}
+	if (a->size != b->size) {
+		return a->size < b->size;
+	}
+	return a->seq < b->seq;
+}
+
+static void job_insert(struct sched_job **list, struct sched_job *job)
+{
+	while (*list && job_before(*list, job)) {
+		list = &(*list)->next;
+	}
+	job->next = *list;
+	*list = job;
+}
+
+static int queue_has_group(struct device_queue *queue, uint64_t group)
+{
+	unsigned int i;
+	for (i = 0; i < queue->num_groups; i++) {
+		if (queue->groups[i] == group) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Takes the first pool job the device may run. Called with sched->lock held. */
+static struct sched_job* pool_take(scheduler_t sched, struct device_queue *queue, void *worker_data)
+{
+	struct sched_job **pos;
+
+	for (pos = &sched->pool; *pos; pos = &(*pos)->next) {
+		struct sched_job *job = *pos;
+		if (job->group && queue_has_group(queue, job->group)) {
+			continue;
+		}
+		if (sched->opts.match && !sched->opts.match(job, queue->device, worker_data, sched->opts.user_data)) {
+			continue;
+		}
+		*pos = job->next;
+		job->next = NULL;
+		job->device = strdup(queue->device);
+		if (job->group) {
+			uint64_t *groups = (uint64_t*)realloc(queue->groups, (queue->num_groups + 1) * sizeof(uint64_t));
+			if (groups) {
+				queue->groups = groups;
+				queue->groups[queue->num_groups++] = job->group;
+			}
+		}
+		return job;
+	}
+	return NULL;
+}
+
+static void* worker_thread(void *arg)
+{
+	struct worker_args *args = (struct worker_args*)arg;
+	scheduler_t sched = args->sched;
+	struct device_queue *queue = args->queue;
+	void *worker_data = NULL;
+	uint64_t idle_seq = UINT64_MAX;
+
+	free(args);
+
+	if (sched->opts.worker_init) {
+		worker_data = sched->opts.worker_init(queue->device, sched->opts.user_data);
+	}
+
+	mutex_lock(&sched->lock);
+	while (1) {
+		struct sched_job *job = NULL;
+		while (1) {
+			if (queue->jobs) {
+				job = queue->jobs;
+				queue->jobs = job->next;
+				job->next = NULL;
+				break;
+			}
+			job = pool_take(sched, queue, worker_data);
+			if (job || sched->quit) {
+				break;
+			}
+			if (idle_seq != sched->work_seq) {
+				idle_seq = sched->work_seq;
+				sched->idle_workers++;
+				cond_signal(&sched->done_cond);
+			}
+			cond_wait(&queue->cond, &sched->lock);
+		}
+		if (!job) {
+			break;
+		}
+		mutex_unlock(&sched->lock);
+
+		job->start_time = time_now_us();
+		job->result = sched->opts.run(job, worker_data, sched->opts.user_data);
+		job->end_time = time_now_us();
+
+		mutex_lock(&sched->lock);
+		uint64_t wait = job->start_time - job->enqueue_time;
+		uint64_t service = job->end_time - job->start_time;
+		sched->stats.completed++;
+		if (job->result != 0) {
+			sched->stats.failed++;
+		}
+		sched->stats.wait_total += wait;
+		if (wait > sched->stats.wait_max) {
+			sched->stats.wait_max = wait;
+		}
+		sched->stats.service_total += service;
+		if (service > sched->stats.service_max) {
+			sched->stats.service_max = service;
+		}
+		mutex_unlock(&sched->lock);
+
+		if (sched->opts.done) {
+			sched->opts.done(job, sched->opts.user_data);
+		}
+
+		mutex_lock(&sched->lock);
+		sched->pending--;
+		cond_signal(&sched->done_cond);
+	}
+	sched->workers--;
+	if (idle_seq == sched->work_seq) {
+		sched->idle_workers--;
+	}
+	cond_signal(&sched->done_cond);
+	mutex_unlock(&sched->lock);
+
+	if (sched->opts.worker_free) {
+		sched->opts.worker_free(worker_data, sched->opts.user_data);
+	}
+
+	return NULL;
+}
+
+/* must be called with sched->lock held */
+static struct device_queue* scheduler_get_queue(scheduler_t sched, const char *device)
+{
+	struct device_queue *queue;
+	unsigned int i;
+
+	for (queue = sched->queues; queue; queue = queue->next) {
+		if (!strcmp(queue->device, device)) {
+			return queue;
+		}
+	}
+
+	queue = (struct device_queue*)calloc(1, sizeof(struct device_queue));
+	if (!queue) {
+		return NULL;
+	}
+	queue->device = strdup(device);
+	cond_init(&queue->cond);
+	queue->workers = (THREAD_T*)calloc(sched->opts.device_workers, sizeof(THREAD_T));
+	for (i = 0; i < sched->opts.device_workers; i++) {
+		struct worker_args *args = (struct worker_args*)malloc(sizeof(struct worker_args));
+		args->sched = sched;
+		args->queue = queue;
+		if (thread_new(&queue->workers[queue->num_workers], worker_thread, args) != 0) {
+			free(args);
+			continue;
+		}
+		queue->num_workers++;
+		sched->workers++;
+	}
+	if (queue->num_workers == 0) {
+		cond_destroy(&queue->cond);
+		free(queue->workers);
+		free(queue->device);
+		free(queue);
+		return NULL;
+	}
+	queue->next = sched->queues;
+	sched->queues = queue;
+
+	return queue;
+}
+
+/* Wakes up one worker of every device so idle workers check the pool.
+ * Must be called with sched->lock held. */
+static void scheduler_wake_all(scheduler_t sched)
+{
+	struct device_queue *queue;
+	unsigned int i;
+
+	for (queue = sched->queues; queue; queue = queue->next) {
+		for (i = 0; i < queue->num_workers; i++) {
+			cond_signal(&queue->cond);
+		}
+	}
+}
+
+scheduler_t scheduler_new(const struct scheduler_options *options)
+{
+	if (!options || !options->run) {
+		return NULL;
+	}
+	scheduler_t sched = (scheduler_t)calloc(1, sizeof(struct scheduler));
+	if (!sched) {
+		return NULL;
+	}
+	sched->opts = *options;
+	if (sched->opts.device_workers == 0) {
+		sched->opts.device_workers = 1;
+	}
+	sched->uploads_free = sched->opts.upload_slots;
+	mutex_init(&sched->lock);
+	cond_init(&sched->done_cond);
+	cond_init(&sched->upload_cond);
+
+	return sched;
+}
+
+void scheduler_free(scheduler_t sched)
+{
+	struct device_queue *queue;
+	unsigned int i;
+
+	if (!sched) {
+		return;
+	}
+
+	mutex_lock(&sched->lock);
+	sched->quit = 1;
+	scheduler_wake_all(sched);
+	mutex_unlock(&sched->lock);
+
+	while (sched->queues) {
+		queue = sched->queues;
+		sched->queues = queue->next;
+		for (i = 0; i < queue->num_workers; i++) {
+			mutex_lock(&sched->lock);
+			cond_signal(&queue->cond);
+			mutex_unlock(&sched->lock);
+			thread_join(queue->workers[i]);
+			thread_free(queue->workers[i]);
+		}
+		cond_destroy(&queue->cond);
+		free(queue->groups);
+		free(queue->workers);
+		free(queue->device);
+		free(queue);
+	}
+
+	cond_destroy(&sched->upload_cond);
+	cond_destroy(&sched->done_cond);
+	mutex_destroy(&sched->lock);
+	free(sched);
+}
+
+int scheduler_add_device(scheduler_t sched, const char *device)
+{
+	if (!sched || !device) {
+		return -1;
+	}
+	mutex_lock(&sched->lock);
+	struct device_queue *queue = scheduler_get_queue(sched, device);
+	mutex_unlock(&sched->lock);
+
+	return (queue) ? 0 : -1;
+}
+
+int scheduler_submit(scheduler_t sched, struct sched_job *job)
+{
+	if (!sched || !job) {
+		return -1;
+	}
+
+	mutex_lock(&sched->lock);
+	job->seq = sched->seq++;
+	job->enqueue_time = time_now_us();
+	sched->work_seq++;
+	sched->idle_workers = 0;
+	if (job->device) {
+		struct device_queue *queue = scheduler_get_queue(sched, job->device);
+		if (!queue) {
+			mutex_unlock(&sched->lock);
+			return -1;
+		}
+		job_insert(&queue->jobs, job);
+		cond_signal(&queue->cond);
+	} else {
+		job_insert(&sched->pool, job);
+		scheduler_wake_all(sched);
+	}
+	sched->pending++;
+	mutex_unlock(&sched->lock);
+
+	return 0;
+}
+
+void scheduler_wait(scheduler_t sched)
+{
+	mutex_lock(&sched->lock);
+	while (sched->pending > 0) {
+		/* all workers are idle and did not take the remaining pool jobs */
+		if (sched->pool && sched->idle_workers == sched->workers) {
+			struct sched_job *jobs = sched->pool;
+			sched->pool = NULL;
+			while (jobs) {
+				struct sched_job *job = jobs;
+				jobs = job->next;
+				job->next = NULL;
+				job->result = -1;
+				job->start_time = job->end_time = time_now_us();
+				sched->stats.unmatched++;
+				sched->stats.failed++;
+				sched->pending--;
+				if (sched->opts.done) {
+					mutex_unlock(&sched->lock);
+					sched->opts.done(job, sched->opts.user_data);
+					mutex_lock(&sched->lock);
+				}
+			}
+			continue;
+		}
+		cond_wait_timeout(&sched->done_cond, &sched->lock, 500);
+	}
+	mutex_unlock(&sched->lock);
+}
+
+void scheduler_upload_acquire(scheduler_t sched)
+{
+	if (sched->opts.upload_slots == 0) {
+		return;
+	}
+	mutex_lock(&sched->lock);
+	while (sched->uploads_free == 0) {
+		cond_wait(&sched->upload_cond, &sched->lock);
+	}
+	sched->uploads_free--;
+	mutex_unlock(&sched->lock);
+}
+
+void scheduler_upload_release(scheduler_t sched)
+{
+	if (sched->opts.upload_slots == 0) {
+		return;
+	}
+	mutex_lock(&sched->lock);
+	sched->uploads_free++;
+	cond_signal(&sched->upload_cond);
+	mutex_unlock(&sched->lock);
+}
+
+void scheduler_get_stats(scheduler_t sched, struct sched_stats *stats)
+{
+	mutex_lock(&sched->lock);
+	*stats = sched->stats;
+	mutex_unlock(&sched->lock);
+}
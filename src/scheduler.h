@@ -0,0 +1,110 @@
+/*
+ * scheduler.h
+ * Job scheduler with per-device queues and concurrency limits
+ *
+ * Copyright (C) 2026 ideviceinstaller contributors
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifndef __SCHEDULER_H
+#define __SCHEDULER_H
+
+#include <stdint.h>
+
+struct sched_job {
+	char *device;           /* UDID of the device the job is queued for, or
+	                           NULL to let any matching device take it; set
+	                           to the device that ran the job once taken */
+	uint64_t group;         /* a device takes at most one pool job of the
+	                           same non-zero group */
+	int priority;           /* higher priorities are run first */
+	uint64_t size;          /* estimated amount of work, e.g. package size */
+	uint64_t enqueue_time;  /* time_now_us() when the job was submitted */
+	uint64_t start_time;    /* time_now_us() when a worker picked it up */
+	uint64_t end_time;      /* time_now_us() when the job finished */
+	int result;             /* return value of the job function */
+	void *data;             /* caller data */
+	/* private */
+	uint64_t seq;
+	struct sched_job *next;
+};
+
+struct sched_stats {
+	unsigned int completed;
+	unsigned int failed;
+	unsigned int unmatched;
+	uint64_t wait_total;
+	uint64_t wait_max;
+	uint64_t service_total;
+	uint64_t service_max;
+};
+
+typedef struct scheduler *scheduler_t;
+
+/* Called in a worker thread to run a job. worker_data is the value returned
+ * by worker_init for this worker. Returns 0 on success. */
+typedef int (*sched_run_cb_t)(struct sched_job *job, void *worker_data, void *user_data);
+
+/* Called once per worker thread before the first job is run. */
+typedef void* (*sched_worker_init_cb_t)(const char *device, void *user_data);
+
+/* Called when a worker thread exits. */
+typedef void (*sched_worker_free_cb_t)(void *worker_data, void *user_data);
+
+/* Called with the scheduler lock held to check if the worker for the
+ * given device may take a job from the pool. Must not block. */
+typedef int (*sched_match_cb_t)(struct sched_job *job, const char *device, void *worker_data, void *user_data);
+
+/* Called after a job has finished; the job is not referenced by the
+ * scheduler anymore and can be freed. */
+typedef void (*sched_done_cb_t)(struct sched_job *job, void *user_data);
+
+struct scheduler_options {
+	unsigned int device_workers;  /* concurrent jobs per device */
+	unsigned int upload_slots;    /* concurrent uploads for all devices, 0 for no limit */
+	sched_run_cb_t run;
+	sched_worker_init_cb_t worker_init;
+	sched_worker_free_cb_t worker_free;
+	sched_match_cb_t match;       /* NULL lets any device take pool jobs */
+	sched_done_cb_t done;
+	void *user_data;
+};
+
+scheduler_t scheduler_new(const struct scheduler_options *options);
+void scheduler_free(scheduler_t sched);
+
+/* Start the workers for a device so it takes jobs from the pool. */
+int scheduler_add_device(scheduler_t sched, const char *device);
+
+/* Queue a job for job->device, or in the shared pool if job->device is
+ * NULL. Jobs are ordered by priority, then by size (shortest first), then
+ * by submission order. Idle workers take pool jobs when their own device
+ * queue is empty. */
+int scheduler_submit(scheduler_t sched, struct sched_job *job);
+
+/* Block until all submitted jobs have finished. Pool jobs that no idle
+ * device can take are finished with result -1 and device NULL. */
+void scheduler_wait(scheduler_t sched);
+
+/* Limit the number of concurrent uploads across all devices. */
+void scheduler_upload_acquire(scheduler_t sched);
+void scheduler_upload_release(scheduler_t sched);
+
+void scheduler_get_stats(scheduler_t sched, struct sched_stats *stats);
+
+#endif
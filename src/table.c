@@ -0,0 +1,431 @@
+/*
+ * table.c
+ * Sorted, grouped and truncated app listings
+ *
+ *
+ * Copyright (C) 2026 ideviceinstaller contributors
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <inttypes.h>
+
+#include "table.h"
+#include "utils.h"
+
+enum table_value_type {
+	VALUE_MISSING = 0,
+	VALUE_NUMBER,
+	VALUE_STRING
+};
+
+#define GROUP_BUCKETS 64
+
+struct table_group {
+	char *value;             /* NULL for apps without the group attribute */
+	uint32_t *heap;          /* rows, the one sorting last at the root */
+	uint32_t count;
+	uint32_t capacity;
+	struct table_group *next_in_bucket;
+	struct table_group *next;
+};
+
+struct app_table {
+	char *sort_key;
+	int descending;
+	char *group_key;
+	uint32_t limit;
+
+	/* columns, indexed by row */
+	uint8_t *types;
+	uint64_t *numbers;
+	char **strings;
+	uint64_t *seqs;
+	plist_t *records;
+	uint32_t num_rows;
+	uint32_t capacity;
+
+	/* rows evicted from a full group, reused before growing */
+	uint32_t *free_rows;
+	uint32_t num_free;
+	uint64_t next_seq;
+
+	struct table_group *buckets[GROUP_BUCKETS];
+	struct table_group *null_group;
+	struct table_group *groups;
+	uint32_t num_groups;
+};
+
+struct app_table* app_table_new(const char *sort_key, int descending, const char *group_key, uint32_t limit)
+{
+	struct app_table *table = calloc(1, sizeof(struct app_table));
+	if (!table) {
+		return NULL;
+	}
+	table->sort_key = (sort_key) ? strdup(sort_key) : NULL;
+	table->descending = descending;
+	table->group_key = (group_key) ? strdup(group_key) : NULL;
+	table->limit = limit;
+	return table;
+}
+
+static int table_grow(struct app_table *table)
+{
+	uint32_t capacity = (table->capacity) ? table->capacity * 2 : 64;
+	void *p;
+
+#define GROW_COLUMN(column) \
+	p = realloc(table->column, capacity * sizeof(*table->column)); \
+	if (!p) { \
+		return -1; \
+	} \
+	table->column = p;
+
+	GROW_COLUMN(types)
+	GROW_COLUMN(numbers)
+	GROW_COLUMN(strings)
+	GROW_COLUMN(seqs)
+	GROW_COLUMN(records)
+	GROW_COLUMN(free_rows)
+#undef GROW_COLUMN
+
+	table->capacity = capacity;
+	return 0;
+}
+
+static int row_alloc(struct app_table *table, uint32_t *row)
+{
+	if (table->num_free > 0) {
+		*row = table->free_rows[--table->num_free];
+		return 0;
+	}
+	if (table->num_rows == table->capacity && table_grow(table) < 0) {
+		return -1;
+	}
+	*row = table->num_rows++;
+	return 0;
+}
+
+static void row_release(struct app_table *table, uint32_t row)
+{
+	plist_free(table->records[row]);
+	table->records[row] = NULL;
+	free(table->strings[row]);
+	table->strings[row] = NULL;
+	table->free_rows[table->num_free++] = row;
+}
+
+static int string_compare(const char *a, const char *b)
+{
+	if (isdigit((unsigned char)*a) && isdigit((unsigned char)*b)) {
+		int cmp = version_compare(a, b);
+		if (cmp != 0) {
+			return cmp;
+		}
+	}
+	return strcmp(a, b);
+}
+
+/* Returns <0 if row a sorts before row b, >0 otherwise */
+static int row_compare(const struct app_table *table, uint32_t a, uint32_t b)
+{
+	int cmp = 0;
+
+	if (table->types[a] != table->types[b]) {
+		if (table->types[a] == VALUE_MISSING) {
+			return 1;
+		}
+		if (table->types[b] == VALUE_MISSING) {
+			return -1;
+		}
+		cmp = (table->types[a] < table->types[b]) ? -1 : 1;
+	} else if (table->types[a] == VALUE_NUMBER) {
+		cmp = (table->numbers[a] < table->numbers[b]) ? -1 : (table->numbers[a] > table->numbers[b]);
+	} else if (table->types[a] == VALUE_STRING) {
+		cmp = string_compare(table->strings[a], table->strings[b]);
+	}
+	if (table->descending) {
+		cmp = -cmp;
+	}
+	if (cmp == 0) {
+		cmp = (table->seqs[a] < table->seqs[b]) ? -1 : 1;
+	}
+	return cmp;
+}
+
+static void heap_sift_up(const struct app_table *table, uint32_t *heap, uint32_t i)
+{
+	while (i > 0) {
+		uint32_t parent = (i - 1) / 2;
+		if (row_compare(table, heap[i], heap[parent]) <= 0) {
+			break;
+		}
+		uint32_t tmp = heap[i];
+		heap[i] = heap[parent];
+		heap[parent] = tmp;
+		i = parent;
+	}
+}
+
+static void heap_sift_down(const struct app_table *table, uint32_t *heap, uint32_t count, uint32_t i)
+{
+	while (1) {
+		uint32_t largest = i;
+		uint32_t left = 2 * i + 1;
+		uint32_t right = left + 1;
+		if (left < count && row_compare(table, heap[left], heap[largest]) > 0) {
+			largest = left;
+		}
+		if (right < count && row_compare(table, heap[right], heap[largest]) > 0) {
+			largest = right;
+		}
+		if (largest == i) {
+			break;
+		}
+		uint32_t tmp = heap[i];
+		heap[i] = heap[largest];
+		heap[largest] = tmp;
+		i = largest;
+	}
+}
+
+static struct table_group* group_get(struct app_table *table, const char *value)
+{
+	struct table_group *group = NULL;
+	uint32_t bucket = 0;
+	const char *p;
+
+	if (value) {
+		uint32_t hash = 2166136261U;
+		for (p = value; *p; p++) {
+			hash = (hash ^ (unsigned char)*p) * 16777619U;
+		}
+		bucket = hash % GROUP_BUCKETS;
+		for (group = table->buckets[bucket]; group; group = group->next_in_bucket) {
+			if (!strcmp(group->value, value)) {
+				return group;
+			}
+		}
+	} else if (table->null_group) {
+		return table->null_group;
+	}
+
+	group = calloc(1, sizeof(struct table_group));
+	if (!group) {
+		return NULL;
+	}
+	if (value) {
+		group->value = strdup(value);
+		group->next_in_bucket = table->buckets[bucket];
+		table->buckets[bucket] = group;
+	} else {
+		table->null_group = group;
+	}
+	group->next = table->groups;
+	table->groups = group;
+	table->num_groups++;
+
+	return group;
+}
+
+static int group_push(struct app_table *table, struct table_group *group, uint32_t row)
+{
+	if (group->count == group->capacity) {
+		uint32_t capacity = (group->capacity) ? group->capacity * 2 : 16;
+		if (table->limit && capacity > table->limit) {
+			capacity = table->limit;
+		}
+		uint32_t *heap = realloc(group->heap, capacity * sizeof(uint32_t));
+		if (!heap) {
+			return -1;
+		}
+		group->heap = heap;
+		group->capacity = capacity;
+	}
+	group->heap[group->count] = row;
+	heap_sift_up(table, group->heap, group->count);
+	group->count++;
+	return 0;
+}
+
+void app_table_add(struct app_table *table, plist_t app)
+{
+	struct table_group *group = NULL;
+	const char *group_value = NULL;
+	char numbuf[32];
+	uint32_t row;
+	plist_t node;
+
+	if (!table || row_alloc(table, &row) < 0) {
+		plist_free(app);
+		return;
+	}
+
+	table->records[row] = app;
+	table->seqs[row] = table->next_seq++;
+	table->types[row] = VALUE_MISSING;
+	table->numbers[row] = 0;
+	table->strings[row] = NULL;
+	node = (table->sort_key) ? plist_dict_get_item(app, table->sort_key) : NULL;
+	switch (plist_get_node_type(node)) {
+		case PLIST_INT:
+			table->types[row] = VALUE_NUMBER;
+			plist_get_uint_val(node, &table->numbers[row]);
+			break;
+		case PLIST_BOOLEAN:
+			table->types[row] = VALUE_NUMBER;
+			table->numbers[row] = plist_bool_val_is_true(node);
+			break;
+		case PLIST_STRING:
+			table->types[row] = VALUE_STRING;
+			table->strings[row] = strdup(plist_get_string_ptr(node, NULL));
+			break;
+		default:
+			break;
+	}
+
+	node = (table->group_key) ? plist_dict_get_item(app, table->group_key) : NULL;
+	switch (plist_get_node_type(node)) {
+		case PLIST_INT:
+			{
+				uint64_t uval = 0;
+				plist_get_uint_val(node, &uval);
+				snprintf(numbuf, sizeof(numbuf), "%" PRIu64, uval);
+				group_value = numbuf;
+			}
+			break;
+		case PLIST_BOOLEAN:
+			group_value = plist_bool_val_is_true(node) ? "true" : "false";
+			break;
+		case PLIST_STRING:
+			group_value = plist_get_string_ptr(node, NULL);
+			break;
+		default:
+			break;
+	}
+	group = group_get(table, group_value);
+	if (!group) {
+		row_release(table, row);
+		return;
+	}
+
+	if (!table->limit || group->count < table->limit) {
+		if (group_push(table, group, row) < 0) {
+			row_release(table, row);
+		}
+	} else if (row_compare(table, row, group->heap[0]) < 0) {
+		/* replaces the row sorting last among the kept ones */
+		row_release(table, group->heap[0]);
+		group->heap[0] = row;
+		heap_sift_down(table, group->heap, group->count, 0);
+	} else {
+		row_release(table, row);
+	}
+}
+
+static int group_compare(const void *a, const void *b)
+{
+	const struct table_group *ga = *(struct table_group* const*)a;
+	const struct table_group *gb = *(struct table_group* const*)b;
+
+	if (!ga->value || !gb->value) {
+		/* apps without the group attribute come last */
+		return (ga->value) ? -1 : ((gb->value) ? 1 : 0);
+	}
+	return string_compare(ga->value, gb->value);
+}
+
+void app_table_foreach_group(struct app_table *table, app_table_group_cb_t cb, void *user_data)
+{
+	struct table_group **groups = NULL;
+	struct table_group *group = NULL;
+	plist_t *rows = NULL;
+	uint32_t i = 0;
+	uint32_t n;
+
+	if (!table || table->num_groups == 0) {
+		return;
+	}
+	groups = malloc(table->num_groups * sizeof(struct table_group*));
+	if (!groups) {
+		return;
+	}
+	for (group = table->groups; group; group = group->next) {
+		groups[i++] = group;
+	}
+	qsort(groups, table->num_groups, sizeof(struct table_group*), group_compare);
+
+	for (i = 0; i < table->num_groups; i++) {
+		group = groups[i];
+		/* heap sort, leaving the rows in ascending order */
+		for (n = group->count; n > 1; n--) {
+			uint32_t tmp = group->heap[0];
+			group->heap[0] = group->heap[n - 1];
+			group->heap[n - 1] = tmp;
+			heap_sift_down(table, group->heap, n - 1, 0);
+		}
+		plist_t *p = realloc(rows, (group->count ? group->count : 1) * sizeof(plist_t));
+		if (!p) {
+			break;
+		}
+		rows = p;
+		for (n = 0; n < group->count; n++) {
+			rows[n] = table->records[group->heap[n]];
+		}
+		cb(group->value, rows, group->count, user_data);
+	}
+
+	free(rows);
+	free(groups);
+}
+
+void app_table_free(struct app_table *table)
+{
+	struct table_group *group = NULL;
+	uint32_t i;
+
+	if (!table) {
+		return;
+	}
+	for (i = 0; i < table->num_rows; i++) {
+		plist_free(table->records[i]);
+		free(table->strings[i]);
+	}
+	while (table->groups) {
+		group = table->groups;
+		table->groups = group->next;
+		free(group->value);
+		free(group->heap);
+		free(group);
+	}
+	free(table->types);
+	free(table->numbers);
+	free(table->strings);
+	free(table->seqs);
+	free(table->records);
+	free(table->free_rows);
+	free(table->sort_key);
+	free(table->group_key);
+	free(table);
+}
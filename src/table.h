@@ -0,0 +1,57 @@
+/*
+ * table.h
+ * Sorted, grouped and truncated app listings
+ *
+ *
+ * Copyright (C) 2026 ideviceinstaller contributors
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifndef __TABLE_H
+#define __TABLE_H
+
+#include <stdint.h>
+#include <plist/plist.h>
+
+/* Collects app records and returns them ordered by the value of one
+ * attribute, optionally grouped by another one. The sort values are kept in
+ * typed column arrays next to the records. With a limit only the first
+ * limit rows of every group are kept while adding, using a bounded heap, so
+ * the memory used does not grow with the number of apps. */
+struct app_table;
+
+typedef void (*app_table_group_cb_t)(const char *group, plist_t *rows, uint32_t num_rows, void *user_data);
+
+/* Creates a table sorted by sort_key (in insertion order if NULL), in
+ * descending order if descending is set, grouped by group_key (not grouped
+ * if NULL) and keeping at most limit rows per group (all if 0). Apps
+ * without the sort attribute are sorted last. */
+struct app_table* app_table_new(const char *sort_key, int descending, const char *group_key, uint32_t limit);
+
+/* Adds app to the table, which takes ownership of it. */
+void app_table_add(struct app_table *table, plist_t app);
+
+/* Calls cb for every group in order of the group values with the rows of
+ * the group in sort order. Apps without the group attribute form the last
+ * group, passed as NULL, as does the only group of a table without
+ * group_key. No apps can be added afterwards. */
+void app_table_foreach_group(struct app_table *table, app_table_group_cb_t cb, void *user_data);
+
+void app_table_free(struct app_table *table);
+
+#endif
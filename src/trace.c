@@ -0,0 +1,292 @@
+/*
+ * trace.c
+ * Phase tracing in Chrome trace-event format
+ *
+ *
+ * Copyright (C) 2026 ideviceinstaller contributors
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include <libimobiledevice-glue/thread.h>
+
+#include "trace.h"
+#include "json.h"
+#include "utils.h"
+
+struct trace_event {
+	char ph;
+	const char *cat;
+	char *name;
+	char *detail;
+	uint64_t ts;
+	uint64_t dur;
+	int64_t bytes;
+	uint32_t lane;
+};
+
+#ifdef WIN32
+typedef DWORD trace_thread_t;
+#define trace_thread_self() GetCurrentThreadId()
+#define trace_thread_equal(a, b) ((a) == (b))
+#else
+typedef pthread_t trace_thread_t;
+#define trace_thread_self() pthread_self()
+#define trace_thread_equal(a, b) pthread_equal(a, b)
+#endif
+
+#define MAX_SINKS 4
+
+static volatile int trace_enabled = 0;
+static char *trace_path = NULL;
+static uint64_t trace_epoch = 0;
+static thread_once_t trace_once = THREAD_ONCE_INIT;
+static mutex_t trace_lock;
+static trace_sink_t sinks[MAX_SINKS];
+static int num_sinks = 0;
+static struct trace_event *events = NULL;
+static uint32_t num_events = 0;
+static uint32_t max_events = 0;
+static trace_thread_t *lanes = NULL;
+static uint32_t num_lanes = 0;
+
+/* must be called with trace_lock held */
+static uint32_t trace_lane(void)
+{
+	trace_thread_t self = trace_thread_self();
+	uint32_t i;
+
+	for (i = 0; i < num_lanes; i++) {
+		if (trace_thread_equal(lanes[i], self)) {
+			return i + 1;
+		}
+	}
+	trace_thread_t *new_lanes = (trace_thread_t*)realloc(lanes, (num_lanes + 1) * sizeof(trace_thread_t));
+	if (!new_lanes) {
+		return 0;
+	}
+	lanes = new_lanes;
+	lanes[num_lanes++] = self;
+	return num_lanes;
+}
+
+/* must be called with trace_lock held */
+static struct trace_event* trace_event_new(char ph, const char *cat, const char *name, const char *detail)
+{
+	if (num_events == max_events) {
+		uint32_t new_max = (max_events) ? max_events * 2 : 1024;
+		struct trace_event *new_events = (struct trace_event*)realloc(events, new_max * sizeof(struct trace_event));
+		if (!new_events) {
+			return NULL;
+		}
+		events = new_events;
+		max_events = new_max;
+	}
+	struct trace_event *ev = &events[num_events++];
+	memset(ev, '\0', sizeof(struct trace_event));
+	ev->ph = ph;
+	ev->cat = cat;
+	ev->name = strdup(name);
+	ev->detail = (detail) ? strdup(detail) : NULL;
+	ev->bytes = -1;
+	ev->lane = trace_lane();
+	return ev;
+}
+
+static void trace_init(void)
+{
+	mutex_init(&trace_lock);
+	trace_epoch = time_now_us();
+}
+
+int trace_open(const char *path)
+{
+	thread_once(&trace_once, trace_init);
+	if (trace_path || output_file_check(path) < 0) {
+		return -1;
+	}
+
+	mutex_lock(&trace_lock);
+	trace_path = strdup(path);
+	trace_enabled = 1;
+	mutex_unlock(&trace_lock);
+
+	return 0;
+}
+
+int trace_add_sink(trace_sink_t sink)
+{
+	int res = -1;
+
+	thread_once(&trace_once, trace_init);
+	mutex_lock(&trace_lock);
+	if (num_sinks < MAX_SINKS) {
+		sinks[num_sinks++] = sink;
+		trace_enabled = 1;
+		res = 0;
+	}
+	mutex_unlock(&trace_lock);
+
+	return res;
+}
+
+uint64_t trace_begin(void)
+{
+	if (!trace_enabled) {
+		return 0;
+	}
+	/* 0 means tracing is off */
+	return time_now_us() | 1;
+}
+
+void trace_end(const char *cat, const char *name, const char *detail, uint64_t start, int64_t bytes)
+{
+	uint64_t now;
+	uint64_t dur;
+	int i;
+
+	if (!trace_enabled || !start) {
+		return;
+	}
+	now = time_now_us();
+	dur = (now > start) ? now - start : 0;
+	if (trace_path) {
+		mutex_lock(&trace_lock);
+		struct trace_event *ev = trace_event_new('X', cat, name, detail);
+		if (ev) {
+			ev->ts = (start > trace_epoch) ? start - trace_epoch : 0;
+			ev->dur = dur;
+			ev->bytes = bytes;
+		}
+		mutex_unlock(&trace_lock);
+	}
+	/* sinks are only added before the work starts */
+	for (i = 0; i < num_sinks; i++) {
+		sinks[i](cat, name, detail, start, dur, bytes);
+	}
+}
+
+void trace_thread_name(const char *name)
+{
+	if (!trace_path) {
+		return;
+	}
+	mutex_lock(&trace_lock);
+	trace_event_new('M', "__metadata", "thread_name", name);
+	mutex_unlock(&trace_lock);
+}
+
+void trace_phase_next(struct trace_phase *p, const char *cat, const char *name)
+{
+	if (!trace_enabled) {
+		return;
+	}
+	if (p->name) {
+		if (name && !strcmp(p->name, name)) {
+			return;
+		}
+		trace_end(cat, p->name, NULL, p->start, -1);
+		free(p->name);
+		p->name = NULL;
+	}
+	if (name) {
+		p->name = strdup(name);
+		p->start = trace_begin();
+	}
+}
+
+int trace_close(void)
+{
+	FILE *f = NULL;
+	uint32_t i;
+	int res = 0;
+
+	if (!trace_enabled) {
+		return 0;
+	}
+	trace_enabled = 0;
+
+	mutex_lock(&trace_lock);
+	num_sinks = 0;
+	if (!trace_path) {
+		mutex_unlock(&trace_lock);
+		return 0;
+	}
+	f = output_file_open(trace_path);
+	if (f) {
+		fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", f);
+		for (i = 0; i < num_events; i++) {
+			struct trace_event *ev = &events[i];
+			fprintf(f, "%s\n{\"ph\":\"%c\",\"pid\":%d,\"tid\":%u,\"cat\":", (i > 0) ? "," : "", ev->ph, 1, ev->lane);
+			json_write_string(f, ev->cat, strlen(ev->cat));
+			fputs(",\"name\":", f);
+			json_write_string(f, ev->name, strlen(ev->name));
+			if (ev->ph == 'M') {
+				fputs(",\"args\":{\"name\":", f);
+				json_write_string(f, ev->detail, strlen(ev->detail));
+				fputs("}}", f);
+				continue;
+			}
+			fprintf(f, ",\"ts\":%" PRIu64 ",\"dur\":%" PRIu64, ev->ts, ev->dur);
+			if (ev->detail || ev->bytes >= 0) {
+				fputs(",\"args\":{", f);
+				if (ev->detail) {
+					fputs("\"detail\":", f);
+					json_write_string(f, ev->detail, strlen(ev->detail));
+				}
+				if (ev->bytes >= 0) {
+					fprintf(f, "%s\"bytes\":%" PRId64, (ev->detail) ? "," : "", ev->bytes);
+				}
+				fputc('}', f);
+			}
+			fputc('}', f);
+		}
+		fputs("\n]}\n", f);
+		res = output_file_commit(f, trace_path);
+	} else {
+		res = -1;
+	}
+
+	for (i = 0; i < num_events; i++) {
+		free(events[i].name);
+		free(events[i].detail);
+	}
+	free(events);
+	events = NULL;
+	num_events = max_events = 0;
+	free(lanes);
+	lanes = NULL;
+	num_lanes = 0;
+	free(trace_path);
+	trace_path = NULL;
+	mutex_unlock(&trace_lock);
+
+	return res;
+}
@@ -0,0 +1,75 @@
+/*
+ * trace.h
+ * Phase tracing in Chrome trace-event format
+ *
+ *
+ * Copyright (C) 2026 ideviceinstaller contributors
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <stdint.h>
+
+/* Spans recorded for --trace are kept in memory and written by
+ * trace_close() as a Chrome trace-event JSON file, which can be loaded
+ * into chrome://tracing or Perfetto. Every thread gets its own lane. The
+ * spans are also passed to any sink added with trace_add_sink(). All
+ * functions may be called from any thread and do nothing unless
+ * trace_open() was called or a sink was added. */
+
+/* Receives every span as it ends, with start and duration in
+ * microseconds. Called without any lock held. */
+typedef void (*trace_sink_t)(const char *cat, const char *name, const char *detail, uint64_t start, uint64_t dur, int64_t bytes);
+
+/* Starts recording, the events are written to path at trace_close().
+ * Returns 0 on success. */
+int trace_open(const char *path);
+
+/* Passes all following spans to sink. At most 4 sinks can be added,
+ * returns 0 on success. */
+int trace_add_sink(trace_sink_t sink);
+
+/* Writes the recorded events, if trace_open() was called, and stops
+ * recording and passing spans to the sinks. Returns 0 on success. */
+int trace_close(void);
+
+/* Returns the start time of a span, or 0 if tracing is off */
+uint64_t trace_begin(void);
+
+/* Records a span from start (as returned by trace_begin()) until now.
+ * cat must be a string literal, name and detail are copied. detail may be
+ * NULL, and bytes is only recorded if it is not negative. */
+void trace_end(const char *cat, const char *name, const char *detail, uint64_t start, int64_t bytes);
+
+/* Names the lane of the calling thread */
+void trace_thread_name(const char *name);
+
+/* A sequence of back to back spans, like the status updates of an
+ * installation_proxy command. */
+struct trace_phase {
+	char *name;
+	uint64_t start;
+};
+
+/* Ends the current phase of p, if any, and starts one named name unless
+ * name is NULL. */
+void trace_phase_next(struct trace_phase *p, const char *cat, const char *name);
+
+#endif
@@ -0,0 +1,164 @@
+/*
+ * utils.c
+ * Miscellaneous helper functions
+ *
+ * Copyright (C) 2026 ideviceinstaller contributors
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#ifdef WIN32
+#include <windows.h>
+#endif
+
+#include "utils.h"
+
+uint64_t time_now_us(void)
+{
+#ifdef WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+	if (freq.QuadPart == 0) {
+		QueryPerformanceFrequency(&freq);
+	}
+	QueryPerformanceCounter(&now);
+	return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000 + (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+int glob_match(const char *pattern, const char *str)
+{
+	const char *star = NULL;
+	const char *retry = NULL;
+
+	while (*str) {
+		if (*pattern == '*') {
+			star = pattern++;
+			retry = str;
+		} else if (*pattern == '?' || *pattern == *str) {
+			pattern++;
+			str++;
+		} else if (star) {
+			pattern = star + 1;
+			str = ++retry;
+		} else {
+			return 0;
+		}
+	}
+	while (*pattern == '*') {
+		pattern++;
+	}
+	return (*pattern == '\0');
+}
+
+int version_compare(const char *a, const char *b)
+{
+	while (*a || *b) {
+		char *end = NULL;
+		unsigned long va = strtoul(a, &end, 10);
+		a = end;
+		unsigned long vb = strtoul(b, &end, 10);
+		b = end;
+		if (va != vb) {
+			return (va < vb) ? -1 : 1;
+		}
+		while (*a && *a != '.') {
+			a++;
+		}
+		while (*b && *b != '.') {
+			b++;
+		}
+		if (*a == '.') {
+			a++;
+		}
+		if (*b == '.') {
+			b++;
+		}
+	}
+	return 0;
+}
+
+static char* output_file_tmpname(const char *path)
+{
+	char *tmp = (char*)malloc(strlen(path) + 5);
+	if (tmp) {
+		strcpy(tmp, path);
+		strcat(tmp, ".tmp");
+	}
+	return tmp;
+}
+
+int output_file_check(const char *path)
+{
+	FILE *f = output_file_open(path);
+	char *tmp;
+
+	if (!f) {
+		return -1;
+	}
+	fclose(f);
+	tmp = output_file_tmpname(path);
+	if (tmp) {
+		remove(tmp);
+		free(tmp);
+	}
+	return 0;
+}
+
+FILE* output_file_open(const char *path)
+{
+	char *tmp = output_file_tmpname(path);
+	FILE *f;
+
+	if (!tmp) {
+		return NULL;
+	}
+	f = fopen(tmp, "w");
+	free(tmp);
+	return f;
+}
+
+int output_file_commit(FILE *f, const char *path)
+{
+	char *tmp = output_file_tmpname(path);
+	int res = -1;
+
+	if (fclose(f) == 0 && tmp) {
+#ifdef WIN32
+		remove(path);
+#endif
+		if (rename(tmp, path) == 0) {
+			res = 0;
+		}
+	}
+	if (res < 0 && tmp) {
+		remove(tmp);
+	}
+	free(tmp);
+	return res;
+}
@@ -0,0 +1,51 @@
+/*
+ * utils.h
+ * Miscellaneous helper functions
+ *
+ * Copyright (C) 2026 ideviceinstaller contributors
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifndef __UTILS_H
+#define __UTILS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Monotonic time in microseconds, only meaningful for differences */
+uint64_t time_now_us(void);
+
+/* Matches str against a shell style pattern supporting '*' and '?'.
+ * Returns 1 on match, 0 otherwise. */
+int glob_match(const char *pattern, const char *str);
+
+/* Compares dotted version strings like "16.4.1" numerically component by
+ * component, missing components count as 0. Returns <0, 0 or >0. */
+int version_compare(const char *a, const char *b);
+
+/* Files written at exit, like the trace or the report, are written to
+ * path.tmp and renamed over path when complete, so a previous file is
+ * kept if writing fails or the program dies early.
+ * output_file_check() checks that this will work without touching path,
+ * output_file_open() opens path.tmp, and output_file_commit() closes f
+ * and renames it. Both return 0 on success, -1 otherwise. */
+int output_file_check(const char *path);
+FILE* output_file_open(const char *path);
+int output_file_commit(FILE *f, const char *path);
+
+#endif